@@ -0,0 +1,171 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023  <Wolfgang Kampichler>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/**
+ *  @file    adv.h
+ *  @author  Wolfgang Kampichler (DEC112)
+ *  @date    10-2023
+ *  @version 1.0
+ *
+ *  @brief Sensor frames carried in BLE advertisements
+ *
+ * A sensor frame holds one reading of all sensors of a puck:
+ *
+ *   offset  size  content
+ *   0       1     frame version (ADV_FRAME_VERSION)
+ *   1       1     sequence number (incremented for every new reading)
+ *   2       1     battery [%]
+ *   3       1     temperature [Cel] (signed)
+ *   4       1     state: ADV_F_MOV (movement), ADV_F_BTN (button value)
+ *   5       1     button presses (counter, wraps around)
+ *
+ * Bytes following the frame are ignored, so later versions may append
+ * fields. The frame is found in the manufacturer specific data of company
+ * ADV_COMPANY_ID or in the service data of ADV_SERVICE_UUID (16-bit UUID).
+ *
+ * An advertisement is repeated until the puck has a new reading, so frames
+ * are deduplicated by their sequence number (adv_accept()). Only a change
+ * counts; a puck that restarts with sequence number 0 is not mistaken for
+ * old data, and its press counter starting again at 0 is not taken for
+ * presses.
+ *
+ * The header depends on the C library only and can be built on a host to
+ * decode captured advertising data.
+ */
+
+#ifndef ADV_H
+#define ADV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ADV_COMPANY_ID 0x0590   /* Espruino (Puck.js) */
+#define ADV_SERVICE_UUID 0x181A /* Environmental Sensing */
+#define ADV_FRAME_VERSION 1
+#define ADV_FRAME_SIZE 6
+
+#define ADV_TYPE_SERVICE_DATA16 0x16
+#define ADV_TYPE_MANUFACTURER 0xFF
+
+#define ADV_F_MOV 0x01
+#define ADV_F_BTN 0x02
+
+/** @brief decoded sensor frame */
+typedef struct adv_frame {
+    uint8_t version;
+    uint8_t seq;
+    uint8_t bat;
+    int8_t temp;
+    uint8_t mov;
+    uint8_t btn;
+    uint8_t presses;
+} adv_frame;
+
+/** @brief deduplication state of one sensor */
+typedef struct adv_seen {
+    uint8_t seq;
+    uint8_t presses;
+    uint8_t valid;
+} adv_seen;
+
+/**
+ * @brief decodes a sensor frame
+ * @return int (1 if p holds a frame of a known version; otherwise 0)
+ */
+static inline int adv_frame_decode(const uint8_t *p, size_t len, adv_frame *f)
+{
+    if (len < ADV_FRAME_SIZE || p[0] != ADV_FRAME_VERSION) {
+        return 0;
+    }
+    f->version = p[0];
+    f->seq = p[1];
+    f->bat = p[2];
+    f->temp = (int8_t)p[3];
+    f->mov = (p[4] & ADV_F_MOV) ? 1 : 0;
+    f->btn = (p[4] & ADV_F_BTN) ? 1 : 0;
+    f->presses = p[5];
+    return 1;
+}
+
+/**
+ * @brief searches advertising data (advertisement and scan response) for a
+ *        sensor frame; malformed AD structures end the search
+ * @return int (1 if a frame was found; otherwise 0)
+ */
+static inline int adv_decode(const uint8_t *p, size_t len, adv_frame *f)
+{
+    size_t i = 0;
+
+    while (i + 1 < len && p[i] != 0) {
+        size_t n = p[i];
+        const uint8_t *d = &p[i + 2];
+
+        if (i + 1 + n > len) {
+            break;
+        }
+        /* n counts the type byte and the 16-bit company id or UUID */
+        if (n >= 3 && (p[i + 1] == ADV_TYPE_MANUFACTURER ||
+                       p[i + 1] == ADV_TYPE_SERVICE_DATA16)) {
+            uint16_t id = (uint16_t)(d[0] | (d[1] << 8));
+
+            if (((p[i + 1] == ADV_TYPE_MANUFACTURER && id == ADV_COMPANY_ID) ||
+                 (p[i + 1] == ADV_TYPE_SERVICE_DATA16 &&
+                  id == ADV_SERVICE_UUID)) &&
+                adv_frame_decode(d + 2, n - 3, f)) {
+                return 1;
+            }
+        }
+        i += n + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief checks if frame f of a sensor is new and updates the sensor's
+ *        state s; presses is set to the number of button presses since the
+ *        previous frame (0 for the first frame of a sensor)
+ * @note Every press makes the puck send a new reading, so the press counter
+ *       cannot advance by more than the sequence number. If it does, the
+ *       puck has restarted and both counters began again at 0; the presses
+ *       since the restart are taken as they are
+ * @return int (1 if f is new; 0 if it repeats the previous frame)
+ */
+static inline int adv_accept(adv_seen *s, const adv_frame *f, int *presses)
+{
+    uint8_t seqs = (uint8_t)(f->seq - s->seq);
+    uint8_t delta = (uint8_t)(f->presses - s->presses);
+
+    if (s->valid && seqs == 0) {
+        *presses = 0;
+        return 0;
+    }
+    *presses = !s->valid ? 0 : (delta <= seqs) ? delta : f->presses;
+    s->seq = f->seq;
+    s->presses = f->presses;
+    s->valid = 1;
+    return 1;
+}
+
+#endif /* ADV_H */
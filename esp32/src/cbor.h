@@ -0,0 +1,523 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023  <Wolfgang Kampichler>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/**
+ *  @file    cbor.h
+ *  @author  Wolfgang Kampichler (DEC112)
+ *  @date    10-2023
+ *  @version 1.0
+ *
+ *  @brief CBOR (RFC 8949) builder and pull decoder
+ *
+ * The builder follows the jsonb API: cborb_*() functions append one item to
+ * a buffer and fail with JSONB_ERROR_NOMEM (builder unchanged) if it does
+ * not fit, cborbs_*() functions write the items to a jsonb sink, so CBOR is
+ * streamed through the same window and write callbacks as JSON.
+ *
+ * Arrays and maps are opened with the number of items (maps: pairs) or with
+ * CBORB_INDEFINITE if it is not known when the container starts (the
+ * container is then closed with a break byte). Every container is closed
+ * with cborb_pop(); a definite one fails with JSONB_ERROR_INPUT if items
+ * are missing or if more items are added than announced.
+ *
+ * Numbers are written in their shortest exact form: integral values as
+ * integers, others as single precision float if that holds the value,
+ * otherwise as double.
+ *
+ * The decoder (cbord_next()) returns one item at a time; it supports what
+ * the builder writes (no tags, no indefinite length strings). The header
+ * depends on json.h and the C library only and can be built on a host.
+ */
+
+#ifndef CBOR_H
+#define CBOR_H
+
+#include <float.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "json.h"
+
+#define CBORB_MAX_DEPTH 8
+#define CBORB_INDEFINITE -1
+/* largest item head: initial byte and 8 byte argument */
+#define CBORB_HEAD_SIZE 9
+
+#define CBOR_UINT 0
+#define CBOR_NINT 1
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_TAG 6
+#define CBOR_SIMPLE 7
+
+#define CBOR_FALSE 0xf4
+#define CBOR_TRUE 0xf5
+#define CBOR_NULL 0xf6
+#define CBOR_FLOAT16 0xf9
+#define CBOR_FLOAT32 0xfa
+#define CBOR_FLOAT64 0xfb
+#define CBOR_BREAK 0xff
+
+/** @brief Handle for building CBOR */
+typedef struct cborb {
+    /** items left per open container (CBORB_INDEFINITE: not counted);
+     *  stack[0] is the top level */
+    int32_t stack[CBORB_MAX_DEPTH + 1];
+    /** number of open containers */
+    int depth;
+    /** offset in the buffer (current length) */
+    size_t pos;
+} cborb;
+
+/** @brief Handle for streaming CBOR to a jsonb sink */
+typedef struct cborb_sink {
+    /** builder state */
+    cborb b;
+    /** receives the items */
+    jsonb_sink *out;
+} cborb_sink;
+
+/**
+ * @brief Initialize a cborb handle
+ */
+static inline void cborb_init(cborb *b)
+{
+    memset(b, 0, sizeof(*b));
+    b->stack[0] = CBORB_INDEFINITE;
+}
+
+/* writes the head of an item (major type and argument) to p */
+static inline size_t _cborb_head(uint8_t p[CBORB_HEAD_SIZE], unsigned major,
+                                 uint64_t v)
+{
+    size_t n;
+
+    major <<= 5;
+    if (v < 24) {
+        p[0] = (uint8_t)(major | v);
+        return 1;
+    }
+    if (v <= 0xff) {
+        p[0] = (uint8_t)(major | 24);
+        n = 1;
+    } else if (v <= 0xffff) {
+        p[0] = (uint8_t)(major | 25);
+        n = 2;
+    } else if (v <= 0xffffffffULL) {
+        p[0] = (uint8_t)(major | 26);
+        n = 4;
+    } else {
+        p[0] = (uint8_t)(major | 27);
+        n = 8;
+    }
+    for (size_t i = n; i > 0; i--, v >>= 8) {
+        p[i] = (uint8_t)v;
+    }
+    return n + 1;
+}
+
+/* appends an item (head and len bytes of data) to the current container */
+static inline jsonbcode _cborb_item(cborb *b, char buf[], size_t bufsize,
+                                    const uint8_t *head, size_t n,
+                                    const char *data, size_t len)
+{
+    int32_t *left = &b->stack[b->depth];
+
+    if (*left == 0) return JSONB_ERROR_INPUT;
+    if (b->pos + n + len > bufsize) return JSONB_ERROR_NOMEM;
+    memcpy(buf + b->pos, head, n);
+    if (len) memcpy(buf + b->pos + n, data, len);
+    b->pos += n + len;
+    if (*left > 0) (*left)--;
+    return JSONB_OK;
+}
+
+/* opens an array or map of count items (pairs) */
+static inline jsonbcode _cborb_open(cborb *b, char buf[], size_t bufsize,
+                                    unsigned major, long count)
+{
+    uint8_t head[CBORB_HEAD_SIZE];
+    size_t n;
+    jsonbcode code;
+
+    if (b->depth >= CBORB_MAX_DEPTH) return JSONB_ERROR_STACK;
+    if (count < 0) {
+        head[0] = (uint8_t)((major << 5) | 31);
+        n = 1;
+    } else {
+        n = _cborb_head(head, major, (uint64_t)count);
+    }
+    if ((code = _cborb_item(b, buf, bufsize, head, n, NULL, 0)) != JSONB_OK)
+        return code;
+    b->stack[++b->depth] = (count < 0) ? CBORB_INDEFINITE
+                         : (major == CBOR_MAP) ? (int32_t)(2 * count)
+                                               : (int32_t)count;
+    return JSONB_OK;
+}
+
+/**
+ * @brief Open an array of count items (CBORB_INDEFINITE if unknown)
+ * @return @ref jsonbcode value
+ */
+static inline jsonbcode cborb_array(cborb *b, char buf[], size_t bufsize,
+                                    long count)
+{
+    return _cborb_open(b, buf, bufsize, CBOR_ARRAY, count);
+}
+
+/**
+ * @brief Open a map of count pairs (CBORB_INDEFINITE if unknown); keys and
+ *      values are added as items, alternately
+ * @return @ref jsonbcode value
+ */
+static inline jsonbcode cborb_map(cborb *b, char buf[], size_t bufsize,
+                                  long count)
+{
+    return _cborb_open(b, buf, bufsize, CBOR_MAP, count);
+}
+
+/**
+ * @brief Close the innermost array or map
+ * @return @ref jsonbcode value
+ */
+static inline jsonbcode cborb_pop(cborb *b, char buf[], size_t bufsize)
+{
+    if (b->depth == 0) return JSONB_ERROR_STACK;
+    if (b->stack[b->depth] > 0) return JSONB_ERROR_INPUT;
+    if (b->stack[b->depth] == CBORB_INDEFINITE) {
+        if (b->pos + 1 > bufsize) return JSONB_ERROR_NOMEM;
+        buf[b->pos++] = (char)CBOR_BREAK;
+    }
+    b->depth--;
+    return JSONB_OK;
+}
+
+/**
+ * @brief Push an integer (e.g. a SenML label)
+ * @return @ref jsonbcode value
+ */
+static inline jsonbcode cborb_int(cborb *b, char buf[], size_t bufsize,
+                                  int64_t value)
+{
+    uint8_t head[CBORB_HEAD_SIZE];
+    size_t n = (value < 0) ? _cborb_head(head, CBOR_NINT, ~(uint64_t)value)
+                           : _cborb_head(head, CBOR_UINT, (uint64_t)value);
+
+    return _cborb_item(b, buf, bufsize, head, n, NULL, 0);
+}
+
+/**
+ * @brief Push a number in its shortest exact form (integer, float, double)
+ * @return @ref jsonbcode value
+ */
+static inline jsonbcode cborb_number(cborb *b, char buf[], size_t bufsize,
+                                     double number)
+{
+    uint8_t head[CBORB_HEAD_SIZE];
+    size_t n;
+
+    if (number >= -9223372036854775808.0 && number < 9223372036854775808.0 &&
+        number == (double)(int64_t)number) {
+        return cborb_int(b, buf, bufsize, (int64_t)number);
+    }
+    if (number != number || number - number != 0 ||
+        (number >= -FLT_MAX && number <= FLT_MAX &&
+         (double)(float)number == number)) {
+        /* NaN, infinity or exact as float */
+        float f = (float)number;
+        uint32_t w;
+
+        memcpy(&w, &f, sizeof(w));
+        head[0] = CBOR_FLOAT32;
+        for (n = 4; n > 0; n--, w >>= 8) head[n] = (uint8_t)w;
+        n = 5;
+    } else {
+        uint64_t w;
+
+        memcpy(&w, &number, sizeof(w));
+        head[0] = CBOR_FLOAT64;
+        for (n = 8; n > 0; n--, w >>= 8) head[n] = (uint8_t)w;
+        n = 9;
+    }
+    return _cborb_item(b, buf, bufsize, head, n, NULL, 0);
+}
+
+/**
+ * @brief Push a text string (UTF-8, len bytes)
+ * @return @ref jsonbcode value
+ */
+static inline jsonbcode cborb_string(cborb *b, char buf[], size_t bufsize,
+                                     const char str[], size_t len)
+{
+    uint8_t head[CBORB_HEAD_SIZE];
+    size_t n = _cborb_head(head, CBOR_TEXT, len);
+
+    return _cborb_item(b, buf, bufsize, head, n, str, len);
+}
+
+/**
+ * @brief Push a boolean
+ * @return @ref jsonbcode value
+ */
+static inline jsonbcode cborb_bool(cborb *b, char buf[], size_t bufsize,
+                                   int boolean)
+{
+    uint8_t head = boolean ? CBOR_TRUE : CBOR_FALSE;
+
+    return _cborb_item(b, buf, bufsize, &head, 1, NULL, 0);
+}
+
+/**
+ * @brief Push null
+ * @return @ref jsonbcode value
+ */
+static inline jsonbcode cborb_null(cborb *b, char buf[], size_t bufsize)
+{
+    uint8_t head = CBOR_NULL;
+
+    return _cborb_item(b, buf, bufsize, &head, 1, NULL, 0);
+}
+
+/**
+ * @brief Initialize a cborb sink writing to the jsonb sink out (which
+ *      keeps the window, the write callback and the first error)
+ */
+static inline void cborb_sink_init(cborb_sink *cs, jsonb_sink *out)
+{
+    cborb_init(&cs->b);
+    cs->out = out;
+}
+
+/* calls a builder function on a head sized buffer and writes the result to
+ * the sink; a builder error is kept as error of the sink */
+#define CBORB_SINK_CALL(cs, call)                                             \
+    do {                                                                      \
+        char tmp[CBORB_HEAD_SIZE];                                            \
+        jsonbcode _code;                                                      \
+        if ((cs)->out->err < 0) return (cs)->out->err;                        \
+        (cs)->b.pos = 0;                                                      \
+        _code = call;                                                         \
+        if (_code < 0) return (cs)->out->err = _code;                         \
+        return jsonb_sink_put((cs)->out, tmp, (cs)->b.pos);                   \
+    } while (0)
+
+/**
+ * @brief Sink versions of the builder functions, see cborb_array() etc.
+ * @return @ref jsonbcode value
+ */
+static inline jsonbcode cborbs_array(cborb_sink *cs, long count)
+{
+    CBORB_SINK_CALL(cs, cborb_array(&cs->b, tmp, sizeof(tmp), count));
+}
+
+static inline jsonbcode cborbs_map(cborb_sink *cs, long count)
+{
+    CBORB_SINK_CALL(cs, cborb_map(&cs->b, tmp, sizeof(tmp), count));
+}
+
+static inline jsonbcode cborbs_pop(cborb_sink *cs)
+{
+    CBORB_SINK_CALL(cs, cborb_pop(&cs->b, tmp, sizeof(tmp)));
+}
+
+static inline jsonbcode cborbs_int(cborb_sink *cs, int64_t value)
+{
+    CBORB_SINK_CALL(cs, cborb_int(&cs->b, tmp, sizeof(tmp), value));
+}
+
+static inline jsonbcode cborbs_number(cborb_sink *cs, double number)
+{
+    CBORB_SINK_CALL(cs, cborb_number(&cs->b, tmp, sizeof(tmp), number));
+}
+
+static inline jsonbcode cborbs_bool(cborb_sink *cs, int boolean)
+{
+    CBORB_SINK_CALL(cs, cborb_bool(&cs->b, tmp, sizeof(tmp), boolean));
+}
+
+static inline jsonbcode cborbs_null(cborb_sink *cs)
+{
+    CBORB_SINK_CALL(cs, cborb_null(&cs->b, tmp, sizeof(tmp)));
+}
+
+/* the string follows its head without a copy into a buffer of its size */
+static inline jsonbcode cborbs_string(cborb_sink *cs, const char str[],
+                                      size_t len)
+{
+    uint8_t head[CBORB_HEAD_SIZE];
+    size_t n = _cborb_head(head, CBOR_TEXT, len);
+    char tmp[CBORB_HEAD_SIZE];
+    jsonbcode code;
+
+    if (cs->out->err < 0) return cs->out->err;
+    cs->b.pos = 0;
+    if ((code = _cborb_item(&cs->b, tmp, sizeof(tmp), head, n, NULL, 0)) < 0)
+        return cs->out->err = code;
+    if ((code = jsonb_sink_put(cs->out, tmp, n)) < 0) return code;
+    return jsonb_sink_put(cs->out, str, len);
+}
+
+/**
+ * @brief Push a string literal to a sink
+ *
+ * @param cs the sink initialized with cborb_sink_init()
+ * @param lit the string literal
+ */
+#define cborbs_string_lit(cs, lit)                                            \
+    cborbs_string((cs), "" lit "", sizeof(lit) - 1)
+
+/** @brief CBOR decoder */
+typedef struct cbord {
+    const uint8_t *p;
+    size_t len;
+    /** offset of the next item */
+    size_t pos;
+} cbord;
+
+/** @brief decoded item */
+typedef struct cbord_item {
+    /** CBOR_UINT .. CBOR_SIMPLE (integers: CBOR_UINT for both signs) */
+    unsigned major;
+    /** integer value; array, map: items (pairs), -1 if indefinite */
+    int64_t i;
+    /** value of a float (float16, float32 and float64) */
+    double d;
+    /** bytes of a string */
+    const char *str;
+    /** string length */
+    size_t len;
+    /** simple values: CBOR_FALSE, CBOR_TRUE, CBOR_NULL, CBOR_BREAK or one
+     *  of the float heads (d holds the value) */
+    uint8_t simple;
+} cbord_item;
+
+/**
+ * @brief Initialize a decoder for len bytes at p
+ */
+static inline void cbord_init(cbord *r, const void *p, size_t len)
+{
+    r->p = (const uint8_t *)p;
+    r->len = len;
+    r->pos = 0;
+}
+
+/* value of an IEEE 754 half precision float */
+static inline double _cbord_half(unsigned h)
+{
+    unsigned e = (h >> 10) & 0x1f, m = h & 0x3ff;
+    double v;
+
+    if (e == 0) {
+        v = m / 16777216.0; /* m * 2^-24 */
+    } else if (e == 31) {
+        v = m ? 0.0 / 0.0 : 1.0 / 0.0;
+    } else {
+        v = (double)(m + 1024) * (double)(1u << e) / 33554432.0; /* 2^25 */
+    }
+    return (h & 0x8000) ? -v : v;
+}
+
+/**
+ * @brief Decode the next item; containers only return their head, their
+ *      items follow as the next items
+ * @return int (1 if an item was decoded; 0 at the end of the input; -1 if
+ *      the input is malformed or not supported)
+ */
+static inline int cbord_next(cbord *r, cbord_item *it)
+{
+    const uint8_t *p = r->p + r->pos;
+    size_t left = r->len - r->pos;
+    unsigned ai;
+    uint64_t v = 0;
+    size_t n;
+
+    if (left == 0) return 0;
+    memset(it, 0, sizeof(*it));
+    it->major = p[0] >> 5;
+    ai = p[0] & 0x1f;
+    if (ai < 24) {
+        v = ai;
+        n = 0;
+    } else if (ai <= 27) {
+        n = (size_t)1 << (ai - 24);
+        if (left < 1 + n) return -1;
+        for (size_t k = 1; k <= n; k++) v = (v << 8) | p[k];
+    } else if (ai == 31 && (it->major == CBOR_ARRAY ||
+                            it->major == CBOR_MAP)) {
+        it->i = -1;
+        r->pos++;
+        return 1;
+    } else if (ai == 31 && it->major == CBOR_SIMPLE) {
+        it->simple = CBOR_BREAK;
+        r->pos++;
+        return 1;
+    } else {
+        return -1;
+    }
+    r->pos += 1 + n;
+
+    switch (it->major) {
+    case CBOR_UINT:
+    case CBOR_NINT:
+        if (v > INT64_MAX) return -1;
+        it->i = (it->major == CBOR_NINT) ? -1 - (int64_t)v : (int64_t)v;
+        it->major = CBOR_UINT;
+        return 1;
+    case CBOR_BYTES:
+    case CBOR_TEXT:
+        if (v > r->len - r->pos) return -1;
+        it->str = (const char *)r->p + r->pos;
+        it->len = (size_t)v;
+        r->pos += (size_t)v;
+        return 1;
+    case CBOR_ARRAY:
+    case CBOR_MAP:
+        if (v > INT32_MAX) return -1;
+        it->i = (int64_t)v;
+        return 1;
+    case CBOR_SIMPLE:
+        it->simple = (uint8_t)p[0];
+        if (p[0] == CBOR_FLOAT16) {
+            it->d = _cbord_half((unsigned)v);
+        } else if (p[0] == CBOR_FLOAT32) {
+            uint32_t w = (uint32_t)v;
+            float f;
+            memcpy(&f, &w, sizeof(f));
+            it->d = f;
+        } else if (p[0] == CBOR_FLOAT64) {
+            memcpy(&it->d, &v, sizeof(it->d));
+        } else if (n != 0) {
+            return -1;
+        }
+        return 1;
+    default:
+        /* tags */
+        return -1;
+    }
+}
+
+#endif /* CBOR_H */
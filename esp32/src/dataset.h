@@ -0,0 +1,245 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023  <Wolfgang Kampichler>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/**
+ *  @file    dataset.h
+ *  @author  Wolfgang Kampichler (DEC112)
+ *  @date    10-2023
+ *  @version 1.0
+ *
+ *  @brief per-device pool of datasets assembled from sensor notifications
+ *
+ * A dataset is started by the first notification of a device (ds_open())
+ * and takes the other sensors arriving within DS_WINDOW_MS (ds_index()).
+ * It is closed (DS_VALID) when it is complete (ds_update()), when a sensor
+ * repeats or when its window has passed (ds_close()); an incomplete dataset
+ * is sent as it is. A sent dataset is returned to the pool (ds_release()).
+ *
+ *   mask     0 -> sensors (DS_BAT..DS_BTN) -> DS_VALID -> DS_PACKED -> 0
+ *
+ * The pool is a bit set of the datasets in use, a free dataset is found
+ * with a count of trailing zeros. The header depends on adv.h and the C
+ * library only and can be built on a host.
+ */
+
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "adv.h"
+
+#ifndef DS_POOL_SIZE
+/* datasets per device (at most 16, bits of used) */
+#define DS_POOL_SIZE 10
+#endif
+
+#ifndef DS_WINDOW_MS
+/* notifications within this window belong to the same dataset; an
+ * incomplete dataset is closed (and sent as it is) after the window */
+#define DS_WINDOW_MS 500
+#endif
+
+/* no dataset (ds_pool.open, result of ds_open() and ds_index()) */
+#define DS_NONE -1
+
+/* sensors received of a dataset (bit 1 << sensor, same bits as SENML_*) */
+#define DS_BAT 0x01
+#define DS_TEMP 0x02
+#define DS_MOV 0x04
+#define DS_BTN 0x08
+#define DS_FULL (DS_BAT | DS_TEMP | DS_MOV | DS_BTN)
+/* closed (complete or timed out) and ready to be sent; packed for sending */
+#define DS_VALID 0x10
+#define DS_PACKED 0x20
+
+/** @brief one dataset (24 bytes); values are sized to the characteristics */
+typedef struct ds_data {
+    uint64_t tm; /* epoch [ms] */
+    uint32_t opened;
+    uint32_t ready;
+    uint16_t len;
+    int16_t temp;
+    uint8_t bat;
+    uint8_t state; /* ADV_F_MOV, ADV_F_BTN */
+    uint8_t mask;  /* DS_* sensors received, DS_VALID, DS_PACKED */
+} ds_data;
+
+/** @brief datasets of a device */
+typedef struct ds_pool {
+    int8_t open;   /* dataset being assembled (DS_NONE if none) */
+    uint16_t used; /* datasets in use (bit 1 << index) */
+    ds_data data[DS_POOL_SIZE];
+} ds_pool;
+
+/**
+ * @brief resets a dataset
+ */
+static inline void reset_data(ds_data *d)
+{
+    memset(d, 0, sizeof(*d));
+}
+
+/**
+ * @brief resets a pool (no dataset in use)
+ */
+static inline void ds_init(ds_pool *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->open = DS_NONE;
+}
+
+/**
+ * @brief checks a dataset
+ * @return int (1 if it is ready to be sent; it may be incomplete)
+ */
+static inline int check_data(const ds_data *d)
+{
+    return (d->mask & DS_VALID) && (d->mask & DS_FULL);
+}
+
+/* stores the value of a sensor unless the dataset holds it already */
+static inline void set_data_bat(ds_data *d, int val)
+{
+    if (!(d->mask & DS_BAT)) {
+        d->bat = (uint8_t)val;
+        d->mask |= DS_BAT;
+    }
+}
+
+static inline void set_data_temp(ds_data *d, int val)
+{
+    if (!(d->mask & DS_TEMP)) {
+        d->temp = (int16_t)val;
+        d->mask |= DS_TEMP;
+    }
+}
+
+static inline void set_data_mov(ds_data *d, int val)
+{
+    if (!(d->mask & DS_MOV)) {
+        d->state |= val ? ADV_F_MOV : 0;
+        d->mask |= DS_MOV;
+    }
+}
+
+static inline void set_data_btn(ds_data *d, int val)
+{
+    if (!(d->mask & DS_BTN)) {
+        d->state |= val ? ADV_F_BTN : 0;
+        d->mask |= DS_BTN;
+    }
+}
+
+/**
+ * @brief closes the dataset being assembled; from now on it is sent,
+ *        complete or not
+ */
+static inline void ds_close(ds_pool *p)
+{
+    if (p->open != DS_NONE) {
+        p->data[p->open].mask |= DS_VALID;
+        p->open = DS_NONE;
+    }
+}
+
+/**
+ * @brief starts a new dataset received at rx (ms) with timestamp tm; the
+ *        dataset being assembled is closed
+ * @return int (dataset index; DS_NONE if all datasets are in use)
+ */
+static inline int ds_open(ds_pool *p, uint32_t rx, uint64_t tm)
+{
+    uint16_t free = (uint16_t)(~p->used & ((1u << DS_POOL_SIZE) - 1));
+    ds_data *d;
+    int j;
+
+    ds_close(p);
+    if (free == 0) {
+        return DS_NONE;
+    }
+    j = __builtin_ctz(free);
+    d = &p->data[j];
+    reset_data(d);
+    d->tm = tm;
+    d->opened = rx;
+    p->used |= (uint16_t)(1u << j);
+    p->open = (int8_t)j;
+    return j;
+}
+
+/**
+ * @brief returns the dataset a value of sensor type (bit 1 << type)
+ *        received at rx (ms) belongs to: the dataset being assembled unless
+ *        it already holds this sensor or its window has passed; otherwise a
+ *        new one
+ * @return int (dataset index; DS_NONE if all datasets are in use)
+ */
+static inline int ds_index(ds_pool *p, uint8_t type, uint32_t rx, uint64_t tm)
+{
+    if (p->open != DS_NONE) {
+        const ds_data *d = &p->data[p->open];
+        if (!(d->mask & (1 << type)) && rx - d->opened < DS_WINDOW_MS) {
+            return p->open;
+        }
+    }
+    return ds_open(p, rx, tm);
+}
+
+/**
+ * @brief closes dataset j once it is complete
+ */
+static inline void ds_update(ds_pool *p, int j)
+{
+    if (j == p->open && (p->data[j].mask & DS_FULL) == DS_FULL) {
+        ds_close(p);
+    }
+}
+
+/**
+ * @brief closes the dataset being assembled if its window has passed at
+ *        now (ms)
+ */
+static inline void ds_expire_pool(ds_pool *p, uint32_t now)
+{
+    if (p->open != DS_NONE && now - p->data[p->open].opened >= DS_WINDOW_MS) {
+        ds_close(p);
+    }
+}
+
+/**
+ * @brief frees dataset j (after it has been sent)
+ */
+static inline void ds_release(ds_pool *p, int j)
+{
+    if (p->open == j) {
+        p->open = DS_NONE;
+    }
+    reset_data(&p->data[j]);
+    p->used &= (uint16_t)~(1u << j);
+}
+
+#endif /* DATASET_H */
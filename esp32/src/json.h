@@ -1,5 +1,9 @@
 /*
  * The file has been modified to support a float datatype, refer to jsonb_float
+ * and to stream its output through a fixed window, refer to jsonb_sink.
+ * Numbers are formatted without printf (shortest representation which reads
+ * back to the same double, Grisu2), refer to jsonb_number and jsonb_fixed
+ * A pull parser for responses was added, refer to jsonp
  * See: https://github.com/lcsmuller/json-build.git
  *
  */
@@ -33,6 +37,7 @@
 #define JSON_BUILD_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -66,7 +71,9 @@ typedef enum jsonbcode {
     /** token doesn't match expected value */
     JSONB_ERROR_INPUT = -2,
     /** operation would lead to out of boundaries access */
-    JSONB_ERROR_STACK = -3
+    JSONB_ERROR_STACK = -3,
+    /** sink did not take all bytes of a flush */
+    JSONB_ERROR_WRITE = -4
 } jsonbcode;
 
 /** @brief json-builder serializing state */
@@ -143,6 +150,21 @@ JSONB_API jsonbcode jsonb_object_pop(jsonb *builder,
 JSONB_API jsonbcode jsonb_key(
     jsonb *builder, char buf[], size_t bufsize, const char key[], size_t len);
 
+/**
+ * @brief Push a key which needs no escaping to the builder (a string
+ *      literal or otherwise known to be free of '"', '\\' and control
+ *      characters); it is copied as it is
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param key the key to be inserted
+ * @param len the key length
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_key_trusted(
+    jsonb *builder, char buf[], size_t bufsize, const char key[], size_t len);
+
 /**
  * @brief Push an array to the builder
  *
@@ -219,7 +241,23 @@ JSONB_API jsonbcode jsonb_string(
     jsonb *builder, char buf[], size_t bufsize, const char str[], size_t len);
 
 /**
- * @brief Push a number token to the builder
+ * @brief Push a string token which needs no escaping to the builder, see
+ *      jsonb_key_trusted()
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param str the string to be inserted
+ * @param len the string length
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_string_trusted(
+    jsonb *builder, char buf[], size_t bufsize, const char str[], size_t len);
+
+/**
+ * @brief Push a number token to the builder; integral values are written as
+ *      integers, others with the fewest digits that read back to the same
+ *      double (not finite numbers are rejected with JSONB_ERROR_INPUT)
  *
  * @param builder the builder initialized with jsonb_init()
  * @param buf the JSON buffer
@@ -233,7 +271,8 @@ JSONB_API jsonbcode jsonb_number(jsonb *builder,
                                  double number);
 
 /**
- * @brief Push a number token to the builder
+ * @brief Push a number token to the builder (as jsonb_number(), the number
+ *      is rounded to a double)
  *
  * @param builder the builder initialized with jsonb_init()
  * @param buf the JSON buffer
@@ -243,8 +282,295 @@ JSONB_API jsonbcode jsonb_number(jsonb *builder,
  */
 JSONB_API jsonbcode jsonb_float(jsonb *b, char buf[], size_t bufsize, long double number);
 
+/** @brief size of a buffer holding any number formatted by jsonb */
+#define JSONB_NUMBER_SIZE 48
+
+/**
+ * @brief Format a number as jsonb_number() does (no terminating '\0')
+ *
+ * @param token the buffer
+ * @param number the number to be formatted
+ * @return the length of the text (negative if number is not finite)
+ */
+JSONB_API long jsonb_format_number(char token[JSONB_NUMBER_SIZE],
+                                   double number);
+
+/**
+ * @brief Format a fixed point number as jsonb_fixed() does (no terminating
+ *      '\0')
+ *
+ * @param token the buffer
+ * @param value the number in units of 10^-scale
+ * @param scale the number of decimals (at most 18)
+ * @return the length of the text (negative if scale is too large)
+ */
+JSONB_API long jsonb_format_fixed(char token[JSONB_NUMBER_SIZE],
+                                  int64_t value,
+                                  unsigned scale);
+
+/**
+ * @brief Push a fixed point number token to the builder: value / 10^scale
+ *      with exactly scale decimals (e.g. a time in ms with scale 3). Integer
+ *      arithmetic only, no precision is lost
+ *
+ * @param builder the builder initialized with jsonb_init()
+ * @param buf the JSON buffer
+ * @param bufsize the JSON buffer size
+ * @param value the number in units of 10^-scale
+ * @param scale the number of decimals (at most 18)
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_fixed(
+    jsonb *b, char buf[], size_t bufsize, int64_t value, unsigned scale);
+
+/**
+ * @brief Write callback of a jsonb sink
+ *
+ * @param ctx the user data given to jsonb_sink_init()
+ * @param data the bytes to be written
+ * @param len the number of bytes
+ * @return the number of bytes taken (anything but len fails the sink)
+ */
+typedef size_t (*jsonb_write)(void *ctx, const char data[], size_t len);
+
+/**
+ * @brief Handle for streaming a JSON string through a fixed window
+ *
+ * The builder writes into the window; whenever a token does not fit, the
+ * window is handed to write() and the token is retried in the emptied
+ * window. The memory used is the window (which must hold the largest token
+ * plus 2 bytes), independent of the length of the output. Without a write
+ * callback the window is the complete output, as with the plain builder.
+ */
+typedef struct jsonb_sink {
+    /** builder state */
+    jsonb b;
+    /** the window */
+    char *buf;
+    /** the window size */
+    size_t bufsize;
+    /** receives the window when it is full (NULL if it is not flushed) */
+    jsonb_write write;
+    /** user data of write */
+    void *ctx;
+    /** number of bytes written so far */
+    size_t flushed;
+    /** first error, later calls fail with it */
+    jsonbcode err;
+} jsonb_sink;
+
+/**
+ * @brief Total length of the output of a sink (written and pending bytes)
+ *
+ * @param sink pointer to the @ref jsonb_sink handle
+ */
+#define jsonb_sink_length(sink) ((sink)->flushed + (sink)->b.pos)
+
+/**
+ * @brief Initialize a jsonb sink
+ *
+ * @param sink the handle to be initialized
+ * @param buf the window
+ * @param bufsize the window size
+ * @param write the write callback (NULL to keep the output in the window)
+ * @param ctx user data of write
+ */
+JSONB_API void jsonb_sink_init(jsonb_sink *sink,
+                               char buf[],
+                               size_t bufsize,
+                               jsonb_write write,
+                               void *ctx);
+
+/**
+ * @brief Hand the pending bytes of the window to the write callback
+ *
+ * @param sink the sink initialized with jsonb_sink_init()
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_sink_flush(jsonb_sink *sink);
+
+/**
+ * @brief Write raw bytes (e.g. a stored JSON string or pre-rendered
+ *      fragments) to the sink, the builder state is not changed; bytes which
+ *      fit into the window are collected there, larger blocks are passed to
+ *      the write callback as they are, without a copy
+ *
+ * @param sink the sink initialized with jsonb_sink_init()
+ * @param data the bytes to be written
+ * @param len the number of bytes
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonb_sink_put(jsonb_sink *sink,
+                                   const char data[],
+                                   size_t len);
+
+/**
+ * @brief Write callback which only counts (e.g. to get a Content-Length)
+ *
+ * @return len
+ */
+JSONB_API size_t jsonb_discard(void *ctx, const char data[], size_t len);
+
+/**
+ * @brief Sink versions of the builder functions, see jsonb_object() etc.
+ *      A token which does not fit flushes the window and is retried once
+ *
+ * @param sink the sink initialized with jsonb_sink_init()
+ * @return @ref jsonbcode value
+ */
+JSONB_API jsonbcode jsonbs_object(jsonb_sink *sink);
+JSONB_API jsonbcode jsonbs_object_pop(jsonb_sink *sink);
+JSONB_API jsonbcode jsonbs_key(jsonb_sink *sink, const char key[], size_t len);
+JSONB_API jsonbcode jsonbs_key_trusted(jsonb_sink *sink,
+                                       const char key[],
+                                       size_t len);
+JSONB_API jsonbcode jsonbs_array(jsonb_sink *sink);
+JSONB_API jsonbcode jsonbs_array_pop(jsonb_sink *sink);
+JSONB_API jsonbcode jsonbs_token(jsonb_sink *sink,
+                                 const char token[],
+                                 size_t len);
+JSONB_API jsonbcode jsonbs_bool(jsonb_sink *sink, int boolean);
+JSONB_API jsonbcode jsonbs_null(jsonb_sink *sink);
+JSONB_API jsonbcode jsonbs_string(jsonb_sink *sink,
+                                  const char str[],
+                                  size_t len);
+JSONB_API jsonbcode jsonbs_string_trusted(jsonb_sink *sink,
+                                          const char str[],
+                                          size_t len);
+
+/**
+ * @brief Push a string literal as key or string to a sink, without escaping
+ *      and with the length known at compile time
+ *
+ * @param sink the sink initialized with jsonb_sink_init()
+ * @param lit the string literal
+ */
+#define jsonbs_key_lit(sink, lit)                                             \
+    jsonbs_key_trusted((sink), "" lit "", sizeof(lit) - 1)
+#define jsonbs_string_lit(sink, lit)                                          \
+    jsonbs_string_trusted((sink), "" lit "", sizeof(lit) - 1)
+JSONB_API jsonbcode jsonbs_number(jsonb_sink *sink, double number);
+JSONB_API jsonbcode jsonbs_float(jsonb_sink *sink, long double number);
+JSONB_API jsonbcode jsonbs_fixed(jsonb_sink *sink,
+                                 int64_t value,
+                                 unsigned scale);
+
+#ifndef JSONP_MAX_DEPTH
+/** Maximum nesting depth of a parsed JSON document */
+#define JSONP_MAX_DEPTH 16
+#endif /* JSONP_MAX_DEPTH */
+#ifndef JSONP_PATH_SIZE
+/** Size of the path of a value (e.g. "location.lat", "items[2].id") */
+#define JSONP_PATH_SIZE 64
+#endif /* JSONP_PATH_SIZE */
+#ifndef JSONP_VALUE_SIZE
+/** Size of the text of a value (longer values are truncated) */
+#define JSONP_VALUE_SIZE 64
+#endif /* JSONP_VALUE_SIZE */
+
+/** @brief json-parser tokens */
+typedef enum jsonptoken {
+    /** the input is used up, the next chunk is expected */
+    JSONP_MORE = 0,
+    JSONP_OBJECT,
+    JSONP_OBJECT_END,
+    JSONP_ARRAY,
+    JSONP_ARRAY_END,
+    JSONP_STRING,
+    JSONP_NUMBER,
+    JSONP_TRUE,
+    JSONP_FALSE,
+    JSONP_NULL,
+    /** malformed input, later calls fail as well */
+    JSONP_ERROR = -1,
+    /** nesting deeper than JSONP_MAX_DEPTH */
+    JSONP_ERROR_DEPTH = -2
+} jsonptoken;
+
+/** @brief json-parser grammar states (private) */
+enum {
+    _JSONP_VALUE = 0,
+    _JSONP_VALUE_OR_END,
+    _JSONP_KEY_OR_END,
+    _JSONP_KEY,
+    _JSONP_COLON,
+    _JSONP_NEXT,
+    _JSONP_DONE
+};
+
+/**
+ * @brief Handle for parsing a JSON document in chunks
+ *
+ * The input is handed to jsonp_next() as it arrives, in chunks of any
+ * size; tokens may span chunks. Keys are not returned as tokens, every
+ * token carries the path of its value instead (keys joined by '.', array
+ * elements as "[index]", "" for the top level value), so fields are taken
+ * by their path and not by their position in the document. Nothing is
+ * allocated, the memory used is the handle.
+ */
+typedef struct jsonp {
+    /** path of the current value */
+    char path[JSONP_PATH_SIZE];
+    /** text of the current string (unescaped, UTF-8) or number */
+    char value[JSONP_VALUE_SIZE];
+    /** length of value */
+    size_t len;
+    /** value was longer than JSONP_VALUE_SIZE - 1 */
+    unsigned char truncated;
+    /** path was longer than JSONP_PATH_SIZE - 1 (matches no path) */
+    unsigned char overflow;
+    /** private: grammar and lexer state */
+    unsigned char depth, expect, lex, key, lit, hex, num;
+    unsigned pathlen;
+    uint32_t cp, hi;
+    char kind[JSONP_MAX_DEPTH + 1];
+    unsigned index[JSONP_MAX_DEPTH + 1];
+    unsigned plen[JSONP_MAX_DEPTH + 1];
+    jsonptoken err;
+} jsonp;
+
+/**
+ * @brief Initialize a jsonp handle
+ *
+ * @param parser the handle to be initialized
+ */
+JSONB_API void jsonp_init(jsonp *parser);
+
+/**
+ * @brief Parse the next token
+ * @note A number is only complete when the character following it has
+ *      been read, so a document consisting of a number alone returns no
+ *      token
+ *
+ * @param parser the handle initialized with jsonp_init()
+ * @param data the input (advanced by the bytes used)
+ * @param len the length of the input (reduced by the bytes used)
+ * @return @ref jsonptoken value, the token's path and text are kept in the
+ *      handle until the next call
+ */
+JSONB_API jsonptoken jsonp_next(jsonp *parser, const char **data, size_t *len);
+
+/**
+ * @brief Check the path of the current token
+ *
+ * @param parser the handle initialized with jsonp_init()
+ * @param path the path, e.g. "location.lat"
+ * @return 1 if the token is the value at path, otherwise 0
+ */
+JSONB_API int jsonp_match(const jsonp *parser, const char path[]);
+
+/**
+ * @brief The top level value has been parsed completely and no error
+ *      occurred (including text after the value)
+ *
+ * @param parser the handle initialized with jsonp_init()
+ */
+#define jsonp_complete(parser)                                                \
+    ((parser)->expect == _JSONP_DONE && (parser)->err == 0)
+
 #ifndef JSONB_HEADER
 #include <stdio.h>
+#include <string.h>
 #ifndef JSONB_DEBUG
 #define TRACE(prev, next) next
 #define DECORATOR(a)
@@ -288,13 +614,11 @@ _jsonb_eval_state(enum jsonbstate state)
     } while (0)
 #define BUFFER_COPY(b, value, len, _pos, buf, bufsize)                        \
     do {                                                                      \
-        size_t i;                                                             \
         if ((b)->pos + (_pos) + (len) + 1 > (bufsize)) {                      \
             (buf)[(b)->pos] = '\0';                                           \
             return JSONB_ERROR_NOMEM;                                         \
         }                                                                     \
-        for (i = 0; i < (len); ++i)                                           \
-            (buf)[(b)->pos + (_pos) + i] = (value)[i];                        \
+        memcpy((buf) + (b)->pos + (_pos), (value), (len));                    \
         (_pos) += (len);                                                      \
         (buf)[(b)->pos + (_pos)] = '\0';                                      \
     } while (0)
@@ -363,73 +687,96 @@ jsonb_object_pop(jsonb *b, char buf[], size_t bufsize)
     return code;
 }
 
-static long
-_jsonb_escape(
-    size_t *pos, char buf[], size_t bufsize, const char str[], size_t len)
+/* word-at-a-time (SWAR) test for bytes which have to be escaped: control
+ * characters (< 0x20), '"' and '\\'; each term is non-zero if and only if one
+ * of the bytes of w matches (see "Bit Twiddling Hacks", haszero/hasless) */
+#define ESC_ONES ((uintptr_t)-1 / 0xFF)
+#define ESC_HIGH (ESC_ONES * 0x80)
+#define ESC_BYTE(c) ((c) < 0x20 || (c) == '"' || (c) == '\\')
+
+static int
+_jsonb_escape_word(uintptr_t w)
 {
-    char *esc_tok = NULL, _esc_tok[8] = "\\u00";
-    char *esc_buf = NULL;
-    int extra_bytes = 0;
-    size_t i;
-second_iter:
-    /* 1st iteration, esc_buf is NULL and count extra_bytes needed for escaping
-     * 2st iteration, esc_buf is not NULL, and does escaping.  */
-    for (i = 0; i < len; ++i) {
-        unsigned char c = str[i];
-        esc_tok = NULL;
-        switch (c) {
-        case 0x22: esc_tok = (char*)"\\\""; break;
-        case 0x5C: esc_tok = (char*)"\\\\"; break;
-        case '\b': esc_tok = (char*)"\\b"; break;
-        case '\f': esc_tok = (char*)"\\f"; break;
-        case '\n': esc_tok = (char*)"\\n"; break;
-        case '\r': esc_tok = (char*)"\\r"; break;
-        case '\t': esc_tok = (char*)"\\t"; break;
-        default: if (c <= 0x1F) {
-                   static const char tohex[] = "0123456789abcdef";
-                   _esc_tok[4] = tohex[c >> 4];
-                   _esc_tok[5] = tohex[c & 0xF];
-                   _esc_tok[6] = 0;
-                   esc_tok = _esc_tok;
-                 }
-        }
-        if (esc_tok) {
-            int j;
-            for (j = 0; esc_tok[j]; j++) {
-                if (!esc_buf) /* count how many extra bytes are needed */
-                    continue;
-                *esc_buf++ = esc_tok[j];
+    uintptr_t q = w ^ (ESC_ONES * '"'), s = w ^ (ESC_ONES * '\\');
+    return ((((w - ESC_ONES * 0x20) & ~w) | ((q - ESC_ONES) & ~q)
+             | ((s - ESC_ONES) & ~s))
+            & ESC_HIGH)
+           != 0;
+}
+
+/* length of the prefix of p .. end which needs no escaping */
+static size_t
+_jsonb_escape_clean(const unsigned char *p, const unsigned char *end)
+{
+    const unsigned char *q = p;
+    while (q < end && !ESC_BYTE(*q)) {
+        if (((uintptr_t)q & (sizeof(uintptr_t) - 1)) == 0) {
+            uintptr_t w;
+            while ((size_t)(end - q) >= sizeof(w)) {
+                memcpy(&w, q, sizeof(w)); /* aligned, a single load */
+                if (_jsonb_escape_word(w)) break;
+                q += sizeof(w);
             }
-            extra_bytes += j - 1;
-        }
-        else if (esc_buf) {
-            *esc_buf++ = c;
+            if (q == end || ESC_BYTE(*q)) break;
         }
+        ++q;
     }
+    return (size_t)(q - p);
+}
 
-    if (*pos + len + extra_bytes > bufsize) {
-        *buf = '\0';
-        return JSONB_ERROR_NOMEM;
-    }
+/* escapes str into buf at *pos in a single pass; clean runs are copied with
+ * memcpy() and only the bytes of a word that contains a special character
+ * are looked at one by one */
+static long
+_jsonb_escape(
+    size_t *pos, char buf[], size_t bufsize, const char str[], size_t len)
+{
+    static const char tohex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *)str, *end = p + len;
+    size_t out = *pos;
 
-    if (esc_buf) {
-        *pos += len + extra_bytes;
-        return JSONB_OK;
-    }
-    if (!extra_bytes) {
-        size_t j;
-        for (j = 0; j < len; ++j)
-            buf[*pos + j] = str[j];
-        *pos += len;
-        return JSONB_OK;
+    while (p < end) {
+        size_t n = _jsonb_escape_clean(p, end);
+        char esc[6] = { '\\', 0, '0', '0', 0, 0 };
+        size_t k = 2;
+        if (out + n > bufsize) goto nomem;
+        memcpy(buf + out, p, n);
+        out += n;
+        p += n;
+        if (p == end) break;
+        switch (*p) {
+        case '"': esc[1] = '"'; break;
+        case '\\': esc[1] = '\\'; break;
+        case '\b': esc[1] = 'b'; break;
+        case '\f': esc[1] = 'f'; break;
+        case '\n': esc[1] = 'n'; break;
+        case '\r': esc[1] = 'r'; break;
+        case '\t': esc[1] = 't'; break;
+        default:
+            esc[1] = 'u';
+            esc[4] = tohex[*p >> 4];
+            esc[5] = tohex[*p & 0xF];
+            k = 6;
+        }
+        if (out + k > bufsize) goto nomem;
+        memcpy(buf + out, esc, k);
+        out += k;
+        ++p;
     }
-    esc_buf = buf + *pos;
-    extra_bytes = 0;
-    goto second_iter;
+    *pos = out;
+    return JSONB_OK;
+nomem:
+    *buf = '\0';
+    return JSONB_ERROR_NOMEM;
 }
 
-JSONB_API jsonbcode
-jsonb_key(jsonb *b, char buf[], size_t bufsize, const char key[], size_t len)
+static jsonbcode
+_jsonb_key(jsonb *b,
+           char buf[],
+           size_t bufsize,
+           const char key[],
+           size_t len,
+           int trusted)
 {
     size_t pos = 0;
     switch (*b->top) {
@@ -439,8 +786,14 @@ jsonb_key(jsonb *b, char buf[], size_t bufsize, const char key[], size_t len)
     case JSONB_OBJECT_KEY_OR_CLOSE: {
         enum jsonbcode ret;
         BUFFER_COPY_CHAR(b, '"', pos, buf, bufsize);
-        ret = (jsonbcode)_jsonb_escape(&pos, buf + b->pos, bufsize - b->pos, key, len);
-        if (ret != JSONB_OK) return ret;
+        if (trusted) {
+            BUFFER_COPY(b, key, len, pos, buf, bufsize);
+        }
+        else {
+            ret = (jsonbcode)_jsonb_escape(&pos, buf + b->pos,
+                                           bufsize - b->pos, key, len);
+            if (ret != JSONB_OK) return ret;
+        }
         BUFFER_COPY(b, "\":", 2, pos, buf, bufsize);
         STACK_HEAD(b, JSONB_OBJECT_VALUE);
     } break;
@@ -454,6 +807,19 @@ jsonb_key(jsonb *b, char buf[], size_t bufsize, const char key[], size_t len)
     return JSONB_OK;
 }
 
+JSONB_API jsonbcode
+jsonb_key(jsonb *b, char buf[], size_t bufsize, const char key[], size_t len)
+{
+    return _jsonb_key(b, buf, bufsize, key, len, 0);
+}
+
+JSONB_API jsonbcode
+jsonb_key_trusted(
+    jsonb *b, char buf[], size_t bufsize, const char key[], size_t len)
+{
+    return _jsonb_key(b, buf, bufsize, key, len, 1);
+}
+
 JSONB_API jsonbcode
 jsonb_array(jsonb *b, char buf[], size_t bufsize)
 {
@@ -559,9 +925,13 @@ jsonb_null(jsonb *b, char buf[], size_t bufsize)
     return jsonb_token(b, buf, bufsize, "null", 4);
 }
 
-JSONB_API jsonbcode
-jsonb_string(
-    jsonb *b, char buf[], size_t bufsize, const char str[], size_t len)
+static jsonbcode
+_jsonb_string(jsonb *b,
+              char buf[],
+              size_t bufsize,
+              const char str[],
+              size_t len,
+              int trusted)
 {
     enum jsonbstate next_state;
     enum jsonbcode code, ret;
@@ -590,19 +960,317 @@ jsonb_string(
         return JSONB_ERROR_INPUT;
     }
     BUFFER_COPY_CHAR(b, '"', pos, buf, bufsize);
-    ret = (jsonbcode)_jsonb_escape(&pos, buf + b->pos, bufsize - b->pos, str, len);
-    if (ret != JSONB_OK) return ret;
+    if (trusted) {
+        BUFFER_COPY(b, str, len, pos, buf, bufsize);
+    }
+    else {
+        ret = (jsonbcode)_jsonb_escape(&pos, buf + b->pos, bufsize - b->pos,
+                                       str, len);
+        if (ret != JSONB_OK) return ret;
+    }
     BUFFER_COPY_CHAR(b, '"', pos, buf, bufsize);
     STACK_HEAD(b, next_state);
     b->pos += pos;
     return code;
 }
 
+JSONB_API jsonbcode
+jsonb_string(
+    jsonb *b, char buf[], size_t bufsize, const char str[], size_t len)
+{
+    return _jsonb_string(b, buf, bufsize, str, len, 0);
+}
+
+JSONB_API jsonbcode
+jsonb_string_trusted(
+    jsonb *b, char buf[], size_t bufsize, const char str[], size_t len)
+{
+    return _jsonb_string(b, buf, bufsize, str, len, 1);
+}
+
+/* digits of an unsigned integer, written backwards from end */
+static char *
+_jsonb_utoa(char *end, uint64_t n)
+{
+    do {
+        *--end = (char)('0' + n % 10);
+        n /= 10;
+    } while (n);
+    return end;
+}
+
+/* Grisu2 (Florian Loitsch, "Printing Floating-Point Numbers Quickly and
+ * Accurately with Integers", 2010) as in RapidJSON's dtoa: finds the
+ * shortest digit string inside the rounding boundaries of a double with
+ * 64-bit integer arithmetic. The result always reads back to the same
+ * double; for about 0.1% of all doubles it is not the shortest one (up to
+ * 17 digits, see test/test_number) */
+typedef struct _jsonb_diyfp {
+    uint64_t f;
+    int e;
+} _jsonb_diyfp;
+
+static const uint64_t _jsonb_pow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+/* normalized 10^-348, 10^-340, ..., 10^340 */
+static const uint64_t _jsonb_cached_f[] = {
+        0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+        0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+        0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+        0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+        0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+        0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+        0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+        0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+        0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+        0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+        0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+        0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+        0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+        0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+        0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+        0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+        0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+        0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+        0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+        0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+        0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+        0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+        0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+        0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+        0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+        0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+        0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+        0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+        0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+};
+static const int16_t _jsonb_cached_e[] = {
+        -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+        -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+        -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+        -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+        -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+        109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+        375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+        641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+        907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static _jsonb_diyfp
+_jsonb_diyfp_mul(_jsonb_diyfp x, _jsonb_diyfp y)
+{
+    const uint64_t M32 = 0xFFFFFFFFu;
+    uint64_t a = x.f >> 32, b = x.f & M32, c = y.f >> 32, d = y.f & M32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (1U << 31);
+    _jsonb_diyfp r;
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+static _jsonb_diyfp
+_jsonb_diyfp_norm(_jsonb_diyfp x)
+{
+    int s = __builtin_clzll(x.f);
+    x.f <<= s;
+    x.e -= s;
+    return x;
+}
+
+static void
+_jsonb_grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+                   uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa
+           && (rest + ten_kappa < wp_w
+               || wp_w - rest > rest + ten_kappa - wp_w))
+    {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static void
+_jsonb_grisu_digits(_jsonb_diyfp w, _jsonb_diyfp mp, uint64_t delta,
+                    char *buf, int *len, int *k)
+{
+    const int shift = -mp.e;
+    const uint64_t one = (uint64_t)1 << shift;
+    const uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> shift);
+    uint64_t p2 = mp.f & (one - 1);
+    int kappa = 1;
+
+    while (kappa < 10 && p1 >= _jsonb_pow10[kappa])
+        kappa++;
+    *len = 0;
+    while (kappa > 0) {
+        uint32_t d = (uint32_t)(p1 / _jsonb_pow10[kappa - 1]);
+        uint64_t rest;
+        p1 %= (uint32_t)_jsonb_pow10[kappa - 1];
+        if (d || *len) buf[(*len)++] = (char)('0' + d);
+        kappa--;
+        rest = ((uint64_t)p1 << shift) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            _jsonb_grisu_round(buf, *len, delta, rest,
+                               _jsonb_pow10[kappa] << shift, wp_w);
+            return;
+        }
+    }
+    for (;;) {
+        char d;
+        p2 *= 10;
+        delta *= 10;
+        d = (char)(p2 >> shift);
+        if (d || *len) buf[(*len)++] = (char)('0' + d);
+        p2 &= one - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            _jsonb_grisu_round(buf, *len, delta, p2, one,
+                               -kappa < 20 ? wp_w * _jsonb_pow10[-kappa] : 0);
+            return;
+        }
+    }
+}
+
+/* digits of a positive finite double, value = digits * 10^k */
+static int
+_jsonb_grisu2(double value, char *buf, int *k)
+{
+    union {
+        double d;
+        uint64_t u;
+    } bits;
+    _jsonb_diyfp v, w, wp, wm, c;
+    int biased, idx, len;
+    double dk;
+
+    bits.d = value;
+    biased = (int)((bits.u >> 52) & 0x7FF);
+    v.f = bits.u & 0xFFFFFFFFFFFFFULL;
+    if (biased) {
+        v.f += 0x10000000000000ULL;
+        v.e = biased - 1075;
+    }
+    else {
+        v.e = -1074;
+    }
+    /* boundaries m+ and m- (closer below a power of two) */
+    wp.f = (v.f << 1) + 1;
+    wp.e = v.e - 1;
+    wp = _jsonb_diyfp_norm(wp);
+    if (v.f == 0x10000000000000ULL) {
+        wm.f = (v.f << 2) - 1;
+        wm.e = v.e - 2;
+    }
+    else {
+        wm.f = (v.f << 1) - 1;
+        wm.e = v.e - 1;
+    }
+    wm.f <<= wm.e - wp.e;
+    wm.e = wp.e;
+    /* cached power c = 10^-k bringing w+ into [2^-60, 2^-32) */
+    dk = (-61 - wp.e) * 0.30102999566398114 + 347;
+    idx = (int)dk;
+    if (dk - idx > 0.0) idx++;
+    idx = (idx >> 3) + 1;
+    *k = -(-348 + idx * 8);
+    c.f = _jsonb_cached_f[idx];
+    c.e = _jsonb_cached_e[idx];
+
+    w = _jsonb_diyfp_mul(_jsonb_diyfp_norm(v), c);
+    wp = _jsonb_diyfp_mul(wp, c);
+    wm = _jsonb_diyfp_mul(wm, c);
+    wm.f++;
+    wp.f--;
+    _jsonb_grisu_digits(w, wp, wp.f - wm.f, buf, &len, k);
+    return len;
+}
+
+/* formats a finite double into token (at least 32 bytes); integral values
+ * below 2^53 take the integer path, others are written by Grisu2 in plain
+ * notation for exponents -6 .. 20, otherwise in exponent notation */
+static long
+_jsonb_dtoa(char *token, double number)
+{
+    char *p = token;
+    int len, k, kk;
+
+    if (number != number || number - number != 0) return -1;
+    /* -0 keeps its sign, as with printf() */
+    if (number < 0 || (number == 0 && 1 / number < 0)) {
+        *p++ = '-';
+        number = -number;
+    }
+    if (number < 9007199254740992.0 && number == (double)(uint64_t)number) {
+        char tmp[20], *q = _jsonb_utoa(tmp + sizeof(tmp), (uint64_t)number);
+        memcpy(p, q, tmp + sizeof(tmp) - q);
+        return (long)(p - token) + (long)(tmp + sizeof(tmp) - q);
+    }
+    len = _jsonb_grisu2(number, p, &k);
+    kk = len + k; /* 10^(kk-1) <= number < 10^kk */
+    if (k >= 0 && kk <= 21) {
+        /* 1234e7 -> 12340000000 */
+        memset(p + len, '0', k);
+        return (long)(p - token) + kk;
+    }
+    if (kk > 0 && kk <= 21) {
+        /* 1234e-2 -> 12.34 */
+        memmove(p + kk + 1, p + kk, len - kk);
+        p[kk] = '.';
+        return (long)(p - token) + len + 1;
+    }
+    if (kk > -6 && kk <= 0) {
+        /* 1234e-6 -> 0.001234 */
+        int offset = 2 - kk;
+        memmove(p + offset, p, len);
+        p[0] = '0';
+        p[1] = '.';
+        memset(p + 2, '0', offset - 2);
+        return (long)(p - token) + len + offset;
+    }
+    /* 1234e30 -> 1.234e33 */
+    if (len > 1) {
+        memmove(p + 2, p + 1, len - 1);
+        p[1] = '.';
+        len++;
+    }
+    p += len;
+    *p++ = 'e';
+    kk--;
+    if (kk < 0) {
+        *p++ = '-';
+        kk = -kk;
+    }
+    {
+        char tmp[4], *q = _jsonb_utoa(tmp + sizeof(tmp), (uint64_t)kk);
+        memcpy(p, q, tmp + sizeof(tmp) - q);
+        p += tmp + sizeof(tmp) - q;
+    }
+    return (long)(p - token);
+}
+
+JSONB_API long
+jsonb_format_number(char token[JSONB_NUMBER_SIZE], double number)
+{
+    return _jsonb_dtoa(token, number);
+}
+
 JSONB_API jsonbcode
 jsonb_number(jsonb *b, char buf[], size_t bufsize, double number)
 {
-    char token[32];
-    long len = sprintf(token, "%.17G", number);
+    char token[JSONB_NUMBER_SIZE];
+    long len = _jsonb_dtoa(token, number);
     if (len < 0) return JSONB_ERROR_INPUT;
     return jsonb_token(b, buf, bufsize, token, len);
 }
@@ -610,12 +1278,568 @@ jsonb_number(jsonb *b, char buf[], size_t bufsize, double number)
 JSONB_API jsonbcode
 jsonb_float(jsonb *b, char buf[], size_t bufsize, long double number)
 {
-    char token[32];
-    //long len = sprintf(token, "%.9e", (float)(number/1.0));;
-    long len = sprintf(token, "%.9e", number);
+    return jsonb_number(b, buf, bufsize, (double)number);
+}
+
+JSONB_API long
+jsonb_format_fixed(char token[JSONB_NUMBER_SIZE], int64_t value, unsigned scale)
+{
+    char tmp[JSONB_NUMBER_SIZE], *end = tmp + sizeof(tmp), *p;
+    uint64_t n = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    if (scale > 18) return -1;
+    if (scale) {
+        p = _jsonb_utoa(end, n % _jsonb_pow10[scale]);
+        while (p > end - scale)
+            *--p = '0';
+        *--p = '.';
+        p = _jsonb_utoa(p, n / _jsonb_pow10[scale]);
+    }
+    else {
+        p = _jsonb_utoa(end, n);
+    }
+    if (value < 0) *--p = '-';
+    memcpy(token, p, end - p);
+    return (long)(end - p);
+}
+
+JSONB_API jsonbcode
+jsonb_fixed(
+    jsonb *b, char buf[], size_t bufsize, int64_t value, unsigned scale)
+{
+    char token[JSONB_NUMBER_SIZE];
+    long len = jsonb_format_fixed(token, value, scale);
     if (len < 0) return JSONB_ERROR_INPUT;
     return jsonb_token(b, buf, bufsize, token, len);
 }
+
+JSONB_API void
+jsonb_sink_init(
+    jsonb_sink *s, char buf[], size_t bufsize, jsonb_write write, void *ctx)
+{
+    jsonb_init(&s->b);
+    s->buf = buf;
+    s->bufsize = bufsize;
+    s->write = write;
+    s->ctx = ctx;
+    s->flushed = 0;
+    s->err = JSONB_OK;
+    if (bufsize) buf[0] = '\0';
+}
+
+JSONB_API jsonbcode
+jsonb_sink_flush(jsonb_sink *s)
+{
+    if (s->err < 0) return s->err;
+    if (!s->b.pos) return JSONB_OK;
+    if (!s->write) return JSONB_ERROR_NOMEM;
+    if (s->write(s->ctx, s->buf, s->b.pos) != s->b.pos)
+        return s->err = JSONB_ERROR_WRITE;
+    s->flushed += s->b.pos;
+    jsonb_reset(&s->b);
+    s->buf[0] = '\0';
+    return JSONB_OK;
+}
+
+JSONB_API jsonbcode
+jsonb_sink_put(jsonb_sink *s, const char data[], size_t len)
+{
+    if (s->err < 0) return s->err;
+    if (s->b.pos + len + 1 <= s->bufsize) {
+        memcpy(s->buf + s->b.pos, data, len);
+        s->b.pos += len;
+        s->buf[s->b.pos] = '\0';
+        return JSONB_OK;
+    }
+    if (!s->write) return s->err = JSONB_ERROR_NOMEM;
+    if (jsonb_sink_flush(s) != JSONB_OK) return s->err;
+    if (s->write(s->ctx, data, len) != len)
+        return s->err = JSONB_ERROR_WRITE;
+    s->flushed += len;
+    return JSONB_OK;
+}
+
+JSONB_API size_t
+jsonb_discard(void *ctx, const char data[], size_t len)
+{
+    (void)ctx;
+    (void)data;
+    return len;
+}
+
+/* calls a builder function on the window; if the token does not fit, the
+ * window is flushed and the call is repeated (a builder function that
+ * fails with JSONB_ERROR_NOMEM leaves the builder state untouched) */
+#define SINK_CALL(s, call)                                                    \
+    do {                                                                      \
+        jsonbcode _code;                                                      \
+        if ((s)->err < 0) return (s)->err;                                    \
+        _code = (call);                                                       \
+        if (_code == JSONB_ERROR_NOMEM && (s)->write && (s)->b.pos) {         \
+            if (jsonb_sink_flush(s) != JSONB_OK) return (s)->err;             \
+            _code = (call);                                                   \
+        }                                                                     \
+        if (_code < 0) (s)->err = _code;                                      \
+        return _code;                                                         \
+    } while (0)
+
+JSONB_API jsonbcode
+jsonbs_object(jsonb_sink *s)
+{
+    SINK_CALL(s, jsonb_object(&s->b, s->buf, s->bufsize));
+}
+
+JSONB_API jsonbcode
+jsonbs_object_pop(jsonb_sink *s)
+{
+    SINK_CALL(s, jsonb_object_pop(&s->b, s->buf, s->bufsize));
+}
+
+JSONB_API jsonbcode
+jsonbs_key(jsonb_sink *s, const char key[], size_t len)
+{
+    SINK_CALL(s, jsonb_key(&s->b, s->buf, s->bufsize, key, len));
+}
+
+JSONB_API jsonbcode
+jsonbs_key_trusted(jsonb_sink *s, const char key[], size_t len)
+{
+    SINK_CALL(s, jsonb_key_trusted(&s->b, s->buf, s->bufsize, key, len));
+}
+
+JSONB_API jsonbcode
+jsonbs_array(jsonb_sink *s)
+{
+    SINK_CALL(s, jsonb_array(&s->b, s->buf, s->bufsize));
+}
+
+JSONB_API jsonbcode
+jsonbs_array_pop(jsonb_sink *s)
+{
+    SINK_CALL(s, jsonb_array_pop(&s->b, s->buf, s->bufsize));
+}
+
+JSONB_API jsonbcode
+jsonbs_token(jsonb_sink *s, const char token[], size_t len)
+{
+    SINK_CALL(s, jsonb_token(&s->b, s->buf, s->bufsize, token, len));
+}
+
+JSONB_API jsonbcode
+jsonbs_bool(jsonb_sink *s, int boolean)
+{
+    SINK_CALL(s, jsonb_bool(&s->b, s->buf, s->bufsize, boolean));
+}
+
+JSONB_API jsonbcode
+jsonbs_null(jsonb_sink *s)
+{
+    SINK_CALL(s, jsonb_null(&s->b, s->buf, s->bufsize));
+}
+
+JSONB_API jsonbcode
+jsonbs_string(jsonb_sink *s, const char str[], size_t len)
+{
+    SINK_CALL(s, jsonb_string(&s->b, s->buf, s->bufsize, str, len));
+}
+
+JSONB_API jsonbcode
+jsonbs_string_trusted(jsonb_sink *s, const char str[], size_t len)
+{
+    SINK_CALL(s, jsonb_string_trusted(&s->b, s->buf, s->bufsize, str, len));
+}
+
+JSONB_API jsonbcode
+jsonbs_number(jsonb_sink *s, double number)
+{
+    SINK_CALL(s, jsonb_number(&s->b, s->buf, s->bufsize, number));
+}
+
+JSONB_API jsonbcode
+jsonbs_float(jsonb_sink *s, long double number)
+{
+    SINK_CALL(s, jsonb_float(&s->b, s->buf, s->bufsize, number));
+}
+
+JSONB_API jsonbcode
+jsonbs_fixed(jsonb_sink *s, int64_t value, unsigned scale)
+{
+    SINK_CALL(s, jsonb_fixed(&s->b, s->buf, s->bufsize, value, scale));
+}
+/* lexer states of the parser */
+enum {
+    _JSONP_LEX_NONE = 0,
+    _JSONP_LEX_STRING,
+    _JSONP_LEX_ESCAPE,
+    _JSONP_LEX_UNICODE,
+    _JSONP_LEX_NUMBER,
+    _JSONP_LEX_LITERAL
+};
+
+/* number grammar -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?: the part
+ * read last */
+enum {
+    _JSONP_NUM_MINUS = 0,
+    _JSONP_NUM_ZERO,
+    _JSONP_NUM_INT,
+    _JSONP_NUM_POINT,
+    _JSONP_NUM_FRAC,
+    _JSONP_NUM_E,
+    _JSONP_NUM_EXP_SIGN,
+    _JSONP_NUM_EXP
+};
+
+/* path length of a container whose path did not fit */
+#define _JSONP_NO_PATH ((unsigned)-1)
+
+JSONB_API void
+jsonp_init(jsonp *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+static void
+_jsonp_append(jsonp *p, char c)
+{
+    if (p->hi) {
+        /* high surrogate without its low surrogate */
+        p->hi = 0;
+        _jsonp_append(p, '?');
+    }
+    if (p->len < JSONP_VALUE_SIZE - 1) {
+        p->value[p->len++] = c;
+        p->value[p->len] = '\0';
+    }
+    else {
+        p->truncated = 1;
+    }
+}
+
+/* appends the code point of a \u escape as UTF-8, surrogate pairs are
+ * joined */
+static void
+_jsonp_append_cp(jsonp *p, uint32_t cp)
+{
+    if (cp >= 0xD800 && cp < 0xDC00) {
+        if (p->hi) _jsonp_append(p, '?');
+        p->hi = cp;
+        return;
+    }
+    if (cp >= 0xDC00 && cp < 0xE000) {
+        if (!p->hi) {
+            _jsonp_append(p, '?');
+            return;
+        }
+        cp = 0x10000 + ((p->hi - 0xD800) << 10) + (cp - 0xDC00);
+        p->hi = 0;
+    }
+    if (cp < 0x80) {
+        _jsonp_append(p, (char)cp);
+    }
+    else if (cp < 0x800) {
+        _jsonp_append(p, (char)(0xC0 | (cp >> 6)));
+        _jsonp_append(p, (char)(0x80 | (cp & 0x3F)));
+    }
+    else if (cp < 0x10000) {
+        _jsonp_append(p, (char)(0xE0 | (cp >> 12)));
+        _jsonp_append(p, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        _jsonp_append(p, (char)(0x80 | (cp & 0x3F)));
+    }
+    else {
+        _jsonp_append(p, (char)(0xF0 | (cp >> 18)));
+        _jsonp_append(p, (char)(0x80 | ((cp >> 12) & 0x3F)));
+        _jsonp_append(p, (char)(0x80 | ((cp >> 6) & 0x3F)));
+        _jsonp_append(p, (char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+/* sets the path to the path of the current container followed by a key
+ * (key != NULL) or an array index */
+static void
+_jsonp_path(jsonp *p, const char *key, unsigned index)
+{
+    unsigned base = p->plen[p->depth];
+    int n;
+
+    p->overflow = 1;
+    if (base == _JSONP_NO_PATH) return;
+    if (key)
+        n = snprintf(p->path + base, JSONP_PATH_SIZE - base, "%s%s",
+                     base ? "." : "", key);
+    else
+        n = snprintf(p->path + base, JSONP_PATH_SIZE - base, "[%u]", index);
+    if (n < 0 || base + n >= JSONP_PATH_SIZE || (key && p->truncated)) {
+        p->path[base] = '\0';
+        return;
+    }
+    p->overflow = 0;
+    p->pathlen = base + n;
+}
+
+/* returns the number state after character c, or -1 if c does not
+ * continue the number */
+static int
+_jsonp_num_next(unsigned char num, char c)
+{
+    int digit = (c >= '0' && c <= '9');
+
+    switch (num) {
+    case _JSONP_NUM_MINUS:
+        if (c == '0') return _JSONP_NUM_ZERO;
+        return digit ? _JSONP_NUM_INT : -1;
+    case _JSONP_NUM_ZERO:
+    case _JSONP_NUM_INT:
+        if (digit && num == _JSONP_NUM_INT) return _JSONP_NUM_INT;
+        if (c == '.') return _JSONP_NUM_POINT;
+        return (c == 'e' || c == 'E') ? _JSONP_NUM_E : -1;
+    case _JSONP_NUM_POINT:
+        return digit ? _JSONP_NUM_FRAC : -1;
+    case _JSONP_NUM_FRAC:
+        if (digit) return _JSONP_NUM_FRAC;
+        return (c == 'e' || c == 'E') ? _JSONP_NUM_E : -1;
+    case _JSONP_NUM_E:
+        if (c == '+' || c == '-') return _JSONP_NUM_EXP_SIGN;
+        /* fall through */
+    default:
+        return digit ? _JSONP_NUM_EXP : -1;
+    }
+}
+
+static jsonptoken
+_jsonp_value_end(jsonp *p, jsonptoken token)
+{
+    p->lex = _JSONP_LEX_NONE;
+    p->expect = p->depth ? _JSONP_NEXT : _JSONP_DONE;
+    return token;
+}
+
+static jsonptoken
+_jsonp_close(jsonp *p, char c)
+{
+    unsigned len = p->plen[p->depth];
+
+    if (p->kind[p->depth] != (c == '}' ? '{' : '[')) return JSONP_ERROR;
+    p->depth--;
+    /* the end token carries the path of its container */
+    p->overflow = (len == _JSONP_NO_PATH);
+    if (!p->overflow) {
+        p->path[len] = '\0';
+        p->pathlen = len;
+    }
+    p->len = 0;
+    p->value[0] = '\0';
+    return _jsonp_value_end(p, c == '}' ? JSONP_OBJECT_END : JSONP_ARRAY_END);
+}
+
+/* starts a value with its first character c */
+static jsonptoken
+_jsonp_value(jsonp *p, char c)
+{
+    if (p->kind[p->depth] == '[') _jsonp_path(p, NULL, p->index[p->depth]);
+    p->len = 0;
+    p->truncated = 0;
+    p->value[0] = '\0';
+    switch (c) {
+    case '{':
+    case '[':
+        if (p->depth >= JSONP_MAX_DEPTH) return JSONP_ERROR_DEPTH;
+        p->depth++;
+        p->kind[p->depth] = c;
+        p->index[p->depth] = 0;
+        p->plen[p->depth] = p->overflow ? _JSONP_NO_PATH : p->pathlen;
+        p->expect = (c == '{') ? _JSONP_KEY_OR_END : _JSONP_VALUE_OR_END;
+        return (c == '{') ? JSONP_OBJECT : JSONP_ARRAY;
+    case '"':
+        p->lex = _JSONP_LEX_STRING;
+        p->key = 0;
+        return JSONP_MORE;
+    case 't':
+    case 'f':
+    case 'n':
+        p->lex = _JSONP_LEX_LITERAL;
+        p->lit = 1;
+        _jsonp_append(p, c);
+        return JSONP_MORE;
+    default:
+        if (c != '-' && (c < '0' || c > '9')) return JSONP_ERROR;
+        p->lex = _JSONP_LEX_NUMBER;
+        p->num = (c == '-')   ? _JSONP_NUM_MINUS
+                 : (c == '0') ? _JSONP_NUM_ZERO
+                              : _JSONP_NUM_INT;
+        _jsonp_append(p, c);
+        return JSONP_MORE;
+    }
+}
+
+JSONB_API jsonptoken
+jsonp_next(jsonp *p, const char **data, size_t *len)
+{
+    static const char *const literals[] = { "true", "false", "null" };
+    static const jsonptoken tokens[] = { JSONP_TRUE, JSONP_FALSE, JSONP_NULL };
+    const char *s = *data, *end = s + *len;
+    jsonptoken token = JSONP_MORE;
+    int k, d;
+
+    if (p->err < 0) return p->err;
+    while (token == JSONP_MORE && s < end) {
+        char c = *s++;
+
+        switch (p->lex) {
+        case _JSONP_LEX_STRING:
+            if (c == '"') {
+                if (p->hi) {
+                    p->hi = 0;
+                    _jsonp_append(p, '?');
+                }
+                if (p->key) {
+                    p->lex = _JSONP_LEX_NONE;
+                    p->expect = _JSONP_COLON;
+                    _jsonp_path(p, p->value, 0);
+                }
+                else {
+                    token = _jsonp_value_end(p, JSONP_STRING);
+                }
+            }
+            else if (c == '\\') {
+                p->lex = _JSONP_LEX_ESCAPE;
+            }
+            else if ((unsigned char)c < 0x20) {
+                token = JSONP_ERROR;
+            }
+            else {
+                _jsonp_append(p, c);
+            }
+            break;
+        case _JSONP_LEX_ESCAPE:
+            p->lex = _JSONP_LEX_STRING;
+            switch (c) {
+            case '"':
+            case '\\':
+            case '/': _jsonp_append(p, c); break;
+            case 'b': _jsonp_append(p, '\b'); break;
+            case 'f': _jsonp_append(p, '\f'); break;
+            case 'n': _jsonp_append(p, '\n'); break;
+            case 'r': _jsonp_append(p, '\r'); break;
+            case 't': _jsonp_append(p, '\t'); break;
+            case 'u':
+                p->lex = _JSONP_LEX_UNICODE;
+                p->hex = 0;
+                p->cp = 0;
+                break;
+            default: token = JSONP_ERROR; break;
+            }
+            break;
+        case _JSONP_LEX_UNICODE:
+            k = c | 0x20;
+            d = (c >= '0' && c <= '9')     ? c - '0'
+                : (k >= 'a' && k <= 'f') ? k - 'a' + 10
+                                         : -1;
+            if (d < 0) {
+                token = JSONP_ERROR;
+                break;
+            }
+            p->cp = (p->cp << 4) | (uint32_t)d;
+            if (++p->hex == 4) {
+                p->lex = _JSONP_LEX_STRING;
+                _jsonp_append_cp(p, p->cp);
+            }
+            break;
+        case _JSONP_LEX_NUMBER:
+            d = _jsonp_num_next(p->num, c);
+            if (d >= 0) {
+                p->num = (unsigned char)d;
+                _jsonp_append(p, c);
+            }
+            else if (p->num == _JSONP_NUM_ZERO || p->num == _JSONP_NUM_INT
+                     || p->num == _JSONP_NUM_FRAC || p->num == _JSONP_NUM_EXP)
+            {
+                /* the delimiter is parsed as next character */
+                s--;
+                token = _jsonp_value_end(p, JSONP_NUMBER);
+            }
+            else {
+                token = JSONP_ERROR;
+            }
+            break;
+        case _JSONP_LEX_LITERAL:
+            k = (p->value[0] == 't') ? 0 : (p->value[0] == 'f') ? 1 : 2;
+            if (c != literals[k][p->lit]) {
+                token = JSONP_ERROR;
+                break;
+            }
+            _jsonp_append(p, c);
+            if (literals[k][++p->lit] == '\0')
+                token = _jsonp_value_end(p, tokens[k]);
+            break;
+        default:
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r') break;
+            switch (p->expect) {
+            case _JSONP_KEY_OR_END:
+            case _JSONP_KEY:
+                if (c == '"') {
+                    p->lex = _JSONP_LEX_STRING;
+                    p->key = 1;
+                    p->len = 0;
+                    p->truncated = 0;
+                    p->value[0] = '\0';
+                }
+                else if (c == '}' && p->expect == _JSONP_KEY_OR_END) {
+                    token = _jsonp_close(p, c);
+                }
+                else {
+                    token = JSONP_ERROR;
+                }
+                break;
+            case _JSONP_COLON:
+                if (c == ':')
+                    p->expect = _JSONP_VALUE;
+                else
+                    token = JSONP_ERROR;
+                break;
+            case _JSONP_NEXT:
+                if (c == ',') {
+                    if (p->kind[p->depth] == '{') {
+                        p->expect = _JSONP_KEY;
+                    }
+                    else {
+                        p->index[p->depth]++;
+                        p->expect = _JSONP_VALUE;
+                    }
+                }
+                else if (c == '}' || c == ']') {
+                    token = _jsonp_close(p, c);
+                }
+                else {
+                    token = JSONP_ERROR;
+                }
+                break;
+            case _JSONP_VALUE_OR_END:
+                if (c == ']') {
+                    token = _jsonp_close(p, c);
+                    break;
+                }
+                /* fall through */
+            case _JSONP_VALUE:
+                token = _jsonp_value(p, c);
+                break;
+            default:
+                /* text after the top level value */
+                token = JSONP_ERROR;
+                break;
+            }
+            break;
+        }
+    }
+    *len -= (size_t)(s - *data);
+    *data = s;
+    if (token < 0) p->err = token;
+    return token;
+}
+
+JSONB_API int
+jsonp_match(const jsonp *p, const char path[])
+{
+    return !p->overflow && strcmp(p->path, path) == 0;
+}
 #endif /* JSONB_HEADER */
 
 #ifdef __cplusplus
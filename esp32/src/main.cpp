@@ -29,7 +29,9 @@
  *  @date    10-2023
  *  @version 1.1
  *
- *  @brief ESP32 BLE-SENML Gateway (up to 4 BLEServer)
+ *  @brief ESP32 BLE-SENML Gateway (connected pucks in up to ble_max_conn
+ *         slots, at most MAX_DEVICE; up to MAX_MACS pucks read from their
+ *         advertisements)
  */
 
 /******************************************************************* INCLUDE */
@@ -43,21 +45,136 @@
 #include <AutoConnectFS.h>
 #include <esp_task_wdt.h>
 #include <Preferences.h>
+#include <esp_partition.h>
+#include <esp_timer.h>
+#include <esp_sntp.h>
 
 #include "json.h"
+#include "pqueue.h"
+#include "ring.h"
+#include "adv.h"
+#include "dataset.h"
+#include "senml.h"
+#include "cbor.h"
 
 /******************************************************************* DEFINE */
 
-#define ELEMENT_SIZE 512
+#define PACK_SIZE 3072
 #define DATA_SIZE 64
 #define URN_SIZE 48
 #define MAC_SIZE 24
 #define LOC_SIZE 12
-#define MAX_DEVICE 4
-#define MAX_POOL 10
+#define MAX_DEVICE 9
+#define MAX_MACS 32
 #define MAX_REDIR 8
 #define MAX_ATTEMPTS 5
+#define MAX_CONN 2
+#define HOST_SIZE 48
+#define CONN_IDLE_MS 60000
+// request bodies are streamed through a SINK_SIZE window, either with a
+// Content-Length from a counting pass (0) or with chunked transfer encoding
+// (1, every window is one chunk)
+#define SINK_SIZE 256
+#define HTTP_CHUNKED 0
+#define HTTP_LINE_SIZE 128
+#define HTTP_CHUNK_SIZE 64
+// requests are advanced by http_poll() (uplink task); every stage of an
+// attempt has its own time budget. Connecting (DNS, TCP and the TLS
+// handshake) is the only step which blocks, bounded by its two budgets.
+// Requests beyond MAX_CONN wait for a connection in their slot
+#define HTTP_CONNECT_MS 3000
+#define HTTP_TLS_MS 5000
+#define HTTP_WRITE_MS 3000
+#define HTTP_READ_MS 5000
+#define HTTP_RETRY_MS 500
+#define MAX_INFLIGHT 4
+// encoding of the packs and alerts of an endpoint: SenML JSON or SenML-CBOR
+// (selected by the key of the webservice in the characteristic of a device,
+// "e=<url>" or "c=<url>")
+#define FMT_JSON 0
+#define FMT_CBOR 1
+#define CT_JSON "application/json"
+#define CT_SENML_CBOR "application/senml+cbor"
+#define MAX_EVENTS 64
+#define MAX_ALERTS 8
+// encoded button alert (an id of 63 characters which all have to be escaped
+// included)
+#define ALERT_SIZE 640
 #define NO_INDEX -1
+// lookup tables (open addressing, power of two, at most half full)
+#define MAC_TAB_SIZE 64
+#define CHR_TAB_SIZE 64
+#define CHR_DELETED 0xFF
+
+// SenML pack flush policy (records, bytes and waiting time per endpoint)
+#define BATCH_MAX_RECORDS 64
+#define BATCH_MAX_BYTES PACK_SIZE
+#define BATCH_MAX_WAIT_MS 2000
+
+// button alerts: endpoints of connected devices are kept connected
+#define ALERT_WARM_MS 30000
+
+// store-and-forward queue (spiffs partition)
+#define QUEUE_RETRY_MS 30000
+#define PACK_FIRST_RECORDS 7
+#define PACK_NEXT_RECORDS 4
+
+// clock service (epoch anchored to esp_timer)
+#define CLOCK_SYNC_MS 600000
+#define CLOCK_VALID_SEC 1600000000
+
+// BLE scan scheduler (interval, window and pause in ms, duration in s); the
+// window and the pause between scans scale with the number of missing devices
+#define SCAN_INTERVAL_MS 640
+#define SCAN_WINDOW_MIN_MS 60
+#define SCAN_WINDOW_MAX_MS 320
+#define SCAN_PAUSE_MS 8000
+#define SCAN_TIME_SEC 2
+// advertisement mode: scan continuously (window = interval)
+#define ADV_SCAN_WINDOW_MS SCAN_INTERVAL_MS
+#define ADV_KEY "advert"
+
+// connection setup tasks
+#define CONN_TASK_STACK 4096
+#define CONN_TASK_PRIO 1
+// task topology (tasks_start()): core, priority, stack and period (or
+// longest wait for work) of the BLE ingest, assembly, uplink and portal
+// tasks. The BLE and WiFi stacks run on core 0, so the TLS work of the
+// uplink task goes to core 1; on a single core chip all tasks share core 0
+#define INGEST_CORE 0
+#define INGEST_PRIO 3
+#define INGEST_STACK 4096
+#define INGEST_MS 20
+#define ASSEMBLY_CORE 1
+#define ASSEMBLY_PRIO 3
+#define ASSEMBLY_STACK 6144
+#define ASSEMBLY_MS 50
+#define UPLINK_CORE 1
+#define UPLINK_PRIO 2
+#define UPLINK_STACK 8192
+#define UPLINK_MS 100
+#define UPLINK_POLL_MS 2
+#define PORTAL_CORE 0
+#define PORTAL_PRIO 1
+#define PORTAL_STACK 8192
+#define PORTAL_MS 2
+#define MAX_TASKS 4
+#define TASK_REPORT_MS 30000
+// packs encoded by the assembly task and not yet sent (or stored) by the
+// uplink task; URL updates handed back to the assembly task
+#define PACK_BUFS 2
+#define MAX_RESULTS 4
+// direct reconnects (by stored address); backoff doubles after each failure
+#define RECONNECT_BASE_MS 500
+#define RECONNECT_MAX_TRIES 5
+// link establishment (connLock is held meanwhile)
+#define BLE_CONNECT_MS 5000
+// GATT handle cache (Preferences); timeout of a single GATT operation
+#define GATT_CACHE_VERSION 2
+#define GATT_OP_MS 2000
+#define GATT_SENSORS 4
+// sensor characteristics plus the packed frame characteristic
+#define GATT_HANDLES 5
 
 #define WDT_TIMEOUT 600
 
@@ -72,43 +189,257 @@
 #define DLT_OFF_SEC 0
 //
 
-enum BLEState { D_DISCONNECTED, D_SCANNED, D_CONNECTING, D_CONNECTED };
-
-typedef struct s_data {
-  long double tm;
-  int temp;
-  bool f_temp;
-  int bat;
-  bool f_bat;
-  int mov;
-  bool f_mov;
-  int btn;
-  bool f_btn;
-  bool valid;
-} s_data;
+// device registry (Preferences blob)
+#define REG_KEY "devices"
+#define REG_VERSION 1
 
-typedef struct s_device {
-  int state;
-  int index;
+enum BLEState {
+  D_DISCONNECTED,
+  D_SCANNED,
+  D_CONNECTING,
+  D_CONNECTED,
+  D_ADVERT
+};
+// E_RESET: the device of a slot disconnected (its datasets are dropped)
+enum EventType { E_BAT, E_TEMP, E_MOV, E_BTN, E_FRAME, E_RESET };
+enum TaskId { T_INGEST, T_ASSEMBLY, T_UPLINK, T_PORTAL };
+enum HTTPStage {
+  H_IDLE,      // slot free
+  H_WAIT,      // waiting for the next attempt or a free connection
+  H_CONNECT,
+  H_WRITE,
+  H_STATUS,    // reading the status line
+  H_HEADER,
+  H_BODY,      // len bytes (len < 0: up to the end of the connection)
+  H_CHUNK,     // chunk size line
+  H_CHUNK_END, // CRLF after the chunk data
+  H_TRAILER
+};
+
+typedef struct s_event {
+  uint8_t dev;
+  uint8_t type;
+  int16_t val; // E_FRAME: battery
+  // E_FRAME only: the other values of the frame (fills the padding)
+  int8_t temp;
+  uint8_t flags;
+  uint8_t seq;
+  uint64_t tm;
+  unsigned long rx;
+} s_event;
+
+// button alert with the device data it is sent with, taken when it is
+// raised (BLE task), so it is delivered even if the device is gone by then
+typedef struct s_alert {
+  s_event event;
+  uint8_t format; // FMT_JSON, FMT_CBOR
+  char mac[MAC_SIZE];
+  char id[DATA_SIZE];
+  char url[DATA_SIZE];
+  char url0[DATA_SIZE];
+} s_alert;
+
+RING_DEFINE(event_ring, s_event, MAX_EVENTS)
+RING_DEFINE(alert_ring, s_alert, MAX_ALERTS)
+
+// connection and configuration of a device (cold data: touched when a
+// device connects, reports or is sent for, not by the per-loop scans)
+typedef struct s_link {
+  unsigned long found;
+  unsigned long online;
+  uint8_t gattIf;
+  uint16_t connId;
+  uint16_t handle[GATT_HANDLES];
+  SemaphoreHandle_t gattSem;
+  volatile int gattStatus;
+  adv_seen frameSeen;
+  int8_t btnLast;   // button value last notified (-1: none yet, BLE task)
+  char gattValue[DATA_SIZE];
   char mac[MAC_SIZE];
   char id[DATA_SIZE];
   char url0[DATA_SIZE];
   char url[DATA_SIZE];
-  BLEAdvertisedDevice *pDevice;
-  BLEClient *pClient;
+  senml_tpl tpl;    // pre-rendered SenML records (assembly task only)
+  bool tplStale;    // id or MAC changed, tpl is rendered again
+  uint8_t format;   // FMT_JSON, FMT_CBOR (encoding of the webservice)
+  volatile bool setup; // a connection setup task runs for the slot
+  BLEClient *client;   // created once, reused by every setup of the slot
+  BLEClient *pClient;  // client of the device in the slot (NULL if reset)
   BLERemoteCharacteristic *tempCharacteristic;
   BLERemoteCharacteristic *batCharacteristic;
   BLERemoteCharacteristic *movCharacteristic;
   BLERemoteCharacteristic *btnCharacteristic;
-  s_data data[MAX_POOL];
+  BLERemoteCharacteristic *frameCharacteristic;
+} s_link;
+
+// device slot (hot data: dataset pool and state, scanned by the tasks);
+// the sensor bits of a dataset are EventType bits (DS_BAT == 1 << E_BAT)
+typedef struct s_device {
+  ds_pool pool;
+  uint8_t state;
+  uint8_t addr_type;
+  bool cached;
+  s_link *link;
+  uint64_t addr;
 } s_device;
 
+// attribute handles of a device, indexed by EventType
+typedef struct s_gatt_cache {
+  uint16_t version;
+  uint16_t config;
+  uint16_t value[GATT_HANDLES];
+  uint16_t cccd[GATT_HANDLES];
+} s_gatt_cache;
+
+// configured MAC addresses as stored in Preferences (count entries used)
+typedef struct s_registry {
+  uint8_t version;
+  uint8_t count;
+  uint8_t mac[MAX_MACS][6];
+} s_registry;
+
+typedef struct s_mac_entry {
+  uint64_t mac;
+  int8_t dev;
+  bool known;
+  uint8_t type;
+  uint8_t tries;
+  unsigned long retry;
+  adv_seen seen;
+} s_mac_entry;
+
+// id and webservice of a device in advertisement mode (Preferences)
+typedef struct s_adv_config {
+  char id[DATA_SIZE];
+  char url[DATA_SIZE];
+  uint8_t format; // missing in entries of older versions (FMT_JSON)
+} s_adv_config;
+
+typedef struct s_chr_entry {
+  BLERemoteCharacteristic *chr;
+  uint8_t dev;
+  uint8_t type;
+} s_chr_entry;
+
+typedef struct s_conn {
+  char host[HOST_SIZE];
+  uint16_t port;
+  unsigned long used;
+  unsigned long warmed;
+  bool warm;
+  struct s_http *busy; // request using the connection (NULL if free)
+  WiFiClientSecure *client;
+} s_conn;
+
+// request body; write() is called once per pass over the body (length,
+// retries, queue) and has to produce the same bytes every time
+typedef struct s_body {
+  int (*write)(jsonb_sink *s, void *arg);
+  void *arg;
+  const char *type; // Content-Type
+} s_body;
+
+typedef struct s_raw {
+  const char *buf;
+  size_t len;
+} s_raw;
+
+typedef struct s_http s_http;
+
+// completion of a request: code is the HTTP status code of the last attempt
+// (HTTPC_ERROR_* if negative, 0 if it was not sent), ms the time since it
+// was submitted
+typedef void (*http_done)(s_http *req, int code, unsigned long ms);
+
+// request in flight (a slot of myHttp); arguments of the body which have to
+// live as long as the request are kept in the slot (alert, raw)
+struct s_http {
+  uint8_t stage;      // HTTPStage
+  bool warm;          // attempt started on an open connection
+  bool stale;         // attempt repeated on a fresh connection
+  bool chunked;
+  bool close;
+  uint8_t redirs;
+  uint8_t attempts;
+  uint8_t n;          // length of line
+  int code;
+  long len;           // body bytes left
+  unsigned long t0;   // submitted
+  unsigned long ta;   // attempt started
+  unsigned long ts;   // stage started
+  unsigned long wait; // H_WAIT: time from ts to the next attempt
+  s_conn *conn;
+  s_body body;
+  s_alert alert;
+  s_raw raw;
+  jsonb_write resp; // response body (NULL: discarded)
+  void *ctx;
+  http_done done;
+  char url[DATA_SIZE];
+  char url0[DATA_SIZE];
+  char from[DATA_SIZE]; // URL the request was submitted with
+  char location[DATA_SIZE];
+  char line[HTTP_LINE_SIZE];
+};
+
+// pack encoded by the assembly task for the uplink task (packQueue); the
+// buffer goes back through packFree once the pack has been sent or stored
+typedef struct s_pack {
+  char *buf;
+  uint16_t len;
+  uint8_t format; // FMT_JSON, FMT_CBOR
+  char url[DATA_SIZE];
+  char url0[DATA_SIZE];
+} s_pack;
+
+// URL a request submitted with URL from ended with (redirect target, url0
+// after errors); applied to the devices by the assembly task (resultQueue)
+typedef struct s_result {
+  char from[DATA_SIZE];
+  char url[DATA_SIZE];
+} s_result;
+
+// task of the topology (myTasks, indexed by TaskId)
+typedef struct s_task {
+  const char *name;
+  TaskHandle_t handle;
+  BaseType_t core;
+  UBaseType_t prio;
+  volatile uint32_t busy; // time spent working [us] (wraps around)
+  uint32_t busyLast;      // busy at the last report
+} s_task;
+
+typedef struct s_http_stats {
+  unsigned long posts;
+  unsigned long handshakes;
+  unsigned long reused;
+  unsigned long stale;
+  unsigned long lat_last;
+  unsigned long lat_max;
+  unsigned long lat_sum;
+} s_http_stats;
+
+typedef struct s_alert_stats {
+  unsigned long sent;
+  unsigned long failed;
+  unsigned long lat_last;
+  unsigned long lat_max;
+  unsigned long lat_sum;
+  unsigned long wait_last;
+} s_alert_stats;
+
 typedef struct {
   char lat[LOC_SIZE];
   char lon[LOC_SIZE];
   int accuracy = 40000;
 } location_t;
 
+// geolocation response being parsed (location_parse())
+typedef struct s_location_parse {
+  jsonp p;
+  location_t loc;
+} s_location_parse;
+
 typedef struct {
   const char* zone;
   const char* ntpServer;
@@ -175,7 +506,7 @@ const char AUX_DEC4IOT[] PROGMEM = R"raw(
             {
                 "name": "caption2",
                 "type": "ACText",
-                "value": "BLE server MAC (Puck.js):",
+                "value": "BLE server MACs (Puck.js):",
                 "style": "font-family:Arial;font-weight:bold;text-align:center;margin-bottom:10px;color:DarkSlateBlue"
             },
             {
@@ -184,28 +515,21 @@ const char AUX_DEC4IOT[] PROGMEM = R"raw(
                 "value": "<br>"
             },
             {
-                "name": "mac1",
-                "type": "ACInput",
-                "label": "MAC 1",
-                "pattern": "^([0-9A-Fa-f]{2}[:]){5}([0-9A-Fa-f]{2})$"
-            },
-            {
-                "name": "mac2",
-                "type": "ACInput",
-                "label": "MAC 2",
-                "pattern": "^([0-9A-Fa-f]{2}[:]){5}([0-9A-Fa-f]{2})$"
+                "name": "macs",
+                "type": "ACTextarea",
+                "label": "MACs (one per line)",
+                "placeholder": "xx:xx:xx:xx:xx:xx"
             },
             {
-                "name": "mac3",
-                "type": "ACInput",
-                "label": "MAC 3",
-                "pattern": "^([0-9A-Fa-f]{2}[:]){5}([0-9A-Fa-f]{2})$"
+                "name": "newline5",
+                "type": "ACElement",
+                "value": "<br>"
             },
             {
-                "name": "mac4",
-                "type": "ACInput",
-                "label": "MAC 4",
-                "pattern": "^([0-9A-Fa-f]{2}[:]){5}([0-9A-Fa-f]{2})$"
+                "name": "advert",
+                "type": "ACCheckbox",
+                "label": "Advertisement mode (no connections, applies after restart)",
+                "checked": false
             },
             {
                 "name": "newline4",
@@ -259,14 +583,58 @@ const char *mozillaApi =
 
 int TZindex = 0;
 
-char myMacs[MAX_DEVICE][MAC_SIZE] = {MAC_1, MAC_2, MAC_3, MAC_4};
+static const char *defaultMacs[] = {MAC_1, MAC_2, MAC_3, MAC_4};
+static uint64_t myMacs[MAX_MACS];
+static int macCount = 0;
+// myMacs and macCount: written by the portal (saveOn()) while the ingest task
+// rebuilds the MAC table from them
+static portMUX_TYPE macMux = portMUX_INITIALIZER_UNLOCKED;
 
 static location_t location;
-static s_device myDev[MAX_DEVICE];
+// the MAC table is rebuilt into the unused half and then published, lookups
+// (BLE task) never see a table under construction
+static s_mac_entry macTabs[2][MAC_TAB_SIZE];
+static s_mac_entry *macTab = macTabs[0];
+static s_chr_entry chrTab[CHR_TAB_SIZE];
+static s_device *myDev = NULL;
+static int devCount = 0;
 static boolean doScan = false;
 static boolean isConfigured = false;
-static WiFiClientSecure *client;
-static HTTPClient http;
+static s_conn myConn[MAX_CONN];
+static s_http myHttp[MAX_INFLIGHT];
+static s_http_stats httpStats;
+static event_ring myEvents;
+static alert_ring myAlerts;
+static s_alert_stats alertStats;
+static int64_t clockOffset[2];
+static uint8_t clockSlot = 0;
+static unsigned long clockAnchor = 0;
+static volatile bool clockNotify = false;
+static pqueue myQueue;
+static boolean hasQueue = false;
+static char queueBuf[DATA_SIZE + PACK_SIZE + 1];
+// the stored pack in flight (queueBusy: one at a time)
+static char queueSend[PACK_SIZE];
+static bool queueBusy = false;
+static uint32_t queueTail = 0;
+static unsigned long queueRetry = 0;
+static char sinkBuf[SINK_SIZE];
+static char measureBuf[SINK_SIZE];
+static char packBuf[PACK_BUFS][PACK_SIZE];
+static char alertBuf[MAX_INFLIGHT][ALERT_SIZE];
+static QueueHandle_t packQueue = NULL;
+static QueueHandle_t packFree = NULL;
+static QueueHandle_t resultQueue = NULL;
+static s_task myTasks[MAX_TASKS];
+// longest time a notification waited in the event ring since the last task
+// report [ms]
+static volatile unsigned long eventLag = 0;
+static volatile bool macDirty = false;
+// URLs of the device slots: changed by the assembly task (send_url()) while
+// the BLE task copies them into alerts and the uplink task reads them
+static portMUX_TYPE linkMux = portMUX_INITIALIZER_UNLOCKED;
+static char senmlLoc[SENML_LOC_SIZE];
+static int senmlLocLen = 0;
 
 // AutoConnect
 AutoConnect Portal;
@@ -275,8 +643,24 @@ AutoConnectConfig Config;
 // EEPROM storage
 Preferences pref;
 
-// BLE Service
-BLEScan *pBLEScan = NULL;
+// BLE scan
+static volatile bool scanRunning = false;
+static SemaphoreHandle_t connLock = NULL;
+static SemaphoreHandle_t chrLock = NULL;
+static volatile bool scanDone = false;
+static void (*scanCallback)(void) = NULL;
+static unsigned long scanStopped = 0;
+static unsigned long scanPause = 0;
+static volatile bool scanWhitelist = false;
+static bool scanActive = false;
+static bool scanDirty = true;
+static volatile uint32_t scanSeen = 0;
+static volatile uint32_t scanAccepted = 0;
+// advertisement mode (sensor frames instead of connections)
+static bool advMode = false;
+static int connMax = 1;
+static volatile uint32_t advFrames = 0;
+static volatile uint32_t advRepeats = 0;
 
 // Service UUID
 static BLEUUID serviceUUID("34defd2c-c8fe-b18e-9a70-591970cba32b");
@@ -290,50 +674,362 @@ static BLEUUID batCharacteristicUUID("2a19");
 static BLEUUID btnCharacteristicUUID("2ae2");
 // Movement Characteristic
 static BLEUUID movCharacteristicUUID("2c01");
+// Sensor Frame Characteristic (all sensors in one notification, see adv.h)
+static BLEUUID frameCharacteristicUUID("34defd2d-c8fe-b18e-9a70-591970cba32b");
 
 /***************************************************************** FUNCTIONS */
 
-/// @brief  load MAC addresses from preferences (EEPROM)
-/// @return int (1 if success; otherwise 0)
-int getMACs(void) {
+/// @brief notifies task id of new work; nothing happens before the tasks
+///        have been started (tasks_start())
+/// @return
+void task_wake(int id) {
+  if (myTasks[id].handle != NULL) {
+    xTaskNotifyGive(myTasks[id].handle);
+  }
+  return;
+}
 
-  size_t len = 0;
-  int ret = 0;
+/// @brief adds the time since t0 (esp_timer_get_time()) to the time task id
+///        spent working
+/// @return
+void task_busy(int id, int64_t t0) {
+  myTasks[id].busy += (uint32_t)(esp_timer_get_time() - t0);
+  return;
+}
 
-  char tmp[MAC_SIZE];
+/// @brief  packs a BLE device address into an integer (0 if invalid)
+/// @return uint64_t
+uint64_t mac_pack(const uint8_t *bda) {
+  uint64_t mac = 0;
 
-  len = pref.getString("mac0", tmp, MAC_SIZE);
-  if (len > 0) {
-    memcpy(myMacs[0], (const char*)tmp, MAC_SIZE);
-    Serial.printf("MAC0: %s\n", myMacs[0]);
-    len = 0;
-    ret = 1;
+  for (int i = 0; i < 6; i++) {
+    mac = (mac << 8) | bda[i];
   }
-  len = pref.getString("mac1", tmp, MAC_SIZE);
-  if (len > 0) {
-    memcpy(myMacs[1], (const char*)tmp, MAC_SIZE);
-    Serial.printf("MAC1: %s\n", myMacs[1]);
-    len = 0;
-    ret = 1;
+  return mac;
+}
+
+/// @brief  parses a MAC address string "xx:xx:xx:xx:xx:xx" (any case)
+/// @return uint64_t (0 if invalid)
+uint64_t mac_parse(const char *s) {
+  uint8_t bda[6];
+  unsigned int v[6];
+
+  if (s == NULL || sscanf(s, "%2x:%2x:%2x:%2x:%2x:%2x", &v[0], &v[1], &v[2],
+                          &v[3], &v[4], &v[5]) != 6) {
+    return 0;
   }
-  len = pref.getString("mac2", tmp, MAC_SIZE);
-  if (len > 0) {
-    memcpy(myMacs[2], (const char*)tmp, MAC_SIZE);
-    Serial.printf("MAC2: %s\n", myMacs[2]);
-    len = 0;
-    ret = 1;
+  for (int i = 0; i < 6; i++) {
+    bda[i] = (uint8_t)v[i];
   }
-  len = pref.getString("mac3", tmp, MAC_SIZE);
-  if (len > 0) {
-    memcpy(myMacs[3], (const char*)tmp, MAC_SIZE);
-    Serial.printf("MAC3: %s\n", myMacs[3]);
-    len = 0;
-    ret = 1;
+  return mac_pack(bda);
+}
+
+/// @brief  unpacks a MAC address packed by mac_pack
+/// @return
+void mac_unpack(uint64_t mac, uint8_t *bda) {
+  for (int i = 5; i >= 0; i--) {
+    bda[i] = (uint8_t)mac;
+    mac >>= 8;
+  }
+  return;
+}
+
+/// @brief  returns the entry of mac in the MAC table tab (size is a power of
+///         two)
+/// @return s_mac_entry pointer (NULL if not found)
+s_mac_entry *mac_probe(s_mac_entry *tab, int size, uint64_t mac) {
+  uint32_t h = (uint32_t)((mac * 0x9E3779B97F4A7C15ULL) >> 32);
+
+  if (mac == 0) {
+    return NULL;
+  }
+  for (int n = 0; n < size; n++) {
+    s_mac_entry *e = &tab[(h + n) & (size - 1)];
+    if (e->mac == mac) {
+      return e;
+    }
+    if (e->mac == 0) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/// @brief  adds mac to the MAC table tab
+/// @return s_mac_entry pointer (NULL if the table is full)
+s_mac_entry *mac_insert(s_mac_entry *tab, int size, uint64_t mac) {
+  uint32_t h = (uint32_t)((mac * 0x9E3779B97F4A7C15ULL) >> 32);
+  s_mac_entry *e = mac_probe(tab, size, mac);
+
+  if (e != NULL) {
+    return e;
+  }
+  for (int n = 0; n < size; n++) {
+    e = &tab[(h + n) & (size - 1)];
+    if (e->mac == 0) {
+      e->mac = mac;
+      e->dev = NO_INDEX;
+      return e;
+    }
+  }
+  return NULL;
+}
+
+/// @brief  returns the current MAC table (MAC_TAB_SIZE entries)
+/// @return s_mac_entry pointer
+s_mac_entry *mac_tab(void) {
+  return __atomic_load_n(&macTab, __ATOMIC_ACQUIRE);
+}
+
+/// @brief  returns the MAC table entry of mac (configured devices only)
+/// @return s_mac_entry pointer (NULL if the MAC is not configured)
+s_mac_entry *mac_find(uint64_t mac) {
+  return mac_probe(mac_tab(), MAC_TAB_SIZE, mac);
+}
+
+/// @brief  takes over the address types learned by scanning from table old
+///         and binds the device slots in use to the entries of table tab
+/// @return
+void mac_carry(s_mac_entry *tab, const s_mac_entry *old) {
+  for (int i = 0; i < MAC_TAB_SIZE; i++) {
+    s_mac_entry *e = mac_probe(tab, MAC_TAB_SIZE, old[i].mac);
+    if (e != NULL && old[i].known) {
+      e->known = true;
+      e->type = old[i].type;
+    }
+  }
+  for (int i = 0; i < MAC_TAB_SIZE; i++) {
+    if (tab[i].dev != NO_INDEX && myDev[tab[i].dev].addr != tab[i].mac) {
+      tab[i].dev = NO_INDEX;
+    }
+  }
+  for (int i = 0; i < devCount; i++) {
+    s_mac_entry *e = mac_probe(tab, MAC_TAB_SIZE, myDev[i].addr);
+    if (e != NULL) {
+      e->dev = i;
+    }
+  }
+  return;
+}
+
+/// @brief  rebuilds the MAC table from the configured MAC addresses; to be
+///         called whenever myMacs changes (ingest task). The new table is
+///         built in the unused half of macTabs and published by a pointer
+///         swap; the old table stays intact until the next rebuild
+/// @return
+void mac_table(void) {
+  s_mac_entry *old = mac_tab();
+  s_mac_entry *tab = (old == macTabs[0]) ? macTabs[1] : macTabs[0];
+  uint64_t macs[MAX_MACS];
+  int n;
+
+  portENTER_CRITICAL(&macMux);
+  n = macCount;
+  memcpy(macs, myMacs, n * sizeof(uint64_t));
+  portEXIT_CRITICAL(&macMux);
+
+  memset(tab, 0, MAC_TAB_SIZE * sizeof(s_mac_entry));
+  for (int i = 0; i < n; i++) {
+    mac_insert(tab, MAC_TAB_SIZE, macs[i]);
+  }
+  mac_carry(tab, old);
+  __atomic_store_n(&macTab, tab, __ATOMIC_RELEASE);
+  // the BLE task may have updated an entry it looked up in the old table
+  // just before the swap
+  mac_carry(tab, old);
+  return;
+}
+
+/// @brief  formats a packed MAC address like BLEAddress::toString()
+/// @return
+void mac_string(uint64_t mac, char *s) {
+  uint8_t bda[6];
+
+  mac_unpack(mac, bda);
+  snprintf(s, MAC_SIZE, "%02x:%02x:%02x:%02x:%02x:%02x", bda[0], bda[1],
+           bda[2], bda[3], bda[4], bda[5]);
+  return;
+}
+
+/// @brief  checks if a configured device is waiting for a direct reconnect
+///         (address type known and backoff not exhausted)
+/// @return bool
+bool mac_direct(s_mac_entry *e) {
+  return e->known && e->tries < RECONNECT_MAX_TRIES;
+}
+
+/// @brief  checks if device dev delivers data (connected or advertising
+///         sensor frames)
+/// @return bool
+bool dev_live(s_device *dev) {
+  return dev->state == D_CONNECTED || dev->state == D_ADVERT;
+}
+
+/// @brief  returns the characteristic table entry of chr
+/// @return s_chr_entry pointer (NULL if not registered)
+s_chr_entry *chr_find(BLERemoteCharacteristic *chr) {
+  uint32_t h = (uint32_t)(uintptr_t)chr * 2654435761u;
+
+  for (int n = 0; n < CHR_TAB_SIZE; n++) {
+    s_chr_entry *e = &chrTab[(h + n) & (CHR_TAB_SIZE - 1)];
+    BLERemoteCharacteristic *p = __atomic_load_n(&e->chr, __ATOMIC_ACQUIRE);
+    if (p == chr) {
+      return (e->dev != CHR_DELETED) ? e : NULL;
+    }
+    if (p == NULL) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/// @brief  maps characteristic chr to device slot dev; writers (connection
+///         setup tasks) are serialized by chrLock, the BLE task only reads
+/// @return
+void chr_add(BLERemoteCharacteristic *chr, int dev, uint8_t type) {
+  uint32_t h = (uint32_t)(uintptr_t)chr * 2654435761u;
+  s_chr_entry *e = NULL;
+
+  xSemaphoreTake(chrLock, portMAX_DELAY);
+  for (int n = 0; n < CHR_TAB_SIZE; n++) {
+    s_chr_entry *t = &chrTab[(h + n) & (CHR_TAB_SIZE - 1)];
+    if (t->chr == chr) {
+      e = t;
+      break;
+    }
+    if (e == NULL && (t->chr == NULL || t->dev == CHR_DELETED)) {
+      e = t;
+    }
+    if (t->chr == NULL) {
+      break;
+    }
+  }
+  if (e == NULL) {
+    xSemaphoreGive(chrLock);
+    Serial.println("ERROR: characteristic table full");
+    return;
+  }
+  e->type = type;
+  e->dev = (uint8_t)dev;
+  __atomic_store_n(&e->chr, chr, __ATOMIC_RELEASE);
+  xSemaphoreGive(chrLock);
+  return;
+}
+
+/// @brief  removes the characteristics of device slot dev (the entries are
+///         marked deleted so that probe chains stay intact; deleted entries
+///         at the end of a chain are reclaimed)
+/// @return
+void chr_purge(int dev) {
+  xSemaphoreTake(chrLock, portMAX_DELAY);
+  for (int i = 0; i < CHR_TAB_SIZE; i++) {
+    if (chrTab[i].chr != NULL && chrTab[i].dev == dev) {
+      chrTab[i].dev = CHR_DELETED;
+    }
+  }
+  // a deleted entry followed by an empty one ends its probe chains, it is
+  // emptied (repeated until chains that ended in deleted entries are gone)
+  for (bool again = true; again;) {
+    again = false;
+    for (int i = 0; i < CHR_TAB_SIZE; i++) {
+      s_chr_entry *e = &chrTab[i];
+      if (e->chr != NULL && e->dev == CHR_DELETED &&
+          chrTab[(i + 1) & (CHR_TAB_SIZE - 1)].chr == NULL) {
+        __atomic_store_n(&e->chr, (BLERemoteCharacteristic *)NULL,
+                         __ATOMIC_RELEASE);
+        again = true;
+      }
+    }
+  }
+  xSemaphoreGive(chrLock);
+  return;
+}
+
+/// @brief  stores the configured MAC addresses as one blob in preferences
+///         (EEPROM); the keys mac0..mac3 of older versions are removed
+/// @return
+void reg_save(void) {
+  s_registry reg;
+  char key[8];
+
+  reg.version = REG_VERSION;
+  reg.count = (uint8_t)macCount;
+  for (int i = 0; i < macCount; i++) {
+    mac_unpack(myMacs[i], reg.mac[i]);
   }
+  pref.putBytes(REG_KEY, &reg, offsetof(s_registry, mac) + 6 * macCount);
+  for (int i = 0; i < 4; i++) {
+    snprintf(key, sizeof(key), "mac%d", i);
+    pref.remove(key);
+  }
+  return;
+}
+
+/// @brief  load MAC addresses from preferences (EEPROM); MACs stored by
+///         older versions (mac0..mac3) are converted
+/// @return int (1 if success; otherwise 0)
+int reg_load(void) {
+  s_registry reg;
+  size_t len = 0;
+  int ret = 0;
+
+  len = pref.getBytes(REG_KEY, &reg, sizeof(reg));
+  if (len >= offsetof(s_registry, mac) && reg.version == REG_VERSION &&
+      reg.count <= MAX_MACS &&
+      len == offsetof(s_registry, mac) + 6 * (size_t)reg.count) {
+    macCount = 0;
+    for (int i = 0; i < reg.count; i++) {
+      uint64_t mac = mac_pack(reg.mac[i]);
+      if (mac != 0) {
+        myMacs[macCount++] = mac;
+      }
+    }
+    ret = 1;
+  } else {
+    char key[8];
+    char tmp[MAC_SIZE];
 
+    macCount = 0;
+    for (int i = 0; i < 4; i++) {
+      uint64_t mac = mac_parse(defaultMacs[i]);
+
+      snprintf(key, sizeof(key), "mac%d", i);
+      if (pref.getString(key, tmp, MAC_SIZE) > 0 && mac_parse(tmp) != 0) {
+        mac = mac_parse(tmp);
+        ret = 1;
+      }
+      myMacs[macCount++] = mac;
+    }
+    if (ret == 1) {
+      reg_save();
+    }
+  }
+  for (int i = 0; i < macCount; i++) {
+    char tmp[MAC_SIZE];
+    mac_string(myMacs[i], tmp);
+    Serial.printf("MAC%d: %s\n", i, tmp);
+  }
   return ret;
 }
 
+/// @brief  returns the number of device slots: the BLE controller's limit
+///         of simultaneous connections (at most MAX_DEVICE); in
+///         advertisement mode every configured MAC gets a slot
+/// @return int
+int dev_slots(void) {
+  esp_bt_controller_config_t cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+  int n = cfg.ble_max_conn;
+
+  if (n < 1) {
+    n = 1;
+  }
+  connMax = (n > MAX_DEVICE) ? MAX_DEVICE : n;
+  if (advMode && macCount > connMax) {
+    return macCount;
+  }
+  return connMax;
+}
+
 /// @brief  loadOn event handler
 /// @return string
 String loadOn(AutoConnectAux& aux, PageArgument& args) {
@@ -344,6 +1040,19 @@ String loadOn(AutoConnectAux& aux, PageArgument& args) {
     tz.add(String(TZ[n].zone));
   }
 
+  AutoConnectTextarea& macs = aux.getElement<AutoConnectTextarea>("macs");
+  String list;
+
+  for (int i = 0; i < macCount; i++) {
+    char tmp[MAC_SIZE];
+    mac_string(myMacs[i], tmp);
+    list += String(tmp) + "\n";
+  }
+  macs.value = list;
+
+  AutoConnectCheckbox& advert = aux.getElement<AutoConnectCheckbox>("advert");
+  advert.checked = pref.getBool(ADV_KEY, advMode);
+
   return String("");
 }
 
@@ -353,27 +1062,44 @@ String saveOn(AutoConnectAux& aux, PageArgument& args) {
 
   AutoConnectAux* page = Portal.aux(Portal.where());
   
-  AutoConnectInput& mac1 = page->getElement<AutoConnectInput>("mac1");
-  AutoConnectInput& mac2 = page->getElement<AutoConnectInput>("mac2");
-  AutoConnectInput& mac3 = page->getElement<AutoConnectInput>("mac3");
-  AutoConnectInput& mac4 = page->getElement<AutoConnectInput>("mac4");
-
-  if (mac1.value) {
-    memcpy(myMacs[0], (const char*)mac1.value.c_str(), MAC_SIZE);
-    pref.putString("mac0", myMacs[0]);
-  }
-  if (mac2.value) {
-    memcpy(myMacs[1], (const char*)mac2.value.c_str(), MAC_SIZE);
-    pref.putString("mac1", myMacs[1]);
-  }
-  if (mac2.value) {
-    memcpy(myMacs[2], (const char*)mac3.value.c_str(), MAC_SIZE);
-    pref.putString("mac2", myMacs[2]);
+  AutoConnectTextarea& macs = page->getElement<AutoConnectTextarea>("macs");
+  const char *p = macs.value.c_str();
+  uint64_t list[MAX_MACS];
+  int n = 0;
+
+  // MACs separated by new lines, blanks, commas or semicolons
+  while (*p != '\0' && n < MAX_MACS) {
+    char tmp[MAC_SIZE];
+    size_t len = strcspn(p, " \t\r\n,;");
+    if (len > 0 && len < MAC_SIZE) {
+      memcpy(tmp, p, len);
+      tmp[len] = '\0';
+      uint64_t mac = mac_parse(tmp);
+      bool dup = false;
+      for (int k = 0; k < n; k++) {
+        dup |= (list[k] == mac);
+      }
+      if (mac != 0 && !dup) {
+        list[n++] = mac;
+      }
+    }
+    p += len;
+    if (*p != '\0') {
+      p++;
+    }
   }
-  if (mac3.value) {
-    memcpy(myMacs[3], (const char*)mac4.value.c_str(), MAC_SIZE);
-    pref.putString("mac3", myMacs[3]);
+  if (n > 0) {
+    portENTER_CRITICAL(&macMux);
+    memcpy(myMacs, list, n * sizeof(uint64_t));
+    macCount = n;
+    portEXIT_CRITICAL(&macMux);
+    reg_save();
   }
+  // the MAC table is rebuilt by the ingest task
+  macDirty = true;
+
+  AutoConnectCheckbox& advert = page->getElement<AutoConnectCheckbox>("advert");
+  pref.putBool(ADV_KEY, advert.checked);
 
   AutoConnectSelect& tz = page->getElement<AutoConnectSelect>("timezone");
 
@@ -393,7 +1119,7 @@ String saveOn(AutoConnectAux& aux, PageArgument& args) {
   AutoConnectText&  url = aux.getElement<AutoConnectText>("url");
   url.value = String("http://") + WiFi.localIP().toString() + String("/dec4iot"); ;
 
-  pBLEScan->setActiveScan(true);
+  scanActive = true;
   isConfigured = true;
   
   return String("");
@@ -418,211 +1144,818 @@ String mac_to_string(uint8_t *macAddress) {
   return String(macStr);
 }
 
-/// @brief  looks for surrounding SSIDs
-/// @return JSON including WiFi information
-String get_surrounding_wifi_json() {
-  String wifiArray = "[\n";
-  int8_t numWifi = WiFi.scanNetworks();
+/// @brief  splits an http(s) URL into host and port
+/// @return bool (true if host could be parsed)
+bool url_host_port(const char *url, char *host, uint16_t *port) {
+  const char *p = url;
+  size_t len = 0;
 
-  for (uint8_t i = 0; i < numWifi; i++) { // numWifi; i++) {
-    wifiArray += "{\"macAddress\":\"" + mac_to_string(WiFi.BSSID(i)) + "\",";
-    wifiArray += "\"signalStrength\":" + String(WiFi.RSSI(i)) + ",";
-    wifiArray += "\"channel\":" + String(WiFi.channel(i)) + "}";
-    if (i < (numWifi - 1)) {
-      wifiArray += ",\n";
+  if (url == NULL) {
+    return false;
+  }
+  *port = 443;
+  if (strncmp(p, "https://", 8) == 0) {
+    p += 8;
+  } else if (strncmp(p, "http://", 7) == 0) {
+    p += 7;
+    *port = 80;
+  }
+  while (p[len] != '\0' && p[len] != ':' && p[len] != '/') {
+    len++;
+  }
+  if (len == 0 || len > HOST_SIZE - 1) {
+    return false;
+  }
+  memcpy(host, p, len);
+  host[len] = '\0';
+  if (p[len] == ':') {
+    *port = (uint16_t)atoi(&p[len + 1]);
+  }
+  return true;
+}
+
+/// @brief  returns the pooled connection for the host and port of url; the
+///         least recently used entry which no request is using is recycled
+///         if the host is new
+/// @return s_conn pointer (NULL if url is invalid or all entries are busy)
+s_conn *conn_get(const char *url) {
+  char host[HOST_SIZE];
+  uint16_t port;
+  s_conn *c = NULL;
+
+  if (!url_host_port(url, host, &port)) {
+    return NULL;
+  }
+  for (int i = 0; i < MAX_CONN; i++) {
+    if (myConn[i].port == port && strcmp(myConn[i].host, host) == 0) {
+      return &myConn[i];
+    }
+    if (myConn[i].busy == NULL && (c == NULL || myConn[i].used < c->used)) {
+      c = &myConn[i];
     }
   }
-  WiFi.scanDelete();
-  wifiArray += "]";
+  if (c == NULL) {
+    return NULL;
+  }
+  if (c->client == NULL) {
+    c->client = new WiFiClientSecure;
+    c->client->setInsecure();
+    c->client->setHandshakeTimeout((HTTP_TLS_MS + 999) / 1000);
+  } else {
+    c->client->stop();
+  }
+  snprintf(c->host, HOST_SIZE, "%s", host);
+  c->port = port;
+  c->used = millis();
 
-  return wifiArray;
+  return c;
 }
 
-/// @brief  gets location via Mozilla API
-/// @return location object
-location_t get_location() {
-  location_t location;
+/// @brief  returns the path of an http(s) URL ("/" if it has none)
+/// @return const char pointer (into url)
+const char *url_path(const char *url) {
+  const char *p = strstr(url, "://");
+
+  p = (p != NULL) ? p + 3 : url;
+  p = strchr(p, '/');
 
-  if (WiFi.status() == WL_CONNECTED) {
+  return (p != NULL) ? p : "/";
+}
 
-    client->setInsecure();
+/// @brief  write function of a jsonb sink printing to a Print (Serial or a
+///         connection)
+/// @return size_t (number of bytes written)
+size_t sink_print(void *ctx, const char *data, size_t len) {
+  return ((Print *)ctx)->write((const uint8_t *)data, len);
+}
 
-    http.begin(*client, mozillaApi);
+/// @brief  write function of a jsonb sink printing the bytes as hex to a
+///         Print (binary bodies on the serial console)
+/// @return size_t (number of bytes written)
+size_t sink_hex(void *ctx, const char *data, size_t len) {
+  Print *p = (Print *)ctx;
 
-    http.addHeader("Content-Type", "application/json");
-    http.addHeader("User-Agent", "ESP32");
+  for (size_t i = 0; i < len; i++) {
+    p->printf("%02x", (uint8_t)data[i]);
+  }
+  return len;
+}
 
-    String body = "{\"wifiAccessPoints\":" + get_surrounding_wifi_json() + "}";
+/// @brief  write function of a jsonb sink sending every window as one chunk
+///         (chunked transfer encoding)
+/// @return size_t (number of bytes written; 0 on error)
+size_t sink_chunk(void *ctx, const char *data, size_t len) {
+  Print *p = (Print *)ctx;
+  char head[12];
+  size_t n = snprintf(head, sizeof(head), "%x\r\n", (unsigned)len);
+
+  if (p->write((const uint8_t *)head, n) != n ||
+      p->write((const uint8_t *)data, len) != len ||
+      p->write((const uint8_t *)"\r\n", 2) != 2) {
+    return 0;
+  }
+  return len;
+}
 
-    Serial.printf("JSON:%s\n", body.c_str());
+/// @brief  passes a request body to write (with the sink window sinkBuf)
+/// @return size_t (number of bytes written; 0 on error)
+size_t body_stream(const s_body *body, jsonb_write write, void *ctx) {
+  jsonb_sink s;
 
-    int httpResponseCode = http.POST(body);
-    Serial.print("HTTP Response code: ");
-    Serial.println(httpResponseCode);
+  jsonb_sink_init(&s, sinkBuf, SINK_SIZE, write, ctx);
+  if (body->write(&s, body->arg) < 0 || jsonb_sink_flush(&s) != JSONB_OK) {
+    return 0;
+  }
+  return jsonb_sink_length(&s);
+}
 
-    // httpCode will be negative on error
-    if (httpResponseCode > 0) {
-      if (httpResponseCode == HTTP_CODE_OK) {
-        String response = http.getString();
-        Serial.println(response);
-
-        int index = response.indexOf("\"lat\":");
-        if (index != -1) {
-          String tempStr = response.substring(index);
-          tempStr =
-              tempStr.substring(tempStr.indexOf(":") + 1, tempStr.indexOf(","));
-          snprintf(location.lat, LOC_SIZE, "%s", tempStr);
-          Serial.printf("Lat: %s\n", location.lat);
-        }
+/// @brief  request body holding stored bytes (s_raw)
+/// @return int (negative on error)
+int body_raw(jsonb_sink *s, void *arg) {
+  s_raw *raw = (s_raw *)arg;
 
-        index = response.indexOf("\"lng\":");
-        if (index != -1) {
-          String tempStr = response.substring(index);
-          tempStr =
-              tempStr.substring(tempStr.indexOf(":") + 1, tempStr.indexOf("}"));
-          snprintf(location.lon, LOC_SIZE, "%s", tempStr);
-          Serial.printf("Lon: %s\n", location.lon);
-        }
+  return jsonb_sink_put(s, raw->buf, raw->len);
+}
 
-        index = response.indexOf("\"accuracy\":");
-        if (index != -1) {
-          String tempStr = response.substring(index);
-          tempStr = tempStr.substring(tempStr.indexOf(":") + 1,
-                                      tempStr.indexOf("\n"));
-          location.accuracy = tempStr.toFloat();
-          Serial.println("Accuracy: " + String(location.accuracy) + "\n");
-        }
-      }
-    } else {
-      Serial.printf("[HTTPS] POST... failed, error: %s\n",
-                    http.errorToString(httpResponseCode).c_str());
+/// @brief  returns a free request slot; it is taken by http_post(), so the
+///         slot may be filled in (alert, raw, resp) or left as it is
+/// @return s_http pointer (NULL if MAX_INFLIGHT requests are in flight)
+s_http *http_slot(void) {
+  for (int i = 0; i < MAX_INFLIGHT; i++) {
+    if (myHttp[i].stage == H_IDLE) {
+      return &myHttp[i];
     }
-
-    // Free resources
-    http.end();
-    client->stop();
   }
-  return location;
+  return NULL;
 }
 
-/// @brief  resets device data
+/// @brief  submits a request posting body to url (DATA_SIZE at most) in
+///         slot req; redirects are followed, after errors url0 is tried
+///         again. Nothing is sent before the next http_poll(), which calls
+///         done (if not NULL) once the request has finished
 /// @return
-void reset_data(s_data *d) {
-  d->valid = false;
-  d->bat = 0;
-  d->f_bat = false;
-  d->temp = 0;
-  d->f_temp = false;
-  d->mov = 0;
-  d->f_mov = false;
-  d->btn = 0;
-  d->f_btn = false;
-  d->tm = 0;
+void http_post(s_http *req, const char *url, const char *url0,
+               const s_body *body, http_done done) {
+  snprintf(req->url, DATA_SIZE, "%s", url);
+  snprintf(req->url0, DATA_SIZE, "%s", url0);
+  snprintf(req->from, DATA_SIZE, "%s", url);
+  req->body = *body;
+  req->done = done;
+  req->conn = NULL;
+  req->stale = false;
+  req->redirs = 0;
+  req->attempts = 0;
+  req->code = 0;
+  req->t0 = millis();
+  req->ts = req->t0;
+  req->wait = 0;
+  req->stage = H_WAIT;
 
   return;
 }
 
-/// @brief  resets device with index i
+/// @brief  finishes a request with code and frees its slot
 /// @return
-void reset_device(int i) {
-  if (i < 0 || i > MAX_DEVICE - 1) {
-    return;
-  }
-  myDev[i].state = D_DISCONNECTED;
-  sprintf(myDev[i].mac, "%s", "00:00:00:00:00:00");
-  myDev[i].pClient = NULL;
-  myDev[i].pDevice = NULL;
-  myDev[i].batCharacteristic = NULL;
-  myDev[i].btnCharacteristic = NULL;
-  myDev[i].movCharacteristic = NULL;
-  myDev[i].tempCharacteristic = NULL;
-  myDev[i].index = 0;
-  for (int j = 0; j < MAX_POOL; j++) {
-    s_data d = myDev[i].data[j];
-    reset_data(&d);
+void http_finish(s_http *req, int code) {
+  req->code = code;
+  if (req->done != NULL) {
+    req->done(req, code, millis() - req->t0);
   }
+  req->done = NULL;
+  req->resp = NULL;
+  req->ctx = NULL;
+  req->stage = H_IDLE;
+
   return;
 }
 
-/// @brief  resets all devices
+/// @brief  lets a request wait ms before its next attempt
 /// @return
-void reset_devices(void) {
-  for (int i = 0; i < MAX_DEVICE; i++) {
-    reset_device(i);
-  }
-  return;
-}
+void http_wait(s_http *req, unsigned long ms) {
+  req->stage = H_WAIT;
+  req->ts = millis();
+  req->wait = ms;
 
-/// @brief  checks sensor dataset
-/// @return bool (true if dataset is complete)
-bool check_data(s_data *d) {
-  return (d->f_bat & d->f_btn & d->f_mov & d->f_temp & d->valid);
+  return;
 }
 
-/// @brief  stores battery value to dataset
+/// @brief  ends an attempt with code (HTTP status code; HTTPC_ERROR_* if
+///         negative) and releases its connection. An attempt on a kept-alive
+///         socket the server has closed meanwhile is repeated once on a
+///         fresh connection; then the request follows a redirect, is
+///         retried after HTTP_RETRY_MS or finishes
 /// @return
-void set_data_bat(s_data *d, int val) {
-  if (d->f_bat == false) {
-    d->bat = val;
-    d->f_bat = true;
-    if (d->f_btn & d->f_mov & d->f_temp) {
-      d->valid = true;
+void http_end(s_http *req, int code) {
+  s_conn *c = req->conn;
+
+  c->used = millis();
+  if (code < 0 || req->close) {
+    c->client->stop();
+  }
+  c->busy = NULL;
+  req->conn = NULL;
+
+  if (code < 0 && req->warm && !req->stale) {
+    // server dropped the idle socket; retry on a fresh connection
+    httpStats.stale++;
+    req->stale = true;
+    http_wait(req, 0);
+    return;
+  }
+  req->stale = false;
+  // only attempts answered with a status line count as posts (handshakes
+  // are counted when the connection is established)
+  if (req->stage > H_STATUS) {
+    if (req->warm) {
+      httpStats.reused++;
     }
+    httpStats.posts++;
+    httpStats.lat_last = c->used - req->ta;
+    httpStats.lat_sum += httpStats.lat_last;
+    if (httpStats.lat_last > httpStats.lat_max) {
+      httpStats.lat_max = httpStats.lat_last;
+    }
+    Serial.printf("HTTP [%s:%u] posts: %lu handshakes: %lu avoided: %lu "
+                  "stale: %lu latency: %lu ms (avg %lu, max %lu)\n",
+                  c->host, c->port, httpStats.posts, httpStats.handshakes,
+                  httpStats.reused, httpStats.stale, httpStats.lat_last,
+                  httpStats.lat_sum / httpStats.posts, httpStats.lat_max);
   }
-  return;
-}
-
-/// @brief  stores temperature value to dataset
-void set_data_temp(s_data *d, int val) {
-  if (d->f_temp == false) {
-    d->temp = val;
-    d->f_temp = true;
-    if (d->f_bat & d->f_btn & d->f_mov) {
-      d->valid = true;
+  Serial.print("HTTP Response code: ");
+  Serial.println(code);
+
+  // check for redirect response
+  if ((code == HTTP_CODE_MOVED_PERMANENTLY) ||
+      (code == HTTP_CODE_PERMANENT_REDIRECT)) {
+    const char *next = req->location;
+    if (next[0] == '\0') {
+      next = req->url0;
+    }
+    Serial.print("HTTP Location header: ");
+    Serial.println(next);
+    snprintf(req->url, DATA_SIZE, "%s", next);
+    if (++req->redirs < MAX_REDIR) {
+      http_wait(req, 0);
+      return;
     }
   }
-  return;
-}
-
-/// @brief  stores movement value to dataset
-/// @return
-void set_data_mov(s_data *d, int val) {
-  if (d->f_mov == false) {
-    d->mov = val;
-    d->f_mov = true;
-    if (d->f_bat & d->f_btn & d->f_temp) {
-      d->valid = true;
+  // retry after error; reset url
+  if (code < 0) {
+    snprintf(req->url, DATA_SIZE, "%s", req->url0);
+    if (++req->attempts < MAX_ATTEMPTS) {
+      http_wait(req, HTTP_RETRY_MS);
+      return;
     }
   }
+  // failed on sending request
+  if ((req->redirs == MAX_REDIR) || (req->attempts == MAX_ATTEMPTS)) {
+    Serial.print("sending request failed on: ");
+    Serial.println(req->url);
+  }
+  http_finish(req, code);
+
   return;
 }
 
-/// @brief  stores button value to dataset
-/// @return
-void set_data_btn(s_data *d, int val) {
-  if (d->f_btn == false) {
-    d->btn = val;
-    d->f_btn = true;
-    if (d->f_bat & d->f_mov & d->f_temp) {
-      d->valid = true;
-    }
+/// @brief  write function of a jsonb sink sending a request body on the
+///         connection of the request (ctx) within HTTP_WRITE_MS
+/// @return size_t (number of bytes written; 0 on error or timeout)
+size_t http_sink(void *ctx, const char *data, size_t len) {
+  s_http *req = (s_http *)ctx;
+  Print *p = (Print *)req->conn->client;
+
+  if (millis() - req->ts > HTTP_WRITE_MS) {
+    return 0;
   }
-  return;
+  return HTTP_CHUNKED ? sink_chunk(p, data, len) : sink_print(p, data, len);
 }
 
-/// @brief  stores id string to dataset
+/// @brief  H_WAIT: starts the next attempt once its time has come and the
+///         connection to the host of the request is free
 /// @return
-void set_data_id(s_device *d, char *id) {
-  if (id == NULL) {
+void http_begin(s_http *req) {
+  char host[HOST_SIZE];
+  uint16_t port;
+
+  if (millis() - req->ts < req->wait) {
     return;
   }
-  if (strlen(id) > DATA_SIZE - 1) {
+  if (WiFi.status() != WL_CONNECTED) {
+    http_finish(req, 0);
     return;
   }
-  sprintf(d->id, "%s", id);
-
-  return;
-}
+  if (!url_host_port(req->url, host, &port)) {
+    Serial.printf("invalid URL: %s\n", req->url);
+    snprintf(req->url, DATA_SIZE, "%s", req->url0);
+    http_finish(req, 0);
+    return;
+  }
+  s_conn *c = conn_get(req->url);
+  if (c == NULL || c->busy != NULL) {
+    return;
+  }
+  Serial.printf("HTTP URL: %s\n", req->url);
+  c->busy = req;
+  req->conn = c;
+  req->warm = c->client->connected();
+  req->ta = millis();
+  req->ts = req->ta;
+  req->stage = req->warm ? H_WRITE : H_CONNECT;
+
+  return;
+}
+
+/// @brief  H_CONNECT: opens the connection (blocks for at most
+///         HTTP_CONNECT_MS + HTTP_TLS_MS)
+/// @return
+void http_connect(s_http *req) {
+  s_conn *c = req->conn;
+
+  if (!c->client->connect(c->host, c->port, HTTP_CONNECT_MS)) {
+    http_end(req, HTTPC_ERROR_CONNECTION_REFUSED);
+    return;
+  }
+  httpStats.handshakes++;
+  req->stage = H_WRITE;
+  req->ts = millis();
+
+  return;
+}
+
+/// @brief  H_WRITE: sends the request head and streams the body into the
+///         socket through the sink window, so the memory used does not
+///         depend on its length
+/// @return
+void http_write(s_http *req) {
+  s_conn *c = req->conn;
+  char head[2 * HTTP_LINE_SIZE];
+  char host[HOST_SIZE + 8];
+  size_t len = 0;
+
+  req->ts = millis();
+  if (!HTTP_CHUNKED &&
+      (len = body_stream(&req->body, jsonb_discard, NULL)) == 0) {
+    http_end(req, HTTPC_ERROR_ENCODING);
+    return;
+  }
+  if (c->port == 443 || c->port == 80) {
+    snprintf(host, sizeof(host), "%s", c->host);
+  } else {
+    snprintf(host, sizeof(host), "%s:%u", c->host, c->port);
+  }
+  size_t n = snprintf(head, sizeof(head),
+                      "POST %s HTTP/1.1\r\nHost: %s\r\n"
+                      "User-Agent: ESP32\r\nConnection: keep-alive\r\n"
+                      "Content-Type: %s\r\n",
+                      url_path(req->url), host, req->body.type);
+  if (HTTP_CHUNKED) {
+    n += snprintf(head + n, sizeof(head) - n,
+                  "Transfer-Encoding: chunked\r\n\r\n");
+  } else {
+    n += snprintf(head + n, sizeof(head) - n, "Content-Length: %u\r\n\r\n",
+                  (unsigned)len);
+  }
+  if (n >= sizeof(head) || c->client->write((const uint8_t *)head, n) != n) {
+    http_end(req, HTTPC_ERROR_SEND_HEADER_FAILED);
+    return;
+  }
+  if (body_stream(&req->body, http_sink, req) == 0 ||
+      (HTTP_CHUNKED &&
+       c->client->write((const uint8_t *)"0\r\n\r\n", 5) != 5)) {
+    http_end(req, HTTPC_ERROR_SEND_PAYLOAD_FAILED);
+    return;
+  }
+  req->stage = H_STATUS;
+  req->ts = millis();
+  req->n = 0;
+  req->len = -1;
+  req->chunked = false;
+  req->close = false;
+  req->location[0] = '\0';
+
+  return;
+}
+
+/// @brief  reads a line of the response as far as it has arrived into
+///         req->line (without CRLF, truncated to HTTP_LINE_SIZE - 1
+///         characters)
+/// @return int (1 if the line is complete; 0 if more is to come; -1 if the
+///         connection was closed)
+int http_line(s_http *req) {
+  WiFiClientSecure *client = req->conn->client;
+  int ch;
+
+  while ((ch = client->read()) >= 0) {
+    if (ch == '\n') {
+      req->line[req->n] = '\0';
+      req->n = 0;
+      return 1;
+    }
+    if (ch != '\r' && req->n < HTTP_LINE_SIZE - 1) {
+      req->line[req->n++] = (char)ch;
+    }
+  }
+  return client->connected() ? 0 : -1;
+}
+
+/// @brief  reads the body bytes which have arrived (req->len of them; all
+///         if req->len < 0) in chunks of HTTP_CHUNK_SIZE bytes, which are
+///         handed to req->resp (if not NULL)
+/// @return int (1 once req->len bytes have been read; 0 if more is to come;
+///         -1 if the connection was closed)
+int http_body(s_http *req) {
+  WiFiClientSecure *client = req->conn->client;
+  uint8_t chunk[HTTP_CHUNK_SIZE];
+
+  while (req->len != 0) {
+    size_t n = sizeof(chunk);
+    int avail = client->available();
+
+    if (avail <= 0) {
+      return client->connected() ? 0 : -1;
+    }
+    if ((size_t)avail < n) {
+      n = avail;
+    }
+    if (req->len > 0 && (size_t)req->len < n) {
+      n = req->len;
+    }
+    int r = client->read(chunk, n);
+    if (r <= 0) {
+      return 0;
+    }
+    if (req->resp != NULL) {
+      req->resp(req->ctx, (const char *)chunk, r);
+    }
+    if (req->len > 0) {
+      req->len -= r;
+    }
+  }
+  return 1;
+}
+
+/// @brief  H_STATUS .. H_TRAILER: parses the response as far as it has
+///         arrived: status line, headers (Location is kept in
+///         req->location) and body (Content-Length, chunked or up to the
+///         end of the connection); the whole response has to arrive within
+///         HTTP_READ_MS
+/// @return
+void http_read(s_http *req) {
+  while (1) {
+    int r = (req->stage == H_BODY) ? http_body(req) : http_line(req);
+
+    if (r < 0 && req->stage == H_BODY && req->len < 0) {
+      // body up to the end of the connection
+      http_end(req, req->code);
+      return;
+    }
+    if (r < 0) {
+      http_end(req, HTTPC_ERROR_CONNECTION_LOST);
+      return;
+    }
+    if (r == 0) {
+      if (millis() - req->ts > HTTP_READ_MS) {
+        http_end(req, HTTPC_ERROR_READ_TIMEOUT);
+      }
+      return;
+    }
+    char *line = req->line;
+    switch (req->stage) {
+    case H_STATUS:
+      if (strncmp(line, "HTTP/1.", 7) != 0 ||
+          (req->code = atoi(&line[9])) <= 0) {
+        http_end(req, HTTPC_ERROR_NO_HTTP_SERVER);
+        return;
+      }
+      req->close = (line[7] == '0');
+      req->stage = H_HEADER;
+      break;
+    case H_HEADER:
+      if (line[0] == '\0') {
+        // end of the headers
+        if (req->code < 200 || req->code == 204 || req->code == 304) {
+          req->len = 0;
+        }
+        if (req->len == 0) {
+          http_end(req, req->code);
+          return;
+        }
+        if (!req->chunked && req->len < 0) {
+          req->close = true;
+        }
+        req->stage = req->chunked ? H_CHUNK : H_BODY;
+      } else {
+        char *v = strchr(line, ':');
+        if (v == NULL) {
+          break;
+        }
+        *v++ = '\0';
+        while (*v == ' ') {
+          v++;
+        }
+        if (strcasecmp(line, "Content-Length") == 0) {
+          req->len = atol(v);
+        } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+          req->chunked = (strcasecmp(v, "chunked") == 0);
+        } else if (strcasecmp(line, "Connection") == 0) {
+          req->close = (strcasecmp(v, "close") == 0);
+        } else if (strcasecmp(line, "Location") == 0 &&
+                   strlen(v) < DATA_SIZE) {
+          strcpy(req->location, v);
+        }
+      }
+      break;
+    case H_CHUNK:
+      req->len = strtol(line, NULL, 16);
+      req->stage = (req->len > 0) ? H_BODY : H_TRAILER;
+      break;
+    case H_BODY:
+      if (!req->chunked) {
+        http_end(req, req->code);
+        return;
+      }
+      req->stage = H_CHUNK_END;
+      break;
+    case H_CHUNK_END:
+      req->stage = H_CHUNK;
+      break;
+    case H_TRAILER:
+      if (line[0] == '\0') {
+        http_end(req, req->code);
+        return;
+      }
+      break;
+    }
+  }
+}
+
+/// @brief  advances all requests in flight as far as possible; called by
+///         the uplink task
+/// @return
+void http_poll(void) {
+  for (int i = 0; i < MAX_INFLIGHT; i++) {
+    s_http *req = &myHttp[i];
+
+    switch (req->stage) {
+    case H_IDLE:
+      break;
+    case H_WAIT:
+      http_begin(req);
+      break;
+    case H_CONNECT:
+      http_connect(req);
+      break;
+    case H_WRITE:
+      http_write(req);
+      break;
+    default:
+      http_read(req);
+      break;
+    }
+  }
+  return;
+}
+
+/// @brief  closes pooled connections which have been idle for too long
+/// @return
+void conn_gc(void) {
+  for (int i = 0; i < MAX_CONN; i++) {
+    s_conn *c = &myConn[i];
+    if (c->client != NULL && !c->warm && c->busy == NULL &&
+        c->client->connected() && millis() - c->used > CONN_IDLE_MS) {
+      Serial.printf("HTTP [%s:%u] closing idle connection\n", c->host, c->port);
+      c->client->stop();
+    }
+  }
+  return;
+}
+
+/// @brief  keeps the connections to the endpoints of all connected devices
+///         open, so a button alert does not wait for a TLS handshake; a
+///         dropped connection is reopened at most every ALERT_WARM_MS
+/// @return
+void conn_warm(void) {
+  for (int i = 0; i < MAX_CONN; i++) {
+    myConn[i].warm = false;
+  }
+  if (WiFi.status() != WL_CONNECTED) {
+    return;
+  }
+  for (int i = 0; i < devCount; i++) {
+    char url[DATA_SIZE];
+
+    if (!dev_live(&myDev[i])) {
+      continue;
+    }
+    portENTER_CRITICAL(&linkMux);
+    memcpy(url, myDev[i].link->url, DATA_SIZE);
+    portEXIT_CRITICAL(&linkMux);
+    if (url[0] == '\0') {
+      continue;
+    }
+    s_conn *c = conn_get(url);
+    if (c == NULL || c->warm) {
+      continue;
+    }
+    c->warm = true;
+    if (c->busy != NULL || c->client->connected() ||
+        (c->warmed != 0 && millis() - c->warmed < ALERT_WARM_MS)) {
+      continue;
+    }
+    c->warmed = millis();
+    if (c->client->connect(c->host, c->port, HTTP_CONNECT_MS)) {
+      httpStats.handshakes++;
+      c->used = millis();
+      Serial.printf("HTTP [%s:%u] pre-warmed in %lu ms\n", c->host, c->port,
+                    c->used - c->warmed);
+    }
+  }
+  return;
+}
+
+/// @brief  looks for surrounding SSIDs
+/// @return JSON including WiFi information
+String get_surrounding_wifi_json() {
+  String wifiArray = "[\n";
+  int8_t numWifi = WiFi.scanNetworks();
+
+  for (uint8_t i = 0; i < numWifi; i++) { // numWifi; i++) {
+    wifiArray += "{\"macAddress\":\"" + mac_to_string(WiFi.BSSID(i)) + "\",";
+    wifiArray += "\"signalStrength\":" + String(WiFi.RSSI(i)) + ",";
+    wifiArray += "\"channel\":" + String(WiFi.channel(i)) + "}";
+    if (i < (numWifi - 1)) {
+      wifiArray += ",\n";
+    }
+  }
+  WiFi.scanDelete();
+  wifiArray += "]";
+
+  return wifiArray;
+}
+
+/// @brief  write function of a response body: takes the location fields of
+///         a geolocation response (s_location_parse) by their path, so
+///         neither their order nor other fields matter
+/// @return size_t (len)
+size_t location_parse(void *ctx, const char *data, size_t len) {
+  s_location_parse *lp = (s_location_parse *)ctx;
+  size_t left = len;
+  jsonptoken t;
+
+  while ((t = jsonp_next(&lp->p, &data, &left)) > JSONP_MORE) {
+    if (t != JSONP_NUMBER) {
+      continue;
+    }
+    if (jsonp_match(&lp->p, "location.lat")) {
+      snprintf(lp->loc.lat, LOC_SIZE, "%s", lp->p.value);
+    } else if (jsonp_match(&lp->p, "location.lng")) {
+      snprintf(lp->loc.lon, LOC_SIZE, "%s", lp->p.value);
+    } else if (jsonp_match(&lp->p, "accuracy")) {
+      lp->loc.accuracy = (int)strtod(lp->p.value, NULL);
+    }
+  }
+  return len;
+}
+
+/// @brief  gets location via Mozilla API
+/// @return location object
+location_t get_location() {
+  location_t location;
+
+  s_http *req = http_slot();
+
+  if (WiFi.status() == WL_CONNECTED && req != NULL) {
+
+    String body = "{\"wifiAccessPoints\":" + get_surrounding_wifi_json() + "}";
+
+    Serial.printf("JSON:%s\n", body.c_str());
+
+    s_location_parse lp;
+    s_raw raw = {body.c_str(), body.length()};
+    s_body post = {body_raw, &raw, CT_JSON};
+
+    jsonp_init(&lp.p);
+    lp.loc = location;
+    req->resp = location_parse;
+    req->ctx = &lp;
+    http_post(req, mozillaApi, mozillaApi, &post, NULL);
+    // nothing else is sent yet (setup())
+    while (req->stage != H_IDLE) {
+      http_poll();
+      delay(1);
+    }
+    int httpResponseCode = req->code;
+
+    // httpCode will be negative on error
+    if (httpResponseCode > 0) {
+      if (httpResponseCode == HTTP_CODE_OK && jsonp_complete(&lp.p)) {
+        location = lp.loc;
+        Serial.printf("Lat: %s\n", location.lat);
+        Serial.printf("Lon: %s\n", location.lon);
+        Serial.printf("Accuracy: %d\n\n", location.accuracy);
+      } else if (httpResponseCode == HTTP_CODE_OK) {
+        Serial.printf("invalid response (%d)\n", lp.p.err);
+      }
+    } else {
+      Serial.printf("[HTTPS] POST... failed, error: %s\n",
+                    HTTPClient::errorToString(httpResponseCode).c_str());
+    }
+  }
+  return location;
+}
+
+/// @brief  resets the connection state of device slot i; its datasets and
+///         SenML template belong to the assembly task, which resets them on
+///         the E_RESET event of the disconnect (see dev_reset_data())
+/// @return
+void reset_device(int i) {
+  if (i < 0 || i > devCount - 1) {
+    return;
+  }
+  s_mac_entry *e = mac_find(myDev[i].addr);
+  if (e != NULL && e->dev == i) {
+    e->dev = NO_INDEX;
+  }
+  myDev[i].state = D_DISCONNECTED;
+  myDev[i].cached = false;
+  myDev[i].addr = 0;
+  sprintf(myDev[i].link->mac, "%s", "00:00:00:00:00:00");
+  myDev[i].link->pClient = NULL;
+  myDev[i].link->batCharacteristic = NULL;
+  myDev[i].link->btnCharacteristic = NULL;
+  myDev[i].link->movCharacteristic = NULL;
+  myDev[i].link->tempCharacteristic = NULL;
+  myDev[i].link->frameCharacteristic = NULL;
+  memset(&myDev[i].link->frameSeen, 0, sizeof(adv_seen));
+  myDev[i].link->btnLast = -1;
+  return;
+}
+
+/// @brief  drops the datasets of device slot i and renders its SenML
+///         template again (assembly task, or before the tasks are started);
+///         the encoding is set by the next device connecting to the slot
+/// @return
+void dev_reset_data(int i) {
+  ds_init(&myDev[i].pool);
+  myDev[i].link->tplStale = true;
+  return;
+}
+
+/// @brief  resets all devices (before the tasks are started)
+/// @return
+void reset_devices(void) {
+  for (int i = 0; i < devCount; i++) {
+    reset_device(i);
+    dev_reset_data(i);
+    myDev[i].link->format = FMT_JSON;
+  }
+  return;
+}
+
+/// @brief  allocates the device slots
+/// @return bool (false if out of memory)
+bool dev_init(void) {
+  int n = dev_slots();
+
+  // hot slots and cold link data are kept in separate arrays
+  myDev = (s_device *)calloc(n, sizeof(s_device));
+  s_link *links = (s_link *)calloc(n, sizeof(s_link));
+  if (myDev == NULL || links == NULL) {
+    free(myDev);
+    free(links);
+    myDev = NULL;
+    Serial.println("REGISTRY: out of memory");
+    return false;
+  }
+  for (int i = 0; i < n; i++) {
+    myDev[i].link = &links[i];
+    myDev[i].link->gattSem = xSemaphoreCreateBinary();
+  }
+  devCount = n;
+  reset_devices();
+  Serial.printf("REGISTRY: %d MACs, %d slots of %u+%u bytes (%u bytes), "
+                "registry %u bytes\n",
+                macCount, devCount, (unsigned)sizeof(s_device),
+                (unsigned)sizeof(s_link),
+                (unsigned)(devCount * (sizeof(s_device) + sizeof(s_link))),
+                (unsigned)(offsetof(s_registry, mac) + 6 * macCount));
+  return true;
+}
+
+/// @brief  stores id string to dataset
+/// @return
+void set_data_id(s_device *d, char *id) {
+  if (id == NULL) {
+    return;
+  }
+  if (strlen(id) > DATA_SIZE - 1) {
+    return;
+  }
+  sprintf(d->link->id, "%s", id);
+  d->link->tplStale = true;
+
+  return;
+}
 
 /// @brief  stores url string to dataset
 /// @return
@@ -633,11 +1966,24 @@ void set_data_url(s_device *d, char *url) {
   if (strlen(url) > DATA_SIZE - 1) {
     return;
   }
-  sprintf(d->url, "%s", url);
+  sprintf(d->link->url, "%s", url);
 
   return;
 }
 
+/// @brief  checks a configuration read from a device: "i=ID;e=URL" (JSON)
+///         or "i=ID;c=URL" (SenML-CBOR)
+/// @return bool
+bool config_valid(const char *s) {
+  const char *sep;
+
+  if (s == NULL || strncmp(s, "i=", 2) != 0) {
+    return false;
+  }
+  sep = strchr(s, ';');
+  return sep != NULL && (sep[1] == 'e' || sep[1] == 'c') && sep[2] == '=';
+}
+
 /// @brief  stores url and id string to dataset
 /// @return
 void set_characteristic(s_device *d, const char *s) {
@@ -663,38 +2009,31 @@ void set_characteristic(s_device *d, const char *s) {
     }
     i++;
     if (i > DATA_SIZE) {
-      *d->id = '\0';
-      *d->url = '\0';
+      *d->link->id = '\0';
+      portENTER_CRITICAL(&linkMux);
+      *d->link->url = '\0';
+      portEXIT_CRITICAL(&linkMux);
       return;
     }
   }
 
   tmp = (char *)s + base;
-  snprintf(d->id, len + 1, "%s", tmp);
+  snprintf(d->link->id, len + 1, "%s", tmp);
+  d->link->tplStale = true;
+  // "c=<url>" instead of "e=<url>": the webservice takes SenML-CBOR
+  d->link->format = (s[base + len + 1] == 'c') ? FMT_CBOR : FMT_JSON;
 
   tmp = (char *)s + base + len + 3;
   len = strlen(s) - len;
 
-  snprintf(d->url, len + strlen(URL_PREFIX), URL_PREFIX "%s", tmp);
-  snprintf(d->url0, len + strlen(URL_PREFIX), URL_PREFIX "%s", tmp);
+  portENTER_CRITICAL(&linkMux);
+  snprintf(d->link->url, len + strlen(URL_PREFIX), URL_PREFIX "%s", tmp);
+  portEXIT_CRITICAL(&linkMux);
+  snprintf(d->link->url0, len + strlen(URL_PREFIX), URL_PREFIX "%s", tmp);
 
   return;
 }
 
-/// @brief  check if the device MAC address is known
-/// @return bool (true if mac found)
-bool has_mac(const char *mac) {
-  if (mac == NULL) {
-    return false;
-  }
-  for (int i = 0; i < MAX_DEVICE; i++) {
-    if (strcmp(myMacs[i], mac) == 0) {
-      return true;
-    }
-  }
-  return false;
-}
-
 /// @brief  reformats MAC address; removes colons and inserts 'ffff'
 /// @return
 void set_smac(char *mac) {
@@ -752,7 +2091,7 @@ void set_smac(char *mac) {
 /// @brief  returns first device index of state s
 /// @return int (-1 if not found)
 int index_by_state(int s) {
-  for (int i = 0; i < MAX_DEVICE; i++) {
+  for (int i = 0; i < devCount; i++) {
     if (myDev[i].state == s) {
       return i;
     }
@@ -760,486 +2099,2367 @@ int index_by_state(int s) {
   return NO_INDEX;
 }
 
-/// @brief  returns first device index of BLEClient c
+/// @brief  returns the device slot of BLEClient c (every slot has its own
+///         client)
 /// @return int (-1 if not found)
 int index_by_client(BLEClient *c) {
-  for (int i = 0; i < MAX_DEVICE; i++) {
-    if (myDev[i].pClient == c) {
+  for (int i = 0; i < devCount; i++) {
+    if (myDev[i].link->client == c) {
       return i;
     }
   }
   return NO_INDEX;
 }
 
-/// @brief  returns first device index of MAC m
+/// @brief  returns the device index of the packed MAC address mac
 /// @return int (-1 if not found)
-int index_by_mac(const char *m) {
-  for (int i = 0; i < MAX_DEVICE; i++) {
-    if (strcmp(myDev[i].mac, m) == 0) {
-      return i;
-    }
-  }
-  return NO_INDEX;
+int index_by_addr(uint64_t mac) {
+  s_mac_entry *e = mac_find(mac);
+
+  return (e != NULL) ? e->dev : NO_INDEX;
 }
 
-/// @brief  returns current (same timestamp and incomplete data) or next index
-/// @return int (< MAX_POOL)
-int next_index(s_device *device, long double tm) {
-  s_data *d = NULL;
+/// @brief  closes datasets whose window has passed (incomplete datasets
+///         are sent as they are instead of being held forever)
+/// @return
+void ds_expire(void) {
+  unsigned long now = millis();
 
-  for (int i = 0; i < MAX_POOL; i++) {
-    d = &(device->data[i]);
-    // if received at almost the same time it may be part of a dataset
-    if (abs((long)(tm - d->tm)) < 3) {
-      if (d->valid) {
-        // this dataset is complete ... get a new index
-        continue;
-      } else {
-        // this dataset is incomplete ... return index
-        return i;
-      }
-    }
-    // there is no timestamp ... return the next avaliable index
-    if (!d->valid && d->tm == 0) {
-      // store timestamp
-      d->tm = tm;
-      return i;
-    }
-  }
-  // something went wrong ... clean up the buffer
-  for (int j = 0; j < MAX_POOL; j++) {
-    s_data d = device->data[j];
-    reset_data(&d);
+  for (int i = 0; i < devCount; i++) {
+    ds_expire_pool(&myDev[i].pool, now);
   }
-  // store timestamp
-  d = &(device->data[0]);
-  d->tm = tm;
-
-  return 0;
+  return;
 }
 
-/// @brief gets local epoch time
-/// @return time_t struct
-unsigned long get_epoch_time() {
-  time_t now;
-  struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) {
+/// @brief epoch time in ms; constant time and non-blocking (may be called
+///        from callbacks)
+/// @return uint64_t (0 if the clock has not been synced yet)
+uint64_t clock_ms(void) {
+  int64_t off = clockOffset[__atomic_load_n(&clockSlot, __ATOMIC_ACQUIRE)];
+
+  if (off == 0) {
     return 0;
   }
-  time(&now);
-
-  return now;
+  return (uint64_t)(esp_timer_get_time() / 1000 + off);
 }
 
-/// @brief sends a SenML JSON object to a webservice
+/// @brief SNTP notification (lwIP task); the anchor is renewed by clock_sync
 /// @return
-void send_json(s_device *dev, s_data *mydata) {
-  jsonb b;
-  jsonbcode ret;
-
-  char buf[ELEMENT_SIZE];
-  char urn[URN_SIZE];
-  char smac[MAC_SIZE];
+static void clock_notify(struct timeval *tv) {
+  clockNotify = true;
+}
 
-  strcpy(smac, dev->mac);
-  set_smac(smac);
+/// @brief anchors the system time (kept by SNTP in the background) to
+///        esp_timer; runs after each SNTP update and every CLOCK_SYNC_MS
+/// @return
+void clock_sync(void) {
+  struct timeval tv;
 
-  snprintf(urn, URN_SIZE, "urn:dev:mac:%s:", smac);
+  if (!clockNotify && clockAnchor != 0 &&
+      millis() - clockAnchor < CLOCK_SYNC_MS) {
+    return;
+  }
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec < CLOCK_VALID_SEC) {
+    // not synced yet
+    return;
+  }
+  clockNotify = false;
+
+  uint8_t next = clockSlot ^ 1;
+  int64_t old = clockOffset[clockSlot];
+  clockOffset[next] = (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000 -
+                      esp_timer_get_time() / 1000;
+  __atomic_store_n(&clockSlot, next, __ATOMIC_RELEASE);
+  clockAnchor = millis();
+  if (old == 0) {
+    Serial.printf("CLOCK: synced [%.9e]\n", clock_ms() / 1000.0);
+  } else {
+    Serial.printf("CLOCK: resynced, drift %ld ms\n",
+                  (long)(clockOffset[next] - old));
+  }
+  return;
+}
 
-  jsonb_init(&b);
-  {
-    jsonb_array(&b, buf, ELEMENT_SIZE);
+/// @brief encodes a dataset as SenML records; the first dataset of a device
+///        in a pack carries base name, base time and the device records, the
+///        following ones only the sensor records with a time relative to bt.
+///        Sensors missing in an incomplete dataset are left out. Packs are
+///        written by senml_write(), this is the reference for its output
+/// @return int (negative on error)
+int json_dataset(jsonb_sink *s, s_device *dev, ds_data *mydata, uint64_t bt,
+                 bool first) {
+  int err = 0;
+  // times in ms, written as seconds with 3 decimals
+  int64_t t = (int64_t)(mydata->tm - bt);
+
+  if (first) {
+    char urn[URN_SIZE];
+    char smac[MAC_SIZE];
+
+    strcpy(smac, dev->link->mac);
+    set_smac(smac);
+
+    snprintf(urn, URN_SIZE, "urn:dev:mac:%s:", smac);
+    if (mydata->mask & DS_BAT) {
+      err |= jsonbs_object(s);
+      err |= jsonbs_key_lit(s, "bn");
+      err |= jsonbs_string(s, urn, strlen(urn));
+      err |= jsonbs_key_lit(s, "bt");
+      err |= jsonbs_fixed(s, (int64_t)mydata->tm, 3);
+      err |= jsonbs_key_lit(s, "n");
+      err |= jsonbs_string_lit(s, "batt");
+      err |= jsonbs_key_lit(s, "u");
+      err |= jsonbs_string_lit(s, "%EL");
+      err |= jsonbs_key_lit(s, "v");
+      err |= jsonbs_number(s, mydata->bat);
+      err |= jsonbs_object_pop(s);
+    }
     {
-      {
-        jsonb_object(&b, buf, ELEMENT_SIZE);
-        jsonb_key(&b, buf, ELEMENT_SIZE, "bn", strlen("bn"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, urn, strlen(urn));
-        jsonb_key(&b, buf, ELEMENT_SIZE, "bt", strlen("bt"));
-        jsonb_float(&b, buf, ELEMENT_SIZE, mydata->tm);
-        jsonb_key(&b, buf, ELEMENT_SIZE, "n", strlen("n"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, "batt", strlen("batt"));
-        jsonb_key(&b, buf, ELEMENT_SIZE, "u", strlen("u"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, "%EL", strlen("%EL"));
-        jsonb_key(&b, buf, ELEMENT_SIZE, "v", strlen("v"));
-        jsonb_number(&b, buf, ELEMENT_SIZE, mydata->bat);
-        jsonb_object_pop(&b, buf, ELEMENT_SIZE);
-      }
-      {
-        jsonb_object(&b, buf, ELEMENT_SIZE);
-        jsonb_key(&b, buf, ELEMENT_SIZE, "n", strlen("n"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, "id", strlen("id"));
-        jsonb_key(&b, buf, ELEMENT_SIZE, "vs", strlen("vs"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, dev->id, strlen(dev->id));
-        jsonb_object_pop(&b, buf, ELEMENT_SIZE);
-      }
-      {
-        jsonb_object(&b, buf, ELEMENT_SIZE);
-        // HACK >>>
-        jsonb_key(&b, buf, ELEMENT_SIZE, "n", strlen("n"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, "lat", strlen("lat"));
-        // <<<
-        jsonb_key(&b, buf, ELEMENT_SIZE, "u", strlen("u"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, "lat", strlen("lat"));
-        jsonb_key(&b, buf, ELEMENT_SIZE, "v", strlen("v"));
-        jsonb_number(&b, buf, ELEMENT_SIZE, strtod(location.lat, NULL));
-        jsonb_object_pop(&b, buf, ELEMENT_SIZE);
-      }
-      {
-        jsonb_object(&b, buf, ELEMENT_SIZE);
-        // HACK >>>
-        jsonb_key(&b, buf, ELEMENT_SIZE, "n", strlen("n"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, "lon", strlen("lon"));
-        // <<<
-        jsonb_key(&b, buf, ELEMENT_SIZE, "u", strlen("u"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, "lon", strlen("lon"));
-        jsonb_key(&b, buf, ELEMENT_SIZE, "v", strlen("v"));
-        jsonb_number(&b, buf, ELEMENT_SIZE, strtod(location.lon, NULL));
-        jsonb_object_pop(&b, buf, ELEMENT_SIZE);
-      }
-      {
-        jsonb_object(&b, buf, ELEMENT_SIZE);
-        jsonb_key(&b, buf, ELEMENT_SIZE, "n", strlen("n"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, "temp", strlen("temp"));
-        jsonb_key(&b, buf, ELEMENT_SIZE, "u", strlen("u"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, "Cel", strlen("Cel"));
-        jsonb_key(&b, buf, ELEMENT_SIZE, "v", strlen("v"));
-        jsonb_number(&b, buf, ELEMENT_SIZE, mydata->temp);
-        jsonb_object_pop(&b, buf, ELEMENT_SIZE);
-      }
-      {
-        jsonb_object(&b, buf, ELEMENT_SIZE);
-        jsonb_key(&b, buf, ELEMENT_SIZE, "n", strlen("n"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, "move", strlen("move"));
-        jsonb_key(&b, buf, ELEMENT_SIZE, "vb", strlen("vb"));
-        jsonb_bool(&b, buf, ELEMENT_SIZE, mydata->mov);
-        jsonb_object_pop(&b, buf, ELEMENT_SIZE);
-      }
-      {
-        jsonb_object(&b, buf, ELEMENT_SIZE);
-        jsonb_key(&b, buf, ELEMENT_SIZE, "n", strlen("n"));
-        jsonb_string(&b, buf, ELEMENT_SIZE, "button", strlen("button"));
-        jsonb_key(&b, buf, ELEMENT_SIZE, "vb", strlen("vb"));
-        jsonb_bool(&b, buf, ELEMENT_SIZE, mydata->btn);
-        jsonb_object_pop(&b, buf, ELEMENT_SIZE);
+      err |= jsonbs_object(s);
+      // base name and time go with the first record
+      if (!(mydata->mask & DS_BAT)) {
+        err |= jsonbs_key_lit(s, "bn");
+        err |= jsonbs_string(s, urn, strlen(urn));
+        err |= jsonbs_key_lit(s, "bt");
+        err |= jsonbs_fixed(s, (int64_t)mydata->tm, 3);
       }
+      err |= jsonbs_key_lit(s, "n");
+      err |= jsonbs_string_lit(s, "id");
+      err |= jsonbs_key_lit(s, "vs");
+      err |= jsonbs_string(s, dev->link->id, strlen(dev->link->id));
+      err |= jsonbs_object_pop(s);
     }
-    jsonb_array_pop(&b, buf, ELEMENT_SIZE);
-  }
-  Serial.printf("JSON:%s\n", buf);
-
-  if (WiFi.status() == WL_CONNECTED) {
-    char *url = NULL;
-    const char *headerKeys[] = {"Location"};
-    const size_t headerKeysCount = sizeof(headerKeys) / sizeof(headerKeys[0]);
-    String httpRequestData = buf;
-    int httpResponseCode = 0;
-    int j = 0;
-    int k = 0;
-
-    client->setInsecure();
-    while (1) {
-      http.collectHeaders(headerKeys, headerKeysCount);
-      Serial.printf("HTTP URL: %s\n", dev->url);
-      http.begin(*client, dev->url);
-
-      http.addHeader("Content-Type", "application/json");
-      http.addHeader("User-Agent", "ESP32");
-
-      httpResponseCode = http.POST(httpRequestData);
-      Serial.print("HTTP Response code: ");
-      Serial.println(httpResponseCode);
-      // check for redirect response
-      if ((httpResponseCode == HTTP_CODE_MOVED_PERMANENTLY) ||
-          (httpResponseCode == HTTP_CODE_PERMANENT_REDIRECT)) {
-        url = (char *)http.header("Location").c_str();
-        if (url == NULL) {
-          url = dev->url0;
-        }
-        Serial.print("HTTP Location header: ");
-        Serial.println(url);
-        set_data_url(dev, url);
-        httpResponseCode = 0;
-        j++;
+    {
+      err |= jsonbs_object(s);
+      // HACK >>>
+      err |= jsonbs_key_lit(s, "n");
+      err |= jsonbs_string_lit(s, "lat");
+      // <<<
+      err |= jsonbs_key_lit(s, "u");
+      err |= jsonbs_string_lit(s, "lat");
+      err |= jsonbs_key_lit(s, "v");
+      err |= jsonbs_number(s, strtod(location.lat, NULL));
+      err |= jsonbs_object_pop(s);
+    }
+    {
+      err |= jsonbs_object(s);
+      // HACK >>>
+      err |= jsonbs_key_lit(s, "n");
+      err |= jsonbs_string_lit(s, "lon");
+      // <<<
+      err |= jsonbs_key_lit(s, "u");
+      err |= jsonbs_string_lit(s, "lon");
+      err |= jsonbs_key_lit(s, "v");
+      err |= jsonbs_number(s, strtod(location.lon, NULL));
+      err |= jsonbs_object_pop(s);
+    }
+  } else if (mydata->mask & DS_BAT) {
+    err |= jsonbs_object(s);
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "batt");
+    err |= jsonbs_key_lit(s, "u");
+    err |= jsonbs_string_lit(s, "%EL");
+    if (t != 0) {
+      err |= jsonbs_key_lit(s, "t");
+      err |= jsonbs_fixed(s, t, 3);
+    }
+    err |= jsonbs_key_lit(s, "v");
+    err |= jsonbs_number(s, mydata->bat);
+    err |= jsonbs_object_pop(s);
+  }
+  if (mydata->mask & DS_TEMP) {
+    err |= jsonbs_object(s);
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "temp");
+    err |= jsonbs_key_lit(s, "u");
+    err |= jsonbs_string_lit(s, "Cel");
+    if (!first && t != 0) {
+      err |= jsonbs_key_lit(s, "t");
+      err |= jsonbs_fixed(s, t, 3);
+    }
+    err |= jsonbs_key_lit(s, "v");
+    err |= jsonbs_number(s, mydata->temp);
+    err |= jsonbs_object_pop(s);
+  }
+  if (mydata->mask & DS_MOV) {
+    err |= jsonbs_object(s);
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "move");
+    if (!first && t != 0) {
+      err |= jsonbs_key_lit(s, "t");
+      err |= jsonbs_fixed(s, t, 3);
+    }
+    err |= jsonbs_key_lit(s, "vb");
+    err |= jsonbs_bool(s, mydata->state & ADV_F_MOV);
+    err |= jsonbs_object_pop(s);
+  }
+  if (mydata->mask & DS_BTN) {
+    err |= jsonbs_object(s);
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "button");
+    if (!first && t != 0) {
+      err |= jsonbs_key_lit(s, "t");
+      err |= jsonbs_fixed(s, t, 3);
+    }
+    err |= jsonbs_key_lit(s, "vb");
+    err |= jsonbs_bool(s, mydata->state & ADV_F_BTN);
+    err |= jsonbs_object_pop(s);
+  }
+
+  return err;
+}
+
+/// @brief encodes a button alert (device data taken with the alert) as SenML
+///        pack; it carries the button state (btn) and the device records
+///        only, the other sensors are sent with the dataset (tm: epoch time
+///        in ms)
+/// @return int (negative on error)
+int json_alert(jsonb_sink *s, const s_alert *a, uint64_t tm, bool btn) {
+  int err = 0;
+  char urn[URN_SIZE];
+  char smac[MAC_SIZE];
+
+  strcpy(smac, a->mac);
+  set_smac(smac);
+
+  snprintf(urn, URN_SIZE, "urn:dev:mac:%s:", smac);
+  err |= jsonbs_array(s);
+  {
+    err |= jsonbs_object(s);
+    err |= jsonbs_key_lit(s, "bn");
+    err |= jsonbs_string(s, urn, strlen(urn));
+    err |= jsonbs_key_lit(s, "bt");
+    err |= jsonbs_fixed(s, (int64_t)tm, 3);
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "button");
+    err |= jsonbs_key_lit(s, "vb");
+    err |= jsonbs_bool(s, btn);
+    err |= jsonbs_object_pop(s);
+  }
+  {
+    err |= jsonbs_object(s);
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "id");
+    err |= jsonbs_key_lit(s, "vs");
+    err |= jsonbs_string(s, a->id, strlen(a->id));
+    err |= jsonbs_object_pop(s);
+  }
+  {
+    err |= jsonbs_object(s);
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "lat");
+    err |= jsonbs_key_lit(s, "u");
+    err |= jsonbs_string_lit(s, "lat");
+    err |= jsonbs_key_lit(s, "v");
+    err |= jsonbs_number(s, strtod(location.lat, NULL));
+    err |= jsonbs_object_pop(s);
+  }
+  {
+    err |= jsonbs_object(s);
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "lon");
+    err |= jsonbs_key_lit(s, "u");
+    err |= jsonbs_string_lit(s, "lon");
+    err |= jsonbs_key_lit(s, "v");
+    err |= jsonbs_number(s, strtod(location.lon, NULL));
+    err |= jsonbs_object_pop(s);
+  }
+  err |= jsonbs_array_pop(s);
+
+  return err;
+}
+
+/// @brief encodes base name and base time (tm: epoch time in ms) of the
+///        device with MAC address mac as SenML-CBOR map entries (see
+///        json_dataset())
+/// @return int (negative on error)
+int cbor_base(cborb_sink *c, const char *mac, uint64_t tm) {
+  int err = 0;
+  char urn[URN_SIZE];
+  char smac[MAC_SIZE];
+
+  strcpy(smac, mac);
+  set_smac(smac);
+
+  snprintf(urn, URN_SIZE, "urn:dev:mac:%s:", smac);
+  err |= cborbs_int(c, SENML_CBOR_BN);
+  err |= cborbs_string(c, urn, strlen(urn));
+  err |= cborbs_int(c, SENML_CBOR_BT);
+  err |= cborbs_number(c, (double)tm / 1000);
+
+  return err;
+}
+
+/// @brief encodes the id and location records of a device (mac, id) as
+///        SenML-CBOR maps; base: the id record carries base name and time (tm)
+/// @return int (negative on error)
+int cbor_device(cborb_sink *c, const char *mac, const char *id, bool base,
+                uint64_t tm) {
+  int err = 0;
+  const char *loc[2] = {location.lat, location.lon};
+  const char *name[2] = {"lat", "lon"};
+
+  err |= cborbs_map(c, base ? 4 : 2);
+  if (base) {
+    err |= cbor_base(c, mac, tm);
+  }
+  err |= cborbs_int(c, SENML_CBOR_N);
+  err |= cborbs_string_lit(c, "id");
+  err |= cborbs_int(c, SENML_CBOR_VS);
+  err |= cborbs_string(c, id, strlen(id));
+  err |= cborbs_pop(c);
+  for (int i = 0; i < 2; i++) {
+    err |= cborbs_map(c, 3);
+    err |= cborbs_int(c, SENML_CBOR_N);
+    err |= cborbs_string(c, name[i], 3);
+    err |= cborbs_int(c, SENML_CBOR_U);
+    err |= cborbs_string(c, name[i], 3);
+    err |= cborbs_int(c, SENML_CBOR_V);
+    err |= cborbs_number(c, strtod(loc[i], NULL));
+    err |= cborbs_pop(c);
+  }
+
+  return err;
+}
+
+/// @brief encodes a sensor record as SenML-CBOR map; name and unit (NULL if
+///        none), t: time relative to the base time [ms] (0: not written),
+///        the value follows as the last item
+/// @return int (negative on error)
+int cbor_record(cborb_sink *c, const char *name, const char *unit, int64_t t,
+                int label) {
+  int err = 0;
+
+  err |= cborbs_map(c, 2 + (unit != NULL) + (t != 0));
+  err |= cborbs_int(c, SENML_CBOR_N);
+  err |= cborbs_string(c, name, strlen(name));
+  if (unit != NULL) {
+    err |= cborbs_int(c, SENML_CBOR_U);
+    err |= cborbs_string(c, unit, strlen(unit));
+  }
+  if (t != 0) {
+    err |= cborbs_int(c, SENML_CBOR_T);
+    err |= cborbs_number(c, (double)t / 1000);
+  }
+  err |= cborbs_int(c, label);
+
+  return err;
+}
+
+/// @brief encodes a dataset as SenML-CBOR records with the same records and
+///        fields in the same order as json_dataset(), labels as integers
+/// @return int (negative on error)
+int cbor_dataset(cborb_sink *c, s_device *dev, ds_data *mydata, uint64_t bt,
+                 bool first) {
+  int err = 0;
+  int64_t t = first ? 0 : (int64_t)(mydata->tm - bt);
+
+  if (first) {
+    if (mydata->mask & DS_BAT) {
+      err |= cborbs_map(c, 5);
+      err |= cbor_base(c, dev->link->mac, mydata->tm);
+      err |= cborbs_int(c, SENML_CBOR_N);
+      err |= cborbs_string_lit(c, "batt");
+      err |= cborbs_int(c, SENML_CBOR_U);
+      err |= cborbs_string_lit(c, "%EL");
+      err |= cborbs_int(c, SENML_CBOR_V);
+      err |= cborbs_int(c, mydata->bat);
+      err |= cborbs_pop(c);
+    }
+    err |= cbor_device(c, dev->link->mac, dev->link->id,
+                       !(mydata->mask & DS_BAT), mydata->tm);
+  } else if (mydata->mask & DS_BAT) {
+    err |= cbor_record(c, "batt", "%EL", t, SENML_CBOR_V);
+    err |= cborbs_int(c, mydata->bat);
+    err |= cborbs_pop(c);
+  }
+  if (mydata->mask & DS_TEMP) {
+    err |= cbor_record(c, "temp", "Cel", t, SENML_CBOR_V);
+    err |= cborbs_int(c, mydata->temp);
+    err |= cborbs_pop(c);
+  }
+  if (mydata->mask & DS_MOV) {
+    err |= cbor_record(c, "move", NULL, t, SENML_CBOR_VB);
+    err |= cborbs_bool(c, mydata->state & ADV_F_MOV);
+    err |= cborbs_pop(c);
+  }
+  if (mydata->mask & DS_BTN) {
+    err |= cbor_record(c, "button", NULL, t, SENML_CBOR_VB);
+    err |= cborbs_bool(c, mydata->state & ADV_F_BTN);
+    err |= cborbs_pop(c);
+  }
+
+  return err;
+}
+
+/// @brief encodes a button alert of device dev as SenML-CBOR pack (see
+///        json_alert())
+/// @return int (negative on error)
+int cbor_alert(jsonb_sink *s, const s_alert *a, uint64_t tm, bool btn) {
+  int err = 0;
+  cborb_sink c;
+
+  cborb_sink_init(&c, s);
+  err |= cborbs_array(&c, 4);
+  err |= cborbs_map(&c, 4);
+  err |= cbor_base(&c, a->mac, tm);
+  err |= cborbs_int(&c, SENML_CBOR_N);
+  err |= cborbs_string_lit(&c, "button");
+  err |= cborbs_int(&c, SENML_CBOR_VB);
+  err |= cborbs_bool(&c, btn);
+  err |= cborbs_pop(&c);
+  err |= cbor_device(&c, a->mac, a->id, false, tm);
+  err |= cborbs_pop(&c);
+
+  return err;
+}
+
+/// @brief renders the SenML fragments of device dev (and the location
+///        records) if they are missing or stale
+/// @return bool (false if they could not be rendered)
+bool senml_ready(s_device *dev) {
+  if (senmlLocLen <= 0) {
+    senmlLocLen = senml_loc_build(senmlLoc, strtod(location.lat, NULL),
+                                  strtod(location.lon, NULL));
+  }
+  if (dev->link->tpl.buf == NULL || dev->link->tplStale) {
+    char urn[URN_SIZE];
+    char smac[MAC_SIZE];
+
+    dev->link->tplStale = false;
+    strcpy(smac, dev->link->mac);
+    set_smac(smac);
+    snprintf(urn, URN_SIZE, "urn:dev:mac:%s:", smac);
+    if (senml_tpl_build(&dev->link->tpl, urn, dev->link->id) < 0) {
+      Serial.printf("SENML [%s] out of memory\n", dev->link->mac);
+    }
+  }
+  return senmlLocLen > 0 && dev->link->tpl.buf != NULL;
+}
+
+/// @brief writes a dataset as SenML records from the pre-rendered fragments
+///        of the device (see json_dataset(), senml_ready() must have
+///        succeeded); comma: records precede the dataset in the pack
+/// @return int (negative on error)
+int senml_write(jsonb_sink *s, s_device *dev, ds_data *mydata, uint64_t bt,
+                bool first, bool comma) {
+  senml_values v;
+
+  v.tm = (int64_t)mydata->tm;
+  v.t = (int64_t)(mydata->tm - bt);
+  v.mask = mydata->mask & DS_FULL;
+  v.bat = mydata->bat;
+  v.temp = mydata->temp;
+  v.mov = (mydata->state & ADV_F_MOV) ? 1 : 0;
+  v.btn = (mydata->state & ADV_F_BTN) ? 1 : 0;
+
+  return senml_dataset(s, &dev->link->tpl, senmlLoc, senmlLocLen, &v, first,
+                       comma);
+}
+
+/// @brief returns the number of SenML records a pack holding n datasets of a
+///        single device consists of
+/// @return int
+int pack_records(int n) {
+  return (n > 0) ? PACK_FIRST_RECORDS + (n - 1) * PACK_NEXT_RECORDS : 0;
+}
+
+/// @brief checks if devices a and b post to the same endpoint (URL and
+///        encoding)
+/// @return bool
+bool same_endpoint(const s_device *a, const s_device *b) {
+  return a->link->format == b->link->format &&
+         strcmp(a->link->url, b->link->url) == 0;
+}
+
+/// @brief measures a dataset as a pack of its own (upper bound of its share
+///        of a pack) in the encoding of its endpoint
+/// @return size_t (0 if it cannot be encoded)
+size_t pack_measure(s_device *dev, ds_data *d) {
+  jsonb_sink s;
+
+  // assembly task; sinkBuf is the window of the uplink task
+  jsonb_sink_init(&s, measureBuf, SINK_SIZE, jsonb_discard, NULL);
+  if (dev->link->format == FMT_CBOR) {
+    cborb_sink c;
+
+    cborb_sink_init(&c, &s);
+    cborbs_array(&c, CBORB_INDEFINITE);
+    cbor_dataset(&c, dev, d, 0, true);
+    cborbs_pop(&c);
+  } else {
+    if (!senml_ready(dev)) {
+      return 0;
+    }
+    jsonb_sink_put(&s, "[", 1);
+    senml_write(&s, dev, d, 0, true, false);
+    jsonb_sink_put(&s, "]", 1);
+  }
+  return (s.err < 0) ? 0 : jsonb_sink_length(&s);
+}
+
+/// @brief marks the ready datasets of all devices posting to the endpoint of
+///        device lead as packed; datasets exceeding BATCH_MAX_RECORDS or
+///        BATCH_MAX_BYTES (by their measured length) are left for the next
+///        pack
+/// @return int (number of SenML records packed)
+int pack_select(const s_device *lead) {
+  size_t bytes = 0;
+  int n = 0;
+
+  for (int i = 0; i < devCount; i++) {
+    s_device *dev = &myDev[i];
+    bool first = true;
+
+    if (!dev_live(dev) || !same_endpoint(dev, lead) ||
+        (dev->link->format == FMT_JSON && !senml_ready(dev))) {
+      continue;
+    }
+    // datasets in use only
+    for (uint16_t m = dev->pool.used; m != 0; m &= m - 1) {
+      ds_data *d = &(dev->pool.data[__builtin_ctz(m)]);
+      int r = first ? PACK_FIRST_RECORDS : PACK_NEXT_RECORDS;
+
+      if (!check_data(d)) {
+        continue;
+      }
+      if (n + r > BATCH_MAX_RECORDS || bytes + d->len > BATCH_MAX_BYTES) {
+        return n;
+      }
+      first = false;
+      d->mask |= DS_PACKED;
+      bytes += d->len;
+      n += r;
+    }
+  }
+  return n;
+}
+
+/// @brief request body: the packed datasets of all devices posting to the
+///        endpoint of device lead as one SenML-CBOR pack (an array of
+///        indefinite length, so it is streamed as well)
+/// @return int (negative on error)
+int body_pack_cbor(jsonb_sink *s, const s_device *lead) {
+  cborb_sink c;
+  int err = 0;
+
+  cborb_sink_init(&c, s);
+  err |= cborbs_array(&c, CBORB_INDEFINITE);
+  for (int i = 0; i < devCount; i++) {
+    s_device *dev = &myDev[i];
+    uint64_t bt = 0;
+    bool first = true;
+
+    if (!same_endpoint(dev, lead)) {
+      continue;
+    }
+    for (uint16_t m = dev->pool.used; m != 0; m &= m - 1) {
+      ds_data *d = &(dev->pool.data[__builtin_ctz(m)]);
+
+      if (!(d->mask & DS_PACKED)) {
+        continue;
+      }
+      err |= cbor_dataset(&c, dev, d, bt, first);
+      if (first) {
+        bt = d->tm;
+        first = false;
+      }
+    }
+  }
+  err |= cborbs_pop(&c);
+
+  return err;
+}
+
+/// @brief request body: the packed datasets of all devices posting to the
+///        endpoint of device arg as one SenML pack (the datasets of a device
+///        are encoded relative to its first) in the encoding of the endpoint
+/// @return int (negative on error)
+int body_pack(jsonb_sink *s, void *arg) {
+  const s_device *lead = (const s_device *)arg;
+
+  if (lead->link->format == FMT_CBOR) {
+    return body_pack_cbor(s, lead);
+  }
+  int err = jsonb_sink_put(s, "[", 1);
+  bool comma = false;
+
+  for (int i = 0; i < devCount; i++) {
+    s_device *dev = &myDev[i];
+    uint64_t bt = 0;
+    bool first = true;
+
+    if (!same_endpoint(dev, lead)) {
+      continue;
+    }
+    for (uint16_t m = dev->pool.used; m != 0; m &= m - 1) {
+      ds_data *d = &(dev->pool.data[__builtin_ctz(m)]);
+
+      if (!(d->mask & DS_PACKED)) {
+        continue;
+      }
+      err |= senml_write(s, dev, d, bt, first, comma);
+      if (first) {
+        bt = d->tm;
+        first = false;
       }
+      comma = true;
+    }
+  }
+  err |= jsonb_sink_put(s, "]", 1);
+
+  return err;
+}
+
+/// @brief request body: a button alert (s_alert)
+/// @return int (negative on error)
+int body_alert(jsonb_sink *s, void *arg) {
+  const s_alert *a = (const s_alert *)arg;
+  const s_event *e = &a->event;
+  bool btn = (e->type == E_FRAME) ? (e->flags & ADV_F_BTN) : (e->val != 0);
+
+  if (a->format == FMT_CBOR) {
+    return cbor_alert(s, a, e->tm, btn);
+  }
+  return json_alert(s, a, e->tm, btn);
+}
+
+/// @brief starts sending a SenML pack (or alert) to a webservice (url, url0
+///        after errors) in request slot req; done is called once it has
+///        finished
+/// @return
+void send_json(s_http *req, const char *url, const char *url0,
+               const s_body *body, http_done done) {
+  if (strcmp(body->type, CT_JSON) == 0) {
+    Serial.print("JSON:");
+    body_stream(body, sink_print, (Print *)&Serial);
+  } else {
+    Serial.print("CBOR:");
+    body_stream(body, sink_hex, (Print *)&Serial);
+  }
+  Serial.println();
+
+  http_post(req, url, url0, body, done);
+  return;
+}
+
+/// @brief applies url (the URL a request submitted with URL from ended
+///        with) to all devices posting to from (assembly task)
+/// @return
+void send_url(const char *from, const char *url) {
+  portENTER_CRITICAL(&linkMux);
+  for (int i = 0; i < devCount; i++) {
+    if (strcmp(myDev[i].link->url, from) == 0) {
+      set_data_url(&myDev[i], (char *)url);
+    }
+  }
+  portEXIT_CRITICAL(&linkMux);
+  return;
+}
+
+/// @brief hands the URL a request ended with to the assembly task if it
+///        differs from the URL it was submitted with (uplink task); it is
+///        dropped if the assembly task is behind, the next redirect repeats
+///        it
+/// @return
+void send_result(const s_http *req) {
+  s_result r;
+
+  if (strcmp(req->url, req->from) == 0) {
+    return;
+  }
+  memcpy(r.from, req->from, DATA_SIZE);
+  memcpy(r.url, req->url, DATA_SIZE);
+  xQueueSend(resultQueue, &r, 0);
+  task_wake(T_ASSEMBLY);
+
+  return;
+}
+
+/// @brief flash read function of the store-and-forward queue
+/// @return int (0 on success)
+int queue_read(void *ctx, uint32_t off, void *dst, size_t len) {
+  const esp_partition_t *part = (const esp_partition_t *)ctx;
+  return (esp_partition_read(part, off, dst, len) == ESP_OK) ? 0 : -1;
+}
+
+/// @brief flash write function of the store-and-forward queue
+/// @return int (0 on success)
+int queue_write(void *ctx, uint32_t off, const void *src, size_t len) {
+  const esp_partition_t *part = (const esp_partition_t *)ctx;
+  return (esp_partition_write(part, off, src, len) == ESP_OK) ? 0 : -1;
+}
+
+/// @brief flash erase function of the store-and-forward queue
+/// @return int (0 on success)
+int queue_erase(void *ctx, uint32_t off) {
+  const esp_partition_t *part = (const esp_partition_t *)ctx;
+  return (esp_partition_erase_range(part, off, PQ_SECTOR_SIZE) == ESP_OK) ? 0
+                                                                          : -1;
+}
+
+/// @brief opens the store-and-forward queue on the spiffs partition
+/// @return bool (true if the queue is usable)
+bool queue_init(void) {
+  pq_flash flash;
+  const esp_partition_t *part = esp_partition_find_first(
+      ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+
+  if (part == NULL) {
+    Serial.println("QUEUE: no spiffs partition");
+    return false;
+  }
+  flash.read = queue_read;
+  flash.write = queue_write;
+  flash.erase = queue_erase;
+  flash.ctx = (void *)part;
+  flash.size = part->size;
+
+  unsigned long t0 = millis();
+  if (pq_init(&myQueue, &flash) != PQ_OK) {
+    Serial.println("QUEUE: recovery failed");
+    return false;
+  }
+  Serial.printf("QUEUE: %u sectors, %s, recovered in %lu ms\n",
+                myQueue.sectors, pq_empty(&myQueue) ? "empty" : "pending",
+                millis() - t0);
+  return true;
+}
+
+/// @brief stores a pack which could not be sent (record: url '\0' pack);
+///        the body is encoded into the record buffer
+/// @return
+void queue_store(const char *url, const s_body *body) {
+  size_t n = strlen(url) + 1;
+  size_t len = 0;
+  jsonb_sink s;
+
+  if (hasQueue && n < sizeof(queueBuf)) {
+    jsonb_sink_init(&s, queueBuf + n, sizeof(queueBuf) - n, NULL, NULL);
+    if (body->write(&s, body->arg) >= 0) {
+      len = jsonb_sink_length(&s);
+    }
+  }
+  if (len == 0) {
+    Serial.println("QUEUE: pack dropped");
+    return;
+  }
+  memcpy(queueBuf, url, n);
+  if (pq_push(&myQueue, queueBuf, n + len) != PQ_OK) {
+    Serial.println("QUEUE: write failed");
+    return;
+  }
+  Serial.printf("QUEUE: stored %u bytes (seq %u, dropped %u)\n",
+                (unsigned)(n + len), myQueue.seq - 1, myQueue.dropped);
+  return;
+}
+
+/// @brief completion of a button alert: an alert which could not be
+///        delivered is stored in the queue
+/// @return
+void alert_done(s_http *req, int code, unsigned long ms) {
+  send_result(req);
+  if (code != HTTP_CODE_OK) {
+    alertStats.failed++;
+    queue_store(req->alert.url0, &req->body);
+  } else {
+    alertStats.sent++;
+  }
+  alertStats.wait_last = req->t0 - req->alert.event.rx;
+  alertStats.lat_last = alertStats.wait_last + ms;
+  alertStats.lat_sum += alertStats.lat_last;
+  if (alertStats.lat_last > alertStats.lat_max) {
+    alertStats.lat_max = alertStats.lat_last;
+  }
+  Serial.printf("ALERT [%s] code: %d sent: %lu failed: %lu notify->ack: "
+                "%lu ms (queued %lu, avg %lu, max %lu)\n",
+                req->alert.mac, code, alertStats.sent, alertStats.failed,
+                alertStats.lat_last, alertStats.wait_last,
+                alertStats.lat_sum / (alertStats.sent + alertStats.failed),
+                alertStats.lat_max);
+  return;
+}
+
+/// @brief submits all pending button alerts ahead of any telemetry (uplink
+///        task); alerts wait in their ring while all request slots are in
+///        use. An alert is sent with the device data taken when it was
+///        raised, also if the device has disconnected since; it is encoded
+///        once into the buffer of its request slot, so every pass over the
+///        body (length, send, queue) yields the same bytes
+/// @return
+void send_alerts(void) {
+  s_http *req;
+
+  while ((req = http_slot()) != NULL &&
+         alert_ring_pop(&myAlerts, &req->alert)) {
+    s_alert *a = &req->alert;
+    jsonb_sink s;
+
+    if (a->url[0] == '\0' && a->url0[0] == '\0') {
+      // the configuration of the device could not be read
+      alertStats.failed++;
+      Serial.printf("ALERT [%s] not sent, no webservice\n", a->mac);
+      continue;
+    }
+    req->raw.buf = alertBuf[req - myHttp];
+    jsonb_sink_init(&s, (char *)req->raw.buf, ALERT_SIZE, NULL, NULL);
+    if (body_alert(&s, a) < 0) {
+      alertStats.failed++;
+      Serial.printf("ALERT [%s] not sent, encoding failed\n", a->mac);
+      continue;
+    }
+    req->raw.len = jsonb_sink_length(&s);
+    s_body body = {body_raw, &req->raw,
+                   (a->format == FMT_CBOR) ? CT_SENML_CBOR : CT_JSON};
+    send_json(req, (a->url[0] != '\0') ? a->url : a->url0, a->url0, &body,
+              alert_done);
+  }
+  return;
+}
+
+/// @brief completion of a stored pack: it is removed from the queue once it
+///        has been delivered or was rejected by the webservice (4xx, sending
+///        it again would not change that); after network errors and 5xx
+///        draining stops for QUEUE_RETRY_MS
+/// @return
+void queue_done(s_http *req, int code, unsigned long ms) {
+  bool rejected = code >= 400 && code < 500;
+
+  req->raw.buf = NULL;
+  queueBusy = false;
+  if (code != HTTP_CODE_OK && !rejected) {
+    queueRetry = millis();
+    return;
+  }
+  if (rejected) {
+    Serial.printf("QUEUE: record rejected (%d), dropped\n", code);
+  }
+  // a full queue drops its oldest sector while the pack is sent, so the
+  // record is only removed if it is still the oldest one
+  if (myQueue.tail == queueTail) {
+    pq_pop(&myQueue);
+  }
+  return;
+}
+
+/// @brief submits the oldest stored pack (one at a time); it is copied to
+///        queueSend, as queueBuf is used to store packs failing meanwhile
+/// @return
+void queue_drain(void) {
+  char url[DATA_SIZE];
+  size_t len = 0;
+
+  if (!hasQueue || queueBusy || pq_empty(&myQueue) ||
+      WiFi.status() != WL_CONNECTED) {
+    return;
+  }
+  if (queueRetry != 0 && millis() - queueRetry < QUEUE_RETRY_MS) {
+    return;
+  }
+  queueRetry = 0;
+  send_alerts();
+  s_http *req = http_slot();
+  if (req == NULL) {
+    return;
+  }
+
+  pqcode ret = pq_peek(&myQueue, queueBuf, sizeof(queueBuf) - 1, &len);
+  if (ret != PQ_OK) {
+    // unreadable record (e.g. interrupted write); skip it
+    Serial.printf("QUEUE: dropping record (%d)\n", ret);
+    pq_pop(&myQueue);
+    return;
+  }
+  queueBuf[len] = '\0';
+
+  size_t n = strlen(queueBuf) + 1;
+  if (n > DATA_SIZE || n >= len || len - n > sizeof(queueSend)) {
+    pq_pop(&myQueue);
+    return;
+  }
+  memcpy(url, queueBuf, n);
+  memcpy(queueSend, queueBuf + n, len - n);
+  Serial.printf("QUEUE: sending stored pack (%u bytes)\n", (unsigned)(len - n));
+  req->raw.buf = queueSend;
+  req->raw.len = len - n;
+  // a SenML JSON pack starts with '[', a SenML-CBOR pack with an array head
+  // (major type 4, 0x80..0x9f)
+  s_body body = {body_raw, &req->raw,
+                 ((uint8_t)queueSend[0] >= 0x80) ? CT_SENML_CBOR : CT_JSON};
+  queueBusy = true;
+  queueTail = myQueue.tail;
+  http_post(req, url, url, &body, queue_done);
+  return;
+}
+
+/// @brief frees the packed datasets of all devices posting to the endpoint
+///        of device lead (once they have been encoded)
+/// @return
+void pack_release(const s_device *lead) {
+  for (int k = 0; k < devCount; k++) {
+    if (!same_endpoint(&myDev[k], lead)) {
+      continue;
+    }
+    for (uint16_t m = myDev[k].pool.used; m != 0; m &= m - 1) {
+      int j = __builtin_ctz(m);
+      if (myDev[k].pool.data[j].mask & DS_PACKED) {
+        ds_release(&myDev[k].pool, j);
+      }
+    }
+  }
+  return;
+}
+
+/// @brief completion of a pack: it is stored in the queue if it failed, its
+///        buffer goes back to the assembly task
+/// @return
+void pack_done(s_http *req, int code, unsigned long ms) {
+  send_result(req);
+  if (code != HTTP_CODE_OK) {
+    queue_store(req->url0, &req->body);
+  }
+  xQueueSend(packFree, &req->raw.buf, 0);
+  req->raw.buf = NULL;
+  Serial.printf("PACK [%s] code: %d in %lu ms\n", req->url, code, ms);
+  return;
+}
+
+/// @brief submits the packs encoded by the assembly task while request
+///        slots are free (uplink task)
+/// @return
+void send_packs(void) {
+  s_http *req;
+  s_pack p;
+
+  while ((req = http_slot()) != NULL &&
+         xQueueReceive(packQueue, &p, 0) == pdTRUE) {
+    req->raw.buf = p.buf;
+    req->raw.len = p.len;
+    s_body body = {body_raw, &req->raw,
+                   (p.format == FMT_CBOR) ? CT_SENML_CBOR : CT_JSON};
+    send_json(req, p.url, p.url0, &body, pack_done);
+  }
+  return;
+}
+
+/// @brief encodes one pack per endpoint as soon as the ready datasets of
+///        that endpoint reach BATCH_MAX_RECORDS or BATCH_MAX_BYTES, or the
+///        oldest of them has waited for BATCH_MAX_WAIT_MS, and hands it to
+///        the uplink task (assembly task); the datasets are freed at once.
+///        Datasets wait in their pool while all PACK_BUFS buffers are in use
+/// @return
+void flush_packs(void) {
+  for (int i = 0; i < devCount; i++) {
+    unsigned long oldest = millis();
+    size_t bytes = 0;
+    int records = 0;
+    bool leader = true;
+
+    if (!dev_live(&myDev[i])) {
+      continue;
+    }
+    // the first device of an endpoint sends for all of them
+    for (int k = 0; k < i; k++) {
+      if (dev_live(&myDev[k]) && same_endpoint(&myDev[k], &myDev[i])) {
+        leader = false;
+        break;
+      }
+    }
+    if (!leader) {
+      continue;
+    }
+    for (int k = i; k < devCount; k++) {
+      int n = 0;
+      if (!dev_live(&myDev[k]) || !same_endpoint(&myDev[k], &myDev[i])) {
+        continue;
+      }
+      for (uint16_t m = myDev[k].pool.used; m != 0; m &= m - 1) {
+        ds_data *d = &(myDev[k].pool.data[__builtin_ctz(m)]);
+        if (!check_data(d)) {
+          continue;
+        }
+        if (d->ready == 0) {
+          // measure the dataset once
+          size_t len = pack_measure(&myDev[k], d);
+          if (len == 0) {
+            continue;
+          }
+          d->len = len;
+          d->ready = millis();
+        }
+        if (d->ready < oldest) {
+          oldest = d->ready;
+        }
+        bytes += d->len;
+        n++;
+      }
+      records += pack_records(n);
+    }
+    if (records == 0) {
+      continue;
+    }
+    if (records < BATCH_MAX_RECORDS && bytes < BATCH_MAX_BYTES &&
+        millis() - oldest < BATCH_MAX_WAIT_MS) {
+      continue;
+    }
+    s_pack p;
+    if (xQueueReceive(packFree, &p.buf, 0) != pdTRUE) {
+      return;
+    }
+    records = pack_select(&myDev[i]);
+    if (records == 0) {
+      xQueueSend(packFree, &p.buf, 0);
+      continue;
+    }
+    // the measured lengths of the selected datasets fit into PACK_SIZE
+    jsonb_sink s;
+    jsonb_sink_init(&s, p.buf, PACK_SIZE, NULL, NULL);
+    int err = body_pack(&s, &myDev[i]);
+    pack_release(&myDev[i]);
+    if (err < 0) {
+      Serial.printf("PACK [%s] encoding failed, %d records dropped\n",
+                    myDev[i].link->mac, records);
+      xQueueSend(packFree, &p.buf, 0);
+      continue;
+    }
+    p.len = (uint16_t)jsonb_sink_length(&s);
+    p.format = myDev[i].link->format;
+    snprintf(p.url, DATA_SIZE, "%s", myDev[i].link->url);
+    snprintf(p.url0, DATA_SIZE, "%s", myDev[i].link->url0);
+    Serial.printf("TIME [%.9e] HEAP [%lu] RECORDS [%d] BYTES [%u]\n",
+                  (long double)clock_ms() / 1000,
+                  (unsigned long)ESP.getFreeHeap(), records, (unsigned)p.len);
+    // datasets left out of the pack are sent with the next one; there is a
+    // queue entry for every buffer
+    xQueueSend(packQueue, &p, 0);
+    task_wake(T_UPLINK);
+  }
+  return;
+}
+
+/// @brief queues event e as button alert for the uplink task with the data
+///        of its device (BLE task, which also resets the slots, so the data
+///        is consistent)
+/// @return
+static void push_alert(const s_event *e) {
+  s_link *link = myDev[e->dev].link;
+  s_alert a;
+
+  a.event = *e;
+  a.format = link->format;
+  memcpy(a.mac, link->mac, MAC_SIZE);
+  memcpy(a.id, link->id, DATA_SIZE);
+  portENTER_CRITICAL(&linkMux);
+  memcpy(a.url, link->url, DATA_SIZE);
+  portEXIT_CRITICAL(&linkMux);
+  memcpy(a.url0, link->url0, DATA_SIZE);
+  alert_ring_push(&myAlerts, &a);
+  task_wake(T_UPLINK);
+}
+
+/// @brief queues a notification for the assembly task (runs in the BLE task,
+///        must not block); alert also queues the event as button alert for
+///        the uplink task
+/// @return
+static void push_value(int dev, uint8_t type, int16_t val, uint64_t tm,
+                       bool alert) {
+  s_event e;
+
+  e.dev = (uint8_t)dev;
+  e.type = type;
+  e.val = val;
+  e.tm = tm;
+  e.rx = millis();
+  event_ring_push(&myEvents, &e);
+  task_wake(T_ASSEMBLY);
+  if (alert) {
+    push_alert(&e);
+  }
+}
+
+/// @brief tells the assembly task that the device of slot dev has
+///        disconnected (BLE task, queued behind its last notifications)
+/// @return
+static void push_reset(int dev) {
+  s_event e;
+
+  memset(&e, 0, sizeof(e));
+  e.dev = (uint8_t)dev;
+  e.type = E_RESET;
+  e.rx = millis();
+  event_ring_push(&myEvents, &e);
+  task_wake(T_ASSEMBLY);
+}
+
+/// @brief queues a decoded sensor frame (one complete dataset) for the
+///        assembly task (BLE task)
+/// @return
+static void push_frame(int dev, const adv_frame *f, uint64_t tm, bool alert) {
+  s_event e;
+
+  e.dev = (uint8_t)dev;
+  e.type = E_FRAME;
+  e.val = f->bat;
+  e.temp = f->temp;
+  e.flags = (f->mov ? ADV_F_MOV : 0) | (f->btn ? ADV_F_BTN : 0);
+  e.seq = f->seq;
+  e.tm = tm;
+  e.rx = millis();
+  event_ring_push(&myEvents, &e);
+  task_wake(T_ASSEMBLY);
+  if (alert) {
+    push_alert(&e);
+  }
+}
+
+/// @brief queues a notification for the assembly task (BLE task); a frame
+///        notification is decoded at once, repeated frames (same sequence
+///        number) are dropped. The puck notifies all characteristics on every
+///        update and toggles the button value on each press, so only a change
+///        of the value is a press (the first value of a connection is not)
+/// @return
+static void push_event(int dev, uint8_t type, uint8_t *pData,
+                       size_t length) {
+  if (length == 0) {
+    return;
+  }
+  if (type == E_FRAME) {
+    adv_frame f;
+    int presses = 0;
+
+    if (adv_frame_decode(pData, length, &f) &&
+        adv_accept(&myDev[dev].link->frameSeen, &f, &presses)) {
+      push_frame(dev, &f, clock_ms(), presses > 0);
+    }
+    return;
+  }
+  bool press = false;
+  if (type == E_BTN) {
+    s_link *link = myDev[dev].link;
+    int8_t btn = (*pData != 0) ? 1 : 0;
+
+    press = (link->btnLast >= 0 && link->btnLast != btn);
+    link->btnLast = btn;
+  }
+  push_value(dev, type, (int16_t)(*pData), clock_ms(), press);
+}
+
+/// @brief sensor characteristic callback function (battery, temperature,
+///        movement and button); device and sensor are taken from the
+///        characteristic table
+/// @return
+static void notifyCallback(BLERemoteCharacteristic *pBLERemoteCharacteristic,
+                           uint8_t *pData, size_t length, bool isNotify) {
+  s_chr_entry *c = chr_find(pBLERemoteCharacteristic);
+
+  if (c != NULL) {
+    push_event(c->dev, c->type, pData, length);
+  }
+}
+
+/// @brief GATT client event handler for devices set up from the handle
+///        cache (BLE task); such devices have no BLERemoteCharacteristic
+///        objects, so notifications and results of the GATT operations
+///        issued by connect_cached() are taken here
+/// @return
+static void gatt_handler(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
+                         esp_ble_gattc_cb_param_t *param) {
+  s_device *dev = NULL;
+  int i;
+
+  if (event == ESP_GATTC_NOTIFY_EVT) {
+    i = index_by_addr(mac_pack(param->notify.remote_bda));
+    if (i == NO_INDEX || !myDev[i].cached) {
+      return;
+    }
+    for (int k = 0; k < GATT_HANDLES; k++) {
+      if (myDev[i].link->handle[k] != 0 &&
+          myDev[i].link->handle[k] == param->notify.handle) {
+        push_event(i, k, param->notify.value, param->notify.value_len);
+        break;
+      }
+    }
+    return;
+  }
+  for (i = 0; i < devCount; i++) {
+    if (myDev[i].cached && myDev[i].link->gattIf == gattc_if) {
+      dev = &myDev[i];
+      break;
+    }
+  }
+  if (dev == NULL) {
+    return;
+  }
+  switch (event) {
+  case ESP_GATTC_READ_CHAR_EVT:
+    dev->link->gattStatus = param->read.status;
+    if (param->read.status == ESP_GATT_OK) {
+      size_t n = param->read.value_len;
+      if (n > DATA_SIZE - 1) {
+        n = DATA_SIZE - 1;
+      }
+      memcpy(dev->link->gattValue, param->read.value, n);
+      dev->link->gattValue[n] = '\0';
+    }
+    xSemaphoreGive(dev->link->gattSem);
+    break;
+  case ESP_GATTC_WRITE_DESCR_EVT:
+    dev->link->gattStatus = param->write.status;
+    xSemaphoreGive(dev->link->gattSem);
+    break;
+  case ESP_GATTC_REG_FOR_NOTIFY_EVT:
+    dev->link->gattStatus = param->reg_for_notify.status;
+    xSemaphoreGive(dev->link->gattSem);
+    break;
+  default:
+    break;
+  }
+}
+
+/// @brief assembles datasets from the queued notifications (assembly task)
+/// @return
+void drain_events(void) {
+  static const char *names[] = {"BAT ", "TEMP", "MOV ", "BTN ", "FRM "};
+  static uint32_t drops = 0;
+  s_event e;
+
+  while (event_ring_pop(&myEvents, &e)) {
+    s_device *dev = &myDev[e.dev];
+    long double ts = (long double)e.tm / 1000;
+    unsigned long lag = millis() - e.rx;
+    int j;
+
+    if (lag > eventLag) {
+      eventLag = lag;
+    }
+    if (e.type == E_RESET) {
+      dev_reset_data(e.dev);
+      continue;
+    }
+
+    if (e.type == E_FRAME) {
+      // a frame is a complete dataset of its own (no reassembly)
+      j = ds_open(&dev->pool, e.rx, e.tm);
+      if (j == DS_NONE) {
+        Serial.printf("FRAME [%s] seq %u dropped, no free dataset\n",
+                      dev->link->mac, e.seq);
+        continue;
+      }
+      ds_data *dat = &(dev->pool.data[j]);
+      set_data_bat(dat, e.val);
+      set_data_temp(dat, e.temp);
+      set_data_mov(dat, (e.flags & ADV_F_MOV) ? 1 : 0);
+      set_data_btn(dat, (e.flags & ADV_F_BTN) ? 1 : 0);
+      ds_close(&dev->pool);
+      Serial.printf("[%.9e]: %s CB / MAC: %s / DEV: %d/%d / SEQ: %u / "
+                    "VAL: %d %d %d %d / Q: %u\n",
+                    ts, names[e.type], dev->link->mac, e.dev, j, e.seq,
+                    dat->bat, dat->temp, dat->state & ADV_F_MOV ? 1 : 0,
+                    dat->state & ADV_F_BTN ? 1 : 0,
+                    (unsigned)event_ring_depth(&myEvents));
+      continue;
+    }
+    j = ds_index(&dev->pool, e.type, e.rx, e.tm);
+    if (j == DS_NONE) {
+      Serial.printf("EVENT [%s] %s dropped, no free dataset\n", dev->link->mac,
+                    names[e.type]);
+      continue;
+    }
+    ds_data *dat = &(dev->pool.data[j]);
+    switch (e.type) {
+    case E_BAT:
+      set_data_bat(dat, e.val);
+      break;
+    case E_TEMP:
+      set_data_temp(dat, e.val);
+      break;
+    case E_MOV:
+      set_data_mov(dat, e.val);
+      break;
+    case E_BTN:
+      set_data_btn(dat, e.val);
+      break;
+    }
+    ds_update(&dev->pool, j);
+    Serial.printf("[%.9e]: %s CB / MAC: %s / DEV: %d/%d / VAL: %d / Q: %u\n",
+                  ts, names[e.type], dev->link->mac, e.dev, j, e.val,
+                  (unsigned)event_ring_depth(&myEvents));
+  }
+  // send what has been received of datasets whose window has passed
+  ds_expire();
+  if (myEvents.drops != drops) {
+    drops = myEvents.drops;
+    Serial.printf("EVENTS: ring full, %u dropped (peak depth %u)\n",
+                  (unsigned)drops, (unsigned)myEvents.peak);
+  }
+  return;
+}
+
+/// @brief BLE client callback class
+/// @return
+class MyClientCallback : public BLEClientCallbacks {
+  void onConnect(BLEClient *pclient) {
+    int i = index_by_client(pclient);
+    if (i == NO_INDEX) {
+      Serial.println("ERROR: wrong onConnect() index");
+    }
+  }
+
+  void onDisconnect(BLEClient *pclient) {
+    int i = index_by_client(pclient);
+    if (i == NO_INDEX) {
+      Serial.println("ERROR: wrong onDisconnect() index");
+    } else {
+      if (myDev[i].state != D_DISCONNECTED) {
+        reset_device(i);
+      }
+      // the datasets are dropped by the assembly task
+      push_reset(i);
+      Serial.print("onDisconnect... ");
+      Serial.printf("MAC [%s] [%d]\n", myDev[i].link->mac, i);
+    }
+  }
+};
+
+static MyClientCallback clientCallbacks;
+
+/// @brief discovers service and characteristics of a connected BLE server
+///        and registers the notify callbacks (connection setup task)
+/// @return bool (true if all characteristics were found)
+bool connect_discover(int i, BLEClient *client, uint16_t *config) {
+  s_device *dev = &myDev[i];
+
+  // obtain a reference to the service we are after in the remote BLE server
+  BLERemoteService *pRemoteService = client->getService(serviceUUID);
+  if (pRemoteService == nullptr) {
+    Serial.print("failed to find our service UUID: ");
+    Serial.println(serviceUUID.toString().c_str());
+    return false;
+  }
+  Serial.printf(" - found service [%d]\n", i);
+
+  // Read the value of the characteristic.
+  BLERemoteCharacteristic *pRemoteCharacteristic =
+      pRemoteService->getCharacteristic(serviceUUID);
+  if (pRemoteCharacteristic != nullptr && pRemoteCharacteristic->canRead()) {
+    *config = pRemoteCharacteristic->getHandle();
+    std::string value = pRemoteCharacteristic->readValue();
+    Serial.print(" - characteristic value is: ");
+    Serial.println(value.c_str());
+    set_characteristic(dev, value.c_str());
+    Serial.printf(" --  id: %s\n", dev->link->id);
+    Serial.printf(" -- url: %s\n", dev->link->url);
+  }
+
+  // a packed frame replaces the four sensor notifications
+  dev->link->frameCharacteristic =
+      pRemoteService->getCharacteristic(frameCharacteristicUUID);
+  if (dev->link->frameCharacteristic != nullptr &&
+      dev->link->frameCharacteristic->canNotify()) {
+    Serial.printf(" - found frame characteristic [%d]\n", i);
+    chr_add(dev->link->frameCharacteristic, i, E_FRAME);
+    dev->link->frameCharacteristic->registerForNotify(notifyCallback);
+    return true;
+  }
+  dev->link->frameCharacteristic = nullptr;
+
+  // obtain references to the characteristics in the service ...
+  // battery characteristic characteristic
+  dev->link->batCharacteristic =
+      pRemoteService->getCharacteristic(batCharacteristicUUID);
+  if (dev->link->batCharacteristic == nullptr) {
+    Serial.print("Failed to find our characteristic UUID: ");
+    Serial.println(batCharacteristicUUID.toString().c_str());
+    return false;
+  }
+  Serial.printf(" - found battery characteristic [%d]\n", i);
+
+  // register battery characteristic callback
+  if (dev->link->batCharacteristic->canNotify()) {
+    chr_add(dev->link->batCharacteristic, i, E_BAT);
+    dev->link->batCharacteristic->registerForNotify(notifyCallback);
+  }
+
+  // temperature characteristic
+  dev->link->tempCharacteristic =
+      pRemoteService->getCharacteristic(tempCharacteristicUUID);
+  if (dev->link->tempCharacteristic == nullptr) {
+    Serial.print("Failed to find our characteristic UUID: ");
+    Serial.println(tempCharacteristicUUID.toString().c_str());
+    return false;
+  }
+  Serial.printf(" - found temperature characteristic [%d]\n", i);
+
+  // register temperature characteristic callback
+  if (dev->link->tempCharacteristic->canNotify()) {
+    chr_add(dev->link->tempCharacteristic, i, E_TEMP);
+    dev->link->tempCharacteristic->registerForNotify(notifyCallback);
+  }
+
+  // movement characteristic
+  dev->link->movCharacteristic =
+      pRemoteService->getCharacteristic(movCharacteristicUUID);
+  if (dev->link->movCharacteristic == nullptr) {
+    Serial.print("Failed to find our characteristic UUID: ");
+    Serial.println(movCharacteristicUUID.toString().c_str());
+    return false;
+  }
+  Serial.printf(" - found movement characteristic [%d]\n", i);
+
+  // register movement characteristic callback
+  if (dev->link->movCharacteristic->canNotify()) {
+    chr_add(dev->link->movCharacteristic, i, E_MOV);
+    dev->link->movCharacteristic->registerForNotify(notifyCallback);
+  }
+
+  // button characteristic
+  dev->link->btnCharacteristic =
+      pRemoteService->getCharacteristic(btnCharacteristicUUID);
+  if (dev->link->btnCharacteristic == nullptr) {
+    Serial.print("Failed to find our characteristic UUID: ");
+    Serial.println(btnCharacteristicUUID.toString().c_str());
+    return false;
+  }
+  Serial.printf(" - found button characteristic [%d]\n", i);
+
+  // register button characteristic callback
+  if (dev->link->btnCharacteristic->canNotify()) {
+    chr_add(dev->link->btnCharacteristic, i, E_BTN);
+    dev->link->btnCharacteristic->registerForNotify(notifyCallback);
+  }
+  return true;
+}
+
+/// @brief returns the Preferences key of the GATT cache of a device
+/// @return
+void gatt_key(s_device *dev, char *key, size_t size) {
+  snprintf(key, size, "h%012llx", (unsigned long long)dev->addr);
+}
+
+/// @brief loads the cached GATT handles of a device
+/// @return bool (true if a valid entry exists)
+bool gatt_load(s_device *dev, s_gatt_cache *gc) {
+  char key[16];
+
+  gatt_key(dev, key, sizeof(key));
+  return pref.getBytes(key, gc, sizeof(s_gatt_cache)) == sizeof(s_gatt_cache) &&
+         gc->version == GATT_CACHE_VERSION;
+}
+
+/// @brief stores the handles found by connect_discover() in the GATT cache
+/// @return
+void gatt_save(s_device *dev, uint16_t config) {
+  BLERemoteCharacteristic *chr[GATT_HANDLES] = {
+      dev->link->batCharacteristic, dev->link->tempCharacteristic,
+      dev->link->movCharacteristic, dev->link->btnCharacteristic,
+      dev->link->frameCharacteristic};
+  s_gatt_cache gc;
+  char key[16];
+
+  gc.version = GATT_CACHE_VERSION;
+  gc.config = config;
+  for (int k = 0; k < GATT_HANDLES; k++) {
+    // not subscribed (frame characteristic missing or used instead)
+    if (chr[k] == nullptr) {
+      gc.value[k] = 0;
+      gc.cccd[k] = 0;
+      continue;
+    }
+    BLERemoteDescriptor *d = chr[k]->getDescriptor(BLEUUID((uint16_t)0x2902));
+    if (d == nullptr) {
+      return;
+    }
+    gc.value[k] = chr[k]->getHandle();
+    gc.cccd[k] = d->getHandle();
+  }
+  gatt_key(dev, key, sizeof(key));
+  pref.putBytes(key, &gc, sizeof(gc));
+  return;
+}
 
-      // Free resources
-      http.end();
-      client->stop();
-      delay(500);
+/// @brief removes a stale entry from the GATT cache
+/// @return
+void gatt_drop(s_device *dev) {
+  char key[16];
 
-      // done ...
-      if (httpResponseCode == HTTP_CODE_OK) {
-        break;
-      }
+  gatt_key(dev, key, sizeof(key));
+  pref.remove(key);
+  return;
+}
 
-      // retry after error; reset url
-      if (httpResponseCode < 0) {
-        url = dev->url0;
-        set_data_url(dev, url);
-        k++;
-      }
+/// @brief returns the Preferences key of the advertisement mode config of a
+///        device
+/// @return
+void adv_config_key(uint64_t mac, char *key, size_t size) {
+  snprintf(key, size, "a%012llx", (unsigned long long)mac);
+}
 
-      // // restart in case heap memory is low
-      // if (httpResponseCode == HTTPC_ERROR_CONNECTION_REFUSED) {
-      //   Serial.println("oom: rebooting ...");
-      //   ESP.restart();
-      //   break;
-      // }
-
-      // failed on sending request
-      if ((j == MAX_REDIR) || (k == MAX_ATTEMPTS)) {
-        Serial.print("sending request failed on: ");
-        Serial.println(dev->url);
-        break;
-      }
+/// @brief loads id and webservice of a device in advertisement mode; they
+///        are read once over a connection (see connect_task())
+/// @return bool (true if stored)
+bool adv_config_load(s_device *dev) {
+  s_adv_config ac;
+  char key[16];
+  size_t n;
+
+  memset(&ac, 0, sizeof(ac));
+  adv_config_key(dev->addr, key, sizeof(key));
+  n = pref.getBytes(key, &ac, sizeof(ac));
+  if ((n != sizeof(ac) && n != offsetof(s_adv_config, format)) ||
+      ac.id[0] == '\0' || ac.url[0] == '\0') {
+    return false;
+  }
+  ac.id[DATA_SIZE - 1] = '\0';
+  ac.url[DATA_SIZE - 1] = '\0';
+  set_data_id(dev, ac.id);
+  set_data_url(dev, ac.url);
+  snprintf(dev->link->url0, DATA_SIZE, "%s", ac.url);
+  dev->link->format = (ac.format == FMT_CBOR) ? FMT_CBOR : FMT_JSON;
+  return true;
+}
+
+/// @brief stores id and webservice of a connected device for advertisement
+///        mode
+/// @return
+void adv_config_save(s_device *dev) {
+  s_adv_config ac;
+  char key[16];
+
+  memset(&ac, 0, sizeof(ac));
+  snprintf(ac.id, DATA_SIZE, "%s", dev->link->id);
+  snprintf(ac.url, DATA_SIZE, "%s", dev->link->url0);
+  ac.format = dev->link->format;
+  adv_config_key(dev->addr, key, sizeof(key));
+  pref.putBytes(key, &ac, sizeof(ac));
+  return;
+}
+
+/// @brief waits for the result of the GATT operation just issued
+/// @return bool (true if the operation succeeded)
+bool gatt_wait(s_device *dev, esp_err_t err) {
+  if (err != ESP_OK) {
+    return false;
+  }
+  return xSemaphoreTake(dev->link->gattSem, pdMS_TO_TICKS(GATT_OP_MS)) ==
+             pdTRUE &&
+         dev->link->gattStatus == ESP_GATT_OK;
+}
+
+/// @brief sets up a connected device from cached handles without service
+///        discovery: reads the configuration characteristic, registers for
+///        notifications and enables them in the CCCDs
+/// @return bool (false if the handles are stale)
+bool connect_cached(int i, BLEClient *client, s_gatt_cache *gc) {
+  s_device *dev = &myDev[i];
+  uint8_t on[2] = {0x01, 0x00};
+  esp_bd_addr_t bda;
+
+  mac_unpack(dev->addr, bda);
+  dev->link->gattIf = client->getGattcIf();
+  dev->link->connId = client->getConnId();
+  memcpy(dev->link->handle, gc->value, sizeof(dev->link->handle));
+  xSemaphoreTake(dev->link->gattSem, 0);
+  dev->cached = true;
+
+  if (!gatt_wait(dev, esp_ble_gattc_read_char(dev->link->gattIf,
+                                              dev->link->connId, gc->config,
+                                              ESP_GATT_AUTH_REQ_NONE))) {
+    return false;
+  }
+  if (!config_valid(dev->link->gattValue)) {
+    return false;
+  }
+  Serial.print(" - characteristic value is: ");
+  Serial.println(dev->link->gattValue);
+  set_characteristic(dev, dev->link->gattValue);
+  Serial.printf(" --  id: %s\n", dev->link->id);
+  Serial.printf(" -- url: %s\n", dev->link->url);
+
+  for (int k = 0; k < GATT_HANDLES; k++) {
+    if (gc->value[k] == 0) {
+      continue;
+    }
+    if (!gatt_wait(dev, esp_ble_gattc_register_for_notify(
+                            dev->link->gattIf, bda, gc->value[k]))) {
+      return false;
+    }
+    if (!gatt_wait(dev, esp_ble_gattc_write_char_descr(
+                            dev->link->gattIf, dev->link->connId, gc->cccd[k],
+                            sizeof(on), on, ESP_GATT_WRITE_TYPE_RSP,
+                            ESP_GATT_AUTH_REQ_NONE))) {
+      return false;
     }
   }
+  return true;
 }
 
-/// @brief battery characteristic callback function
-/// @return
-static void
-notifyBatteryCallback(BLERemoteCharacteristic *pBLERemoteCharacteristic,
-                      BLEAddress BLEAddr, uint8_t *pData, size_t length,
-                      bool isNotify) {
-  //BLEDevice::getScan()->stop();
-  long double ts = (long double)get_epoch_time();
-  int i = index_by_mac(BLEAddr.toString().c_str());
-  int j = next_index(&myDev[i], ts);
-  int val = (int)(*pData);
-  s_data *dat = &(myDev[i].data[j]);
-  set_data_bat(dat, val);
-  Serial.printf("[%.9e]: BAT  CB / MAC: %s / DEV: %d/%d / VAL: %d\n", ts,
-                myDev[i].mac, i, j, val);
-}
-
-/// @brief temperature characteristic callback function
-/// @return
-static void
-notifyTemperatureCallback(BLERemoteCharacteristic *pBLERemoteCharacteristic,
-                          BLEAddress BLEAddr, uint8_t *pData, size_t length,
-                          bool isNotify) {
-  //BLEDevice::getScan()->stop();
-  long double ts = (long double)get_epoch_time();
-  int i = index_by_mac(BLEAddr.toString().c_str());
-  int j = next_index(&myDev[i], ts);
-  int val = (int)(*pData);
-  s_data *dat = &(myDev[i].data[j]);
-  set_data_temp(dat, val);
-  Serial.printf("[%.9e]: TEMP CB / MAC: %s / DEV: %d/%d / VAL: %d\n", ts,
-                myDev[i].mac, i, j, val);
-}
-/// @brief movement characteristic callback function
-/// @return
-static void
-notifyMovementCallback(BLERemoteCharacteristic *pBLERemoteCharacteristic,
-                       BLEAddress BLEAddr, uint8_t *pData, size_t length,
-                       bool isNotify) {
-  //BLEDevice::getScan()->stop();
-  long double ts = (long double)get_epoch_time();
-  int i = index_by_mac(BLEAddr.toString().c_str());
-  int j = next_index(&myDev[i], ts);
-  int val = (int)(*pData);
-  s_data *dat = &(myDev[i].data[j]);
-  set_data_mov(dat, val);
-  Serial.printf("[%.9e]: MOV  CB / MAC: %s / DEV: %d/%d / VAL: %d\n", ts,
-                myDev[i].mac, i, j, val);
-}
-
-/// @brief button characteristic callback function
-/// @return
-static void
-notifyButtonCallback(BLERemoteCharacteristic *pBLERemoteCharacteristic,
-                     BLEAddress BLEAddr, uint8_t *pData, size_t length,
-                     bool isNotify) {
-  //BLEDevice::getScan()->stop();
-  long double ts = (long double)get_epoch_time();
-  int i = index_by_mac(BLEAddr.toString().c_str());
-  int j = next_index(&myDev[i], ts);
-  int val = (int)(*pData);
-  s_data *dat = &(myDev[i].data[j]);
-  set_data_btn(dat, val);
-  Serial.printf("[%.9e]: BTN  CB / MAC: %s / DEV: %d/%d / VAL: %d\n", ts,
-                myDev[i].mac, i, j, val);
+/// @brief updates the reconnect backoff of a device after a connection
+///        attempt (connection setup task)
+/// @return
+void reconnect_backoff(uint64_t addr, bool ok) {
+  s_mac_entry *e = mac_find(addr);
+
+  if (e == NULL) {
+    return;
+  }
+  if (ok) {
+    e->tries = 0;
+    return;
+  }
+  if (e->tries < RECONNECT_MAX_TRIES) {
+    e->tries++;
+  }
+  e->retry = millis() + (RECONNECT_BASE_MS << (e->tries - 1));
+  if (e->tries == RECONNECT_MAX_TRIES) {
+    Serial.println("CONN: direct reconnect failed, falling back to scan");
+  }
+  return;
 }
 
-/// @brief BLE client callback class
+/// @brief connection setup task of one scanned device (D_CONNECTING); link
+///        establishment is serialized (the controller handles one pending
+///        connection at a time), service discovery runs in parallel to the
+///        setup of other devices
 /// @return
-class MyClientCallback : public BLEClientCallbacks {
-  void onConnect(BLEClient *pclient) {
-    int i = index_by_client(pclient);
-    if (i == NO_INDEX) {
-      Serial.println("ERROR: wrong onConnect() index");
+void connect_task(void *arg) {
+  int i = (int)(intptr_t)arg;
+  s_device *dev = &myDev[i];
+  uint64_t addr = dev->addr;
+  unsigned long t0 = millis();
+  unsigned long t1, t2, t3;
+  esp_bd_addr_t bda;
+  BLEClient *client;
+  bool cached = false;
+  bool ok;
+
+  xSemaphoreTake(connLock, portMAX_DELAY);
+  t1 = millis();
+  Serial.printf("connecting to %s [%d]\n", dev->link->mac, i);
+
+  // forget the characteristics of the previous device in this slot
+  chr_purge(i);
+  if (dev->link->client == NULL) {
+    dev->link->client = BLEDevice::createClient();
+    dev->link->client->setClientCallbacks(&clientCallbacks);
+  }
+  client = dev->link->client;
+  dev->link->pClient = client;
+
+  // connect to the remote BLE server; a device that went away must not
+  // hold up the connections of the other devices
+  mac_unpack(dev->addr, bda);
+  ok = client->connect(BLEAddress(bda), (esp_ble_addr_type_t)dev->addr_type,
+                       BLE_CONNECT_MS);
+  t2 = millis();
+  if (!ok && t2 - t1 >= BLE_CONNECT_MS) {
+    // cancel the pending connection before the next device is connected
+    Serial.printf(" - connect to [%d] timed out\n", i);
+    client->disconnect();
+    esp_ble_gap_disconnect(bda);
+  }
+  xSemaphoreGive(connLock);
+
+  if (ok) {
+    s_gatt_cache gc;
+    uint16_t config = 0;
+
+    Serial.printf(" - connected to server [%d]\n", i);
+    if (gatt_load(dev, &gc)) {
+      cached = connect_cached(i, client, &gc);
+      if (!cached) {
+        // stale handles (e.g. new firmware on the puck); discover again
+        Serial.printf(" - GATT cache of [%d] is stale\n", i);
+        dev->cached = false;
+        gatt_drop(dev);
+      }
+    }
+    if (!cached && client->isConnected()) {
+      ok = connect_discover(i, client, &config);
+      if (ok && config != 0) {
+        gatt_save(dev, config);
+      }
+    }
+    ok = cached || ok;
+  }
+  t3 = millis();
+
+  // the device may have disconnected meanwhile (slot reset by onDisconnect)
+  if (!ok || dev->state != D_CONNECTING || dev->link->pClient != client) {
+    Serial.printf("CONN [%s] [%d] setup failed after %lu ms\n",
+                  dev->link->mac, i, t3 - t0);
+    if (client->isConnected()) {
+      client->disconnect();
     }
+    if (dev->link->pClient == client) {
+      reset_device(i);
+    }
+    reconnect_backoff(addr, false);
+    dev->link->setup = false;
+    vTaskDelete(NULL);
+    return;
+  }
+  reconnect_backoff(addr, true);
+  if (advMode) {
+    // the connection was only needed for id and webservice
+    adv_config_save(dev);
+    Serial.printf("CONN [%s] [%d] config read in %lu ms, advertisement mode\n",
+                  dev->link->mac, i, t3 - t0);
+    client->disconnect();
+    dev->link->setup = false;
+    vTaskDelete(NULL);
+    return;
   }
+  dev->state = D_CONNECTED;
+  dev->link->online = t3 - dev->link->found;
+  Serial.printf("CONN [%s] [%d] online in %lu ms since found (setup %lu ms: "
+                "queued %lu, connect %lu, %s %lu)\n",
+                dev->link->mac, i, dev->link->online, t3 - t0, t1 - t0, t2 - t1,
+                cached ? "cached" : "discovery", t3 - t2);
+  dev->link->setup = false;
+  vTaskDelete(NULL);
+}
 
-  void onDisconnect(BLEClient *pclient) {
-    int i = index_by_client(pclient);
+/// @brief reconnects lost devices directly by their stored address and
+///        address type (no scan); attempts are spaced by an exponential
+///        backoff, after RECONNECT_MAX_TRIES failures the device is left to
+///        the scan scheduler
+/// @return
+void reconnect_devices(void) {
+  s_mac_entry *tab = mac_tab();
+
+  for (int k = 0; k < MAC_TAB_SIZE; k++) {
+    s_mac_entry *e = &tab[k];
+
+    if (e->mac == 0 || e->dev != NO_INDEX || !mac_direct(e)) {
+      continue;
+    }
+    if (e->tries > 0 && (long)(millis() - e->retry) < 0) {
+      continue;
+    }
+    int i = index_by_state(D_DISCONNECTED);
     if (i == NO_INDEX) {
-      Serial.println("ERROR: wrong onDisconnect() index");
-    } else {
-      if (myDev[i].state != D_DISCONNECTED) {
-        reset_device(i);
-      }
-      Serial.print("onDisconnect... ");
-      Serial.printf("MAC [%s] [%d]\n", myDev[i].mac, i);
+      return;
     }
+    myDev[i].addr = e->mac;
+    myDev[i].addr_type = e->type;
+    mac_string(e->mac, myDev[i].link->mac);
+    myDev[i].link->tplStale = true;
+    myDev[i].link->found = millis();
+    e->dev = i;
+    myDev[i].state = D_SCANNED;
+    Serial.printf("reconnecting %s directly (attempt %d)\n", myDev[i].link->mac,
+                  e->tries + 1);
   }
-};
+  return;
+}
 
-/// @brief starts connection to a BLE server
+/// @brief starts a setup task for every scanned device; connections are set
+///        up concurrently and the ingest task does not wait for them
 /// @return
-void connectToServer() {
-  int i = NO_INDEX;
+void connect_devices(void) {
+  int n = 0;
 
-  while (1) {
-    // connect only if this server was scanned and is known
-    i = index_by_state(D_SCANNED);
-    if (i == NO_INDEX) {
-      break;
+  for (int i = 0; i < devCount; i++) {
+    n += (myDev[i].state == D_CONNECTING || myDev[i].state == D_CONNECTED);
+  }
+  for (int i = 0; i < devCount; i++) {
+    // the client of the slot is still used by the previous setup task
+    if (myDev[i].state != D_SCANNED || myDev[i].link->setup) {
+      continue;
+    }
+    // slots may outnumber the controller's connections (advertisement mode)
+    if (n >= connMax) {
+      return;
     }
-    // set device state to connected
-    myDev[i].state = D_CONNECTED;
+    n++;
+    myDev[i].state = D_CONNECTING;
+    myDev[i].link->setup = true;
+    if (xTaskCreate(connect_task, "connect", CONN_TASK_STACK,
+                    (void *)(intptr_t)i, CONN_TASK_PRIO, NULL) != pdPASS) {
+      // try again on the next pass
+      myDev[i].link->setup = false;
+      myDev[i].state = D_SCANNED;
+    }
+  }
+  return;
+}
 
-    Serial.print("connecting to ");
-    Serial.println(myDev[i].mac);
+/// @brief checks if advertising data lists the 128-bit service UUID uuid
+/// @return bool (true if found)
+bool adv_has_uuid(const uint8_t *p, size_t len, const uint8_t *uuid) {
+  size_t i = 0;
 
-    myDev[i].pClient = BLEDevice::createClient();
-    Serial.println(" - created client");
+  while (i + 1 < len && p[i] != 0) {
+    size_t n = p[i];
+    uint8_t type = p[i + 1];
+
+    if (i + 1 + n > len) {
+      break;
+    }
+    // incomplete or complete list of 128-bit service UUIDs
+    if (type == 0x06 || type == 0x07) {
+      for (size_t k = i + 2; k + ESP_UUID_LEN_128 <= i + 1 + n;
+           k += ESP_UUID_LEN_128) {
+        if (memcmp(&p[k], uuid, ESP_UUID_LEN_128) == 0) {
+          return true;
+        }
+      }
+    }
+    i += n + 1;
+  }
+  return false;
+}
 
-    myDev[i].pClient->setClientCallbacks(new MyClientCallback());
+/// @brief loads the configured MAC addresses into the controller whitelist;
+///        each address is added as public and as random address, as the
+///        type is not configured. On failure the scan falls back to
+///        filtering by the host (scan callback)
+/// @return
+void scan_whitelist(void) {
+  s_mac_entry *tab = mac_tab();
+  int n = 0;
+  bool ok = (esp_ble_gap_clear_whitelist() == ESP_OK);
 
-    // connect to the remote BLE server
-    myDev[i].pClient->connect(myDev[i].pDevice);
-    Serial.println(" - connected to server");
+  for (int i = 0; ok && i < MAC_TAB_SIZE; i++) {
+    esp_bd_addr_t bda;
 
-    // obtain a reference to the service we are after in the remote BLE server
-    BLERemoteService *pRemoteService =
-        myDev[i].pClient->getService(serviceUUID);
-    if (pRemoteService == nullptr) {
-      Serial.print("failed to find our service UUID: ");
-      Serial.println(serviceUUID.toString().c_str());
-      myDev[i].pClient->disconnect();
-      reset_device(i);
+    if (tab[i].mac == 0) {
       continue;
     }
-    Serial.println(" - found service");
-
-    // Read the value of the characteristic.
-    BLERemoteCharacteristic *pRemoteCharacteristic =
-        pRemoteService->getCharacteristic(serviceUUID);
-    if (pRemoteCharacteristic->canRead()) {
-      std::string value = pRemoteCharacteristic->readValue();
-      Serial.print(" - characteristic value is: ");
-      Serial.println(value.c_str());
-      set_characteristic(&myDev[i], value.c_str());
-      Serial.printf(" --  id: %s\n", myDev[i].id);
-      Serial.printf(" -- url: %s\n", myDev[i].url);
-    }
-
-    // obtain references to the characteristics in the service ...
-    // battery characteristic characteristic
-    myDev[i].batCharacteristic =
-        pRemoteService->getCharacteristic(batCharacteristicUUID);
-    if (myDev[i].batCharacteristic == nullptr) {
-      Serial.print("Failed to find our characteristic UUID: ");
-      Serial.println(batCharacteristicUUID.toString().c_str());
-      myDev[i].pClient->disconnect();
-      reset_device(i);
-      continue;
+    mac_unpack(tab[i].mac, bda);
+    ok = (esp_ble_gap_update_whitelist(true, bda, BLE_WL_ADDR_TYPE_PUBLIC) ==
+          ESP_OK) &&
+         (esp_ble_gap_update_whitelist(true, bda, BLE_WL_ADDR_TYPE_RANDOM) ==
+          ESP_OK);
+    n++;
+  }
+  scanWhitelist = ok && n > 0;
+  if (scanWhitelist) {
+    Serial.printf("SCAN: controller whitelist with %d devices\n", n);
+  } else {
+    Serial.println("SCAN: whitelist not available, host filtering");
+  }
+  return;
+}
+
+/// @brief takes the sensor frame from the advertisement of a configured
+///        device (BLE task, advertisement mode); repeated frames are dropped
+///        and a device whose id and webservice are not stored yet is
+///        connected once to read them
+/// @return bool (true if the advertisement carried a sensor frame)
+static bool adv_ingest(s_mac_entry *e, esp_ble_gap_cb_param_t *param) {
+  adv_frame f;
+  int presses = 0;
+  int i = e->dev;
+
+  if (!adv_decode(param->scan_rst.ble_adv,
+                  param->scan_rst.adv_data_len + param->scan_rst.scan_rsp_len,
+                  &f)) {
+    return false;
+  }
+  scanAccepted++;
+  e->type = (uint8_t)param->scan_rst.ble_addr_type;
+  e->known = true;
+  if (i == NO_INDEX) {
+    i = index_by_state(D_DISCONNECTED);
+    if (i == NO_INDEX) {
+      Serial.println("ERROR: no free index");
+      return true;
+    }
+    myDev[i].addr = e->mac;
+    myDev[i].addr_type = e->type;
+    mac_string(e->mac, myDev[i].link->mac);
+    myDev[i].link->tplStale = true;
+    myDev[i].link->found = millis();
+    e->dev = i;
+    if (!adv_config_load(&myDev[i])) {
+      myDev[i].state = D_SCANNED;
+      Serial.printf("ADV [%s] [%d] no config, connecting once\n",
+                    myDev[i].link->mac, i);
+      esp_ble_gap_stop_scanning();
+      return true;
+    }
+    myDev[i].state = D_ADVERT;
+    Serial.printf("ADV [%s] [%d] receiving sensor frames, rssi: %d\n",
+                  myDev[i].link->mac, i, param->scan_rst.rssi);
+  }
+  if (myDev[i].state != D_ADVERT) {
+    return true;
+  }
+  if (!adv_accept(&e->seen, &f, &presses)) {
+    advRepeats++;
+    return true;
+  }
+  advFrames++;
+  push_frame(i, &f, clock_ms(), presses > 0);
+  return true;
+}
+
+/// @brief handles a scan result (BLE task); only configured devices which
+///        advertise our service are taken
+/// @return
+static void scan_result(esp_ble_gap_cb_param_t *param) {
+  uint64_t mac = mac_pack(param->scan_rst.bda);
+  s_mac_entry *e;
+
+  scanSeen++;
+  // host filter (always passes if the controller whitelist is used)
+  e = mac_find(mac);
+  if (e == NULL) {
+    return;
+  }
+  if (advMode) {
+    // devices not sending sensor frames are ignored in this mode
+    adv_ingest(e, param);
+    return;
+  }
+  if (!adv_has_uuid(param->scan_rst.ble_adv,
+                    param->scan_rst.adv_data_len + param->scan_rst.scan_rsp_len,
+                    serviceUUID.getNative()->uuid.uuid128)) {
+    return;
+  }
+  scanAccepted++;
+  // remember the address type for direct reconnects
+  e->type = (uint8_t)param->scan_rst.ble_addr_type;
+  e->known = true;
+  e->tries = 0;
+  // get the next unused device index
+  if (e->dev != NO_INDEX) {
+    return;
+  }
+  int i = index_by_state(D_DISCONNECTED);
+  if (i == NO_INDEX) {
+    Serial.println("ERROR: no free index");
+    return;
+  }
+  myDev[i].state = D_SCANNED;
+  myDev[i].addr = mac;
+  myDev[i].addr_type = (uint8_t)param->scan_rst.ble_addr_type;
+  mac_string(mac, myDev[i].link->mac);
+  myDev[i].link->tplStale = true;
+  myDev[i].link->found = millis();
+  e->dev = i;
+  Serial.printf("BLE Advertised Device found: %s, rssi: %d\n",
+                myDev[i].link->mac, param->scan_rst.rssi);
+  // keep scanning for the other missing devices, they are connected together
+  s_mac_entry *tab = mac_tab();
+
+  for (int k = 0; k < MAC_TAB_SIZE; k++) {
+    if (tab[k].mac != 0 && tab[k].dev == NO_INDEX && !mac_direct(&tab[k])) {
+      return;
     }
-    Serial.println(" - found battery characteristic");
+  }
+  esp_ble_gap_stop_scanning();
+}
+
+/// @brief ends a scan and runs the completion callback (BLE task)
+/// @return
+static void scan_complete(void) {
+  if (!scanRunning) {
+    return;
+  }
+  scanRunning = false;
+  if (scanCallback != NULL) {
+    scanCallback();
+  }
+}
 
-    // register battery characteristic callback
-    if (myDev[i].batCharacteristic->canNotify()) {
-      myDev[i].batCharacteristic->registerForNotify(notifyBatteryCallback);
+/// @brief GAP event handler for scanning (BLE task)
+/// @return
+static void scan_gap_handler(esp_gap_ble_cb_event_t event,
+                             esp_ble_gap_cb_param_t *param) {
+  switch (event) {
+  case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT:
+    if (param->scan_param_cmpl.status != ESP_BT_STATUS_SUCCESS ||
+        esp_ble_gap_start_scanning(SCAN_TIME_SEC) != ESP_OK) {
+      scan_complete();
+    }
+    break;
+  case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:
+    if (param->scan_start_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+      scan_complete();
+    }
+    break;
+  case ESP_GAP_BLE_UPDATE_WHITELIST_COMPLETE_EVT:
+    if (param->update_whitelist_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+      scanWhitelist = false;
+    }
+    break;
+  case ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT:
+    scan_complete();
+    break;
+  case ESP_GAP_BLE_SCAN_RESULT_EVT:
+    if (param->scan_rst.search_evt == ESP_GAP_SEARCH_INQ_RES_EVT) {
+      scan_result(param);
+    } else if (param->scan_rst.search_evt == ESP_GAP_SEARCH_INQ_CMPL_EVT) {
+      scan_complete();
     }
+    break;
+  default:
+    break;
+  }
+}
 
-    // temperature characteristic
-    myDev[i].tempCharacteristic =
-        pRemoteService->getCharacteristic(tempCharacteristicUUID);
-    if (myDev[i].tempCharacteristic == nullptr) {
-      Serial.print("Failed to find our characteristic UUID: ");
-      Serial.println(tempCharacteristicUUID.toString().c_str());
-      myDev[i].pClient->disconnect();
-      reset_device(i);
-      continue;
+/// @brief starts a scan for BLE servers with known MAC and service and
+///        returns at once; done is called in the BLE task when the scan has
+///        ended (timeout or device found). The controller only reports
+///        whitelisted devices unless the whitelist could not be set up
+/// @return bool (true if the scan was started)
+bool scan_start(uint16_t window, void (*done)(void)) {
+  esp_ble_scan_params_t params;
+
+  if (scanRunning) {
+    return false;
+  }
+  if (scanDirty) {
+    scan_whitelist();
+    scanDirty = false;
+  }
+  params.scan_type = scanActive ? BLE_SCAN_TYPE_ACTIVE : BLE_SCAN_TYPE_PASSIVE;
+  params.own_addr_type = BLE_ADDR_TYPE_PUBLIC;
+  params.scan_filter_policy = scanWhitelist ? BLE_SCAN_FILTER_ALLOW_ONLY_WLST
+                                            : BLE_SCAN_FILTER_ALLOW_ALL;
+  params.scan_interval = SCAN_INTERVAL_MS * 1000 / 625;
+  params.scan_window = window * 1000 / 625;
+  params.scan_duplicate = BLE_SCAN_DUPLICATE_DISABLE;
+
+  scanCallback = done;
+  scanRunning = true;
+  if (esp_ble_gap_set_scan_params(&params) != ESP_OK) {
+    scanRunning = false;
+    Serial.println("SCAN: failed to set parameters");
+    return false;
+  }
+  return true;
+}
+
+/// @brief scan completion callback of the scheduler (BLE task)
+/// @return
+static void scan_done(void) {
+  scanStopped = millis();
+  scanDone = true;
+}
+
+/// @brief schedules scans while configured devices are missing; the fewer
+///        devices are missing, the shorter the scan window and the longer
+///        the pause between scans (no scan if all devices are connected).
+///        Never blocks
+/// @return
+void scan_schedule(void) {
+  static uint32_t seen = 0;
+  static uint32_t accepted = 0;
+  s_mac_entry *tab = mac_tab();
+  int configured = 0;
+  int missing = 0;
+
+  if (scanDone) {
+    scanDone = false;
+    Serial.printf("SCAN: %s filter, adverts seen: %u accepted: %u "
+                  "(total %u/%u)\n",
+                  scanWhitelist ? "whitelist" : "host",
+                  (unsigned)(scanSeen - seen),
+                  (unsigned)(scanAccepted - accepted), (unsigned)scanSeen,
+                  (unsigned)scanAccepted);
+    if (advMode) {
+      Serial.printf("ADV: frames %u repeated %u\n", (unsigned)advFrames,
+                    (unsigned)advRepeats);
+    }
+    seen = scanSeen;
+    accepted = scanAccepted;
+  }
+  if (scanRunning) {
+    // the scan is stopped by the controller after SCAN_TIME_SEC
+    return;
+  }
+  if (advMode) {
+    // sensor frames are received while scanning only; the scan is just
+    // held while a device is connected for its config
+    if (index_by_state(D_SCANNED) == NO_INDEX &&
+        index_by_state(D_CONNECTING) == NO_INDEX) {
+      scan_start(ADV_SCAN_WINDOW_MS, scan_done);
     }
-    Serial.println(" - found temperature characteristic");
+    return;
+  }
+  for (int i = 0; i < MAC_TAB_SIZE; i++) {
+    if (tab[i].mac != 0) {
+      configured++;
+      // devices are scanned for once direct reconnects keep failing
+      if (tab[i].dev == NO_INDEX && !mac_direct(&tab[i])) {
+        missing++;
+      }
+    }
+  }
+  // no free slot or connections are being set up
+  if (missing == 0 || index_by_state(D_DISCONNECTED) == NO_INDEX ||
+      index_by_state(D_SCANNED) != NO_INDEX ||
+      index_by_state(D_CONNECTING) != NO_INDEX) {
+    return;
+  }
+  if (scanStopped != 0 && millis() - scanStopped < scanPause) {
+    return;
+  }
+  uint16_t window = SCAN_WINDOW_MIN_MS +
+                    (SCAN_WINDOW_MAX_MS - SCAN_WINDOW_MIN_MS) * missing /
+                        configured;
+  scanPause = (unsigned long)SCAN_PAUSE_MS * (configured - missing) /
+              configured;
+  if (scan_start(window, scan_done)) {
+    Serial.printf("scanning ... [%d/%d missing] window %u ms, pause %lu ms\n",
+                  missing, configured, window, scanPause);
+  }
+  return;
+}
 
-    // register temperature characteristic callback
-    if (myDev[i].tempCharacteristic->canNotify()) {
-      myDev[i].tempCharacteristic->registerForNotify(notifyTemperatureCallback);
+/// @brief BLE ingest task: applies a changed MAC list, starts connection
+///        setup for scanned or lost devices and schedules scans;
+///        notifications and advertisements arrive in the BLE task and are
+///        handed on by the event rings
+/// @return
+void ingest_task(void *arg) {
+  while (1) {
+    int64_t t0 = esp_timer_get_time();
+
+    if (macDirty) {
+      macDirty = false;
+      mac_table();
+      scanDirty = true;
+    }
+    if (isConfigured) {
+      // connect scanned or lost BLE servers (in the background)
+      if (!advMode) {
+        reconnect_devices();
+      }
+      if (!scanRunning) {
+        connect_devices();
+      }
+      // scan in the background while configured devices are missing
+      scan_schedule();
     }
+    task_busy(T_INGEST, t0);
+    vTaskDelay(pdMS_TO_TICKS(INGEST_MS));
+  }
+}
 
-    // movement characteristic
-    myDev[i].movCharacteristic =
-        pRemoteService->getCharacteristic(movCharacteristicUUID);
-    if (myDev[i].movCharacteristic == nullptr) {
-      Serial.print("Failed to find our characteristic UUID: ");
-      Serial.println(movCharacteristicUUID.toString().c_str());
-      myDev[i].pClient->disconnect();
-      reset_device(i);
-      continue;
+/// @brief assembly task: assembles datasets from the received
+///        notifications and encodes the packs for the uplink task; woken by
+///        every notification, at least every ASSEMBLY_MS for the dataset
+///        and batch windows
+/// @return
+void assembly_task(void *arg) {
+  s_result r;
+
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ASSEMBLY_MS));
+    int64_t t0 = esp_timer_get_time();
+
+    // URLs learned by the uplink task (redirects)
+    while (xQueueReceive(resultQueue, &r, 0) == pdTRUE) {
+      send_url(r.from, r.url);
     }
-    Serial.println(" - found movement characteristic");
+    if (isConfigured) {
+      drain_events();
+      flush_packs();
+    }
+    task_busy(T_ASSEMBLY, t0);
+  }
+}
 
-    // register movement characteristic callback
-    if (myDev[i].movCharacteristic->canNotify()) {
-      myDev[i].movCharacteristic->registerForNotify(notifyMovementCallback);
+/// @brief uplink task: sends alerts, packs and stored packs and advances
+///        the requests in flight; polls every UPLINK_POLL_MS while requests
+///        are in flight, otherwise waits for work up to UPLINK_MS. A slow
+///        webservice only holds up this task
+/// @return
+void uplink_task(void *arg) {
+  while (1) {
+    int64_t t0 = esp_timer_get_time();
+    bool busy = false;
+
+    clock_sync();
+    conn_gc();
+    conn_warm();
+    if (isConfigured) {
+      // button alerts go first
+      send_alerts();
+      send_packs();
+      // resend packs stored while the webservice was unreachable
+      queue_drain();
+    }
+    http_poll();
+    for (int i = 0; i < MAX_INFLIGHT; i++) {
+      busy |= (myHttp[i].stage != H_IDLE);
     }
+#ifdef UPLINK_STALL
+    // a webservice holding up the uplink task (e.g. in the TLS handshake);
+    // the event lag of the task report shows whether the assembly of the
+    // datasets is delayed by it
+    if (busy) {
+      delay(UPLINK_STALL);
+    }
+#endif
+    task_busy(T_UPLINK, t0);
+    ulTaskNotifyTake(pdTRUE,
+                     pdMS_TO_TICKS(busy ? UPLINK_POLL_MS : UPLINK_MS));
+  }
+}
 
-    // button characteristic
-    myDev[i].btnCharacteristic =
-        pRemoteService->getCharacteristic(btnCharacteristicUUID);
-    if (myDev[i].btnCharacteristic == nullptr) {
-      Serial.print("Failed to find our characteristic UUID: ");
-      Serial.println(btnCharacteristicUUID.toString().c_str());
-      myDev[i].pClient->disconnect();
-      reset_device(i);
+/// @brief prints CPU time (share of one core) and unused stack of every
+///        task, the depth of the queues between them and the longest wait of
+///        a notification in the event ring for the last ms
+/// @return
+void task_report(unsigned long ms) {
+  for (int i = 0; i < MAX_TASKS; i++) {
+    s_task *t = &myTasks[i];
+    uint32_t busy = t->busy;
+
+    if (t->handle == NULL) {
       continue;
     }
-    Serial.println(" - found button characteristic");
+    Serial.printf("TASK [%s] core %d prio %u cpu %.1f%% stack free %u\n",
+                  t->name, (int)t->core, (unsigned)t->prio,
+                  (busy - t->busyLast) / (ms * 10.0),
+                  (unsigned)uxTaskGetStackHighWaterMark(t->handle));
+    t->busyLast = busy;
+  }
+  Serial.printf("TASK queues: events %u alerts %u packs %u/%u results %u\n",
+                (unsigned)event_ring_depth(&myEvents),
+                (unsigned)alert_ring_depth(&myAlerts),
+                (unsigned)uxQueueMessagesWaiting(packQueue), PACK_BUFS,
+                (unsigned)uxQueueMessagesWaiting(resultQueue));
+  Serial.printf("TASK events: peak %u dropped %u lag max %lu ms\n",
+                (unsigned)myEvents.peak, (unsigned)myEvents.drops, eventLag);
+  eventLag = 0;
+  return;
+}
+
+/// @brief portal task: serves the captive portal and the configuration
+///        pages and prints the task report every TASK_REPORT_MS
+/// @return
+void portal_task(void *arg) {
+  unsigned long report = millis();
+
+  while (1) {
+    int64_t t0 = esp_timer_get_time();
 
-    // register button characteristic callback
-    if (myDev[i].btnCharacteristic->canNotify()) {
-      myDev[i].btnCharacteristic->registerForNotify(notifyButtonCallback);
+    Portal.handleClient();
+    task_busy(T_PORTAL, t0);
+    if (millis() - report >= TASK_REPORT_MS) {
+      task_report(millis() - report);
+      report = millis();
     }
+    vTaskDelay(pdMS_TO_TICKS(PORTAL_MS));
   }
+}
 
-  Serial.println("done.");
+/// @brief starts task id pinned to core (core 0 on a single core chip)
+/// @return bool (true if the task is running)
+bool task_start(int id, const char *name, void (*fn)(void *),
+                uint32_t stack, UBaseType_t prio, BaseType_t core) {
+  s_task *t = &myTasks[id];
+
+  t->name = name;
+  t->prio = prio;
+  t->core = (core < portNUM_PROCESSORS) ? core : 0;
+  if (xTaskCreatePinnedToCore(fn, name, stack, NULL, prio, &t->handle,
+                              t->core) != pdPASS) {
+    Serial.printf("TASK [%s] not started\n", name);
+    return false;
+  }
+  return true;
+}
 
+/// @brief creates the queues between the tasks and starts them: the BLE
+///        task feeds the assembly task (event ring) and the uplink task
+///        (alert ring), the assembly task hands packs to the uplink task
+///        (packQueue, buffers return through packFree) and gets URL
+///        updates back (resultQueue)
+/// @return
+void tasks_start(void) {
+  packQueue = xQueueCreate(PACK_BUFS, sizeof(s_pack));
+  packFree = xQueueCreate(PACK_BUFS, sizeof(char *));
+  resultQueue = xQueueCreate(MAX_RESULTS, sizeof(s_result));
+  for (int i = 0; i < PACK_BUFS; i++) {
+    char *buf = packBuf[i];
+    xQueueSend(packFree, &buf, 0);
+  }
+  task_start(T_ASSEMBLY, "assembly", assembly_task, ASSEMBLY_STACK,
+             ASSEMBLY_PRIO, ASSEMBLY_CORE);
+  task_start(T_UPLINK, "uplink", uplink_task, UPLINK_STACK, UPLINK_PRIO,
+             UPLINK_CORE);
+  task_start(T_INGEST, "ingest", ingest_task, INGEST_STACK, INGEST_PRIO,
+             INGEST_CORE);
+  task_start(T_PORTAL, "portal", portal_task, PORTAL_STACK, PORTAL_PRIO,
+             PORTAL_CORE);
   return;
 }
 
-/// @brief scan for BLE servers with known MAC and service
-/// @return
-class MyAdvertisedDeviceCallbacks : public BLEAdvertisedDeviceCallbacks {
-  // called for each advertising BLE server
-  void onResult(BLEAdvertisedDevice advertisedDevice) {
-    Serial.print("BLE Advertised Device found: ");
-    Serial.println(advertisedDevice.toString().c_str());
-    // device found, lets now see if it contains proper MAC and service
-    if (advertisedDevice.haveServiceUUID() &&
-        advertisedDevice.isAdvertisingService(serviceUUID) &&
-        has_mac(advertisedDevice.getAddress().toString().c_str())) {
-      BLEDevice::getScan()->stop();
-      // get the next unused device index
-      if (index_by_mac(advertisedDevice.getAddress().toString().c_str()) ==
-          NO_INDEX) {
-        int i = index_by_state(D_DISCONNECTED);
-        if (i == NO_INDEX) {
-          Serial.println("ERROR: no free index");
-        } else {
-          myDev[i].state = D_SCANNED;
-          myDev[i].pDevice = new BLEAdvertisedDevice(advertisedDevice);
-          strcpy(myDev[i].mac,
-                 advertisedDevice.getAddress().toString().c_str());
-        }
+#ifdef REGISTRY_BENCH
+/// @brief  compares the MAC table lookup with the former lookup (MAC string
+///         and linear search) for REGISTRY_BENCH simulated devices; build
+///         with -DREGISTRY_BENCH=<n> to run it at the end of setup
+/// @return
+void registry_bench(void) {
+  const int n = REGISTRY_BENCH;
+  const int rounds = 10000;
+  int size = 1;
+  s_mac_entry *tab = NULL;
+  uint64_t *macs = NULL;
+  char (*strs)[MAC_SIZE] = NULL;
+  int hits = 0;
+  int64_t t0, t1, t2;
+
+  while (size < 2 * n) {
+    size <<= 1;
+  }
+  tab = (s_mac_entry *)calloc(size, sizeof(s_mac_entry));
+  macs = (uint64_t *)malloc(n * sizeof(uint64_t));
+  strs = (char (*)[MAC_SIZE])malloc(n * MAC_SIZE);
+  if (tab == NULL || macs == NULL || strs == NULL) {
+    Serial.println("BENCH: out of memory");
+    goto done;
+  }
+  for (int i = 0; i < n; i++) {
+    macs[i] = (((uint64_t)esp_random() << 32) | esp_random()) &
+              0xFFFFFFFFFFFFULL;
+    mac_insert(tab, size, macs[i]);
+    mac_string(macs[i], strs[i]);
+  }
+
+  t0 = esp_timer_get_time();
+  for (int r = 0; r < rounds; r++) {
+    hits += (mac_probe(tab, size, macs[r % n]) != NULL);
+  }
+  t1 = esp_timer_get_time();
+  for (int r = 0; r < rounds; r++) {
+    char tmp[MAC_SIZE];
+    mac_string(macs[r % n], tmp);
+    for (int i = 0; i < n; i++) {
+      if (strcmp(strs[i], tmp) == 0) {
+        hits++;
+        break;
       }
     }
   }
-};
+  t2 = esp_timer_get_time();
+
+  Serial.printf("BENCH: %d devices, %d lookups (%d hits)\n", n, rounds, hits);
+  Serial.printf("BENCH: MAC table %.3f us/lookup (%u bytes)\n",
+                (double)(t1 - t0) / rounds,
+                (unsigned)(size * sizeof(s_mac_entry)));
+  Serial.printf("BENCH: string search %.3f us/lookup (%u bytes)\n",
+                (double)(t2 - t1) / rounds, (unsigned)(n * MAC_SIZE));
+  Serial.printf("BENCH: registry blob %u bytes, slot %u bytes, heap %lu\n",
+                (unsigned)(offsetof(s_registry, mac) + 6 * MAX_MACS),
+                (unsigned)(sizeof(s_device) + sizeof(s_link)),
+                (unsigned long)ESP.getFreeHeap());
+
+done:
+  free(tab);
+  free(macs);
+  free(strs);
+  return;
+}
+#endif
 
 /// @brief ESP 32 device setup
 /// @return
@@ -1259,6 +4479,12 @@ void setup() {
     Serial.println("EEPROM storage initialized");
   }
 
+  // device registry and slots (needed by the portal handlers)
+  isConfigured = (reg_load() == 1);
+  advMode = pref.getBool(ADV_KEY, false);
+  Serial.printf("BLE ingest: %s\n", advMode ? "advertisements" : "connections");
+  dev_init();
+
   Config.autoReset = false;     // Not reset the module even by intentional disconnection using AutoConnect menu.
   Config.autoReconnect = true;  // Reconnect to known access points.
   Config.reconnectInterval = 6; // Reconnection attempting interval is 3[min].
@@ -1271,83 +4497,54 @@ void setup() {
   Portal.on("/dec4iot", loadOn, AC_EXIT_AHEAD);
   Portal.on("/save", saveOn, AC_EXIT_AHEAD);
 
+  sntp_set_time_sync_notification_cb(clock_notify);
+
   if (Portal.begin()) {
     Serial.println("WiFi connected: " + WiFi.localIP().toString());
     configTime(TZ[TZindex].tzoff * GMT_OFF_SEC, DLT_OFF_SEC, TZ[TZindex].ntpServer);
   }
 
-  Serial.printf("TIME [%.9e] HEAP [%lu] ", (long double)get_epoch_time(),
+  Serial.printf("TIME [%.9e] HEAP [%lu] ", (long double)clock_ms() / 1000,
                 (unsigned long)ESP.getFreeHeap());
   Serial.println("starting Arduino BLE Client application...");
 
-  client = new WiFiClientSecure;
-  client->setInsecure();
-
   location = get_location();
+  senmlLocLen = 0;
 
   delay(4000);
-  reset_devices();
 
-  Serial.printf("TIME [%.9e] HEAP [%lu]\n", (long double)get_epoch_time(),
+  hasQueue = queue_init();
+
+  Serial.printf("TIME [%.9e] HEAP [%lu]\n", (long double)clock_ms() / 1000,
                 (unsigned long)ESP.getFreeHeap());
 
   BLEDevice::init(DEV_NAME);
 
-  pBLEScan = BLEDevice::getScan();
-  pBLEScan->setAdvertisedDeviceCallbacks(new MyAdvertisedDeviceCallbacks());
-  pBLEScan->setInterval(1349);
-  pBLEScan->setWindow(449);
+  BLEDevice::setCustomGapHandler(scan_gap_handler);
+  BLEDevice::setCustomGattcHandler(gatt_handler);
+  connLock = xSemaphoreCreateMutex();
+  chrLock = xSemaphoreCreateMutex();
+
+  mac_table();
 
-  if (getMACs() == 1) {
-    isConfigured = true;
-    pBLEScan->setActiveScan(true);
+  if (isConfigured) {
+    scanActive = true;
     Serial.println("BLE MACs found!");
   } else {
-    pBLEScan->setActiveScan(false);
+    scanActive = false;
     Serial.println("BLE MACs not found!");
   }
+
+#ifdef REGISTRY_BENCH
+  registry_bench();
+#endif
+
+  tasks_start();
 }
 
-/// @brief ESP 32 main loop
+/// @brief ESP 32 main loop (the work is done by the tasks started in
+///        setup())
 /// @return
 void loop() {
-  int i;
-
-  Portal.handleClient();
-
-  if (isConfigured) {
-    // connect to BLE server
-    for (i = 0; i < MAX_DEVICE; i++) {
-      if (myDev[i].state == D_SCANNED) {
-        Serial.printf("connecting ... [%d]\n", i);
-        connectToServer();
-      }
-    }
-    // check for JSON data to send
-    for (i = 0; i < MAX_DEVICE; i++) {
-      if (myDev[i].state == D_CONNECTED) {
-        Serial.printf("checking data ... [%d]\n", i);
-        for (int j = 0; j < MAX_POOL; j++) {
-          s_data *d = &(myDev[i].data[j]);
-          if (check_data(d)) {
-            Serial.printf("TIME [%.9e] HEAP [%lu]\n", d->tm,
-                          (unsigned long)ESP.getFreeHeap());
-            send_json(&myDev[i], d);
-            reset_data(d);
-          }
-        }
-      }
-    }
-    // start scan if we can connect a new device
-    // (after disconnect or if no device is connected)
-    int j = index_by_state(D_DISCONNECTED);
-    if (j == NO_INDEX) {
-      Serial.println("ERROR: no free index");
-    } else {
-      Serial.printf("scanning ... [%d]\n", j);
-      BLEDevice::getScan()->start(2);
-    }
-  }
-
-  // esp_task_wdt_reset();
+  vTaskDelete(NULL);
 }
@@ -0,0 +1,533 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023  <Wolfgang Kampichler>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/**
+ *  @file    pqueue.h
+ *  @author  Wolfgang Kampichler (DEC112)
+ *  @date    10-2023
+ *  @version 1.1
+ *
+ *  @brief Persistent FIFO queue on a raw NOR flash region (store-and-forward)
+ *
+ * The region is used as a ring of PQ_SECTOR_SIZE sectors which are filled
+ * one after the other with CRC framed records. A record is never rewritten;
+ * it is consumed by clearing the bits of its flags word, which NOR flash
+ * allows without an erase. A sector is only erased when the write position
+ * wraps around to it, so every sector is erased once per pass over the
+ * region. If the queue is full the oldest sector is dropped.
+ *
+ * At start-up only the first header of each sector is read to find the
+ * newest sector (highest sequence number); that sector and the sectors
+ * holding the oldest pending records are scanned record by record. A
+ * record whose CRC does not match (e.g. power loss while writing) is marked
+ * consumed and closes its sector, new records continue in the next one.
+ *
+ * The flash is accessed through pq_flash, so the same code runs against an
+ * esp_partition on the ESP32 and against a file on a host (PQ_FILE_FLASH).
+ */
+
+#ifndef PQUEUE_H
+#define PQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef PQ_STATIC
+#define PQ_API static
+#else
+#define PQ_API extern
+#endif
+
+#ifndef PQ_SECTOR_SIZE
+/** erase unit of the flash */
+#define PQ_SECTOR_SIZE 4096
+#endif /* PQ_SECTOR_SIZE */
+
+#define PQ_MAGIC 0x5150
+#define PQ_ERASED32 0xFFFFFFFFu
+#define PQ_ALIGN(n) (((n) + 3u) & ~3u)
+
+/** @brief pqueue return codes */
+typedef enum pqcode {
+    /** no error, operation was a success */
+    PQ_OK = 0,
+    /** queue holds no pending record */
+    PQ_EMPTY,
+    /** record is too large for a sector or the destination buffer */
+    PQ_ERROR_SIZE = -1,
+    /** flash access failed */
+    PQ_ERROR_FLASH = -2,
+    /** record failed the CRC check */
+    PQ_ERROR_CORRUPT = -3
+} pqcode;
+
+/** @brief flash access; offsets are relative to the start of the region */
+typedef struct pq_flash {
+    /** reads len bytes at off into dst, returns 0 on success */
+    int (*read)(void *ctx, uint32_t off, void *dst, size_t len);
+    /** programs len bytes at off (clears bits only), returns 0 on success */
+    int (*write)(void *ctx, uint32_t off, const void *src, size_t len);
+    /** erases the sector at off (sets all bits), returns 0 on success */
+    int (*erase)(void *ctx, uint32_t off);
+    /** user pointer handed to the functions above */
+    void *ctx;
+    /** region size; a multiple of PQ_SECTOR_SIZE */
+    uint32_t size;
+} pq_flash;
+
+/** @brief record header as stored on flash */
+typedef struct pq_hdr {
+    /** PQ_MAGIC; erased (0xFFFF) marks the end of a sector */
+    uint16_t magic;
+    /** payload length */
+    uint16_t len;
+    /** sequence number, increments with every record */
+    uint32_t seq;
+    /** CRC32 over len, seq and payload */
+    uint32_t crc;
+    /** PQ_ERASED32 while pending, 0 once consumed */
+    uint32_t flags;
+} pq_hdr;
+
+/** @brief largest payload a record can carry */
+#define PQ_MAX_RECORD (PQ_SECTOR_SIZE - sizeof(pq_hdr))
+
+/** @brief handle of a persistent queue */
+typedef struct pqueue {
+    /** flash the queue is stored in */
+    pq_flash flash;
+    /** number of sectors */
+    uint32_t sectors;
+    /** offset the next record is written to */
+    uint32_t head;
+    /** offset of the oldest pending record (== head if empty) */
+    uint32_t tail;
+    /** sequence number of the next record */
+    uint32_t seq;
+    /** records written since start-up */
+    uint32_t pushed;
+    /** records consumed since start-up */
+    uint32_t popped;
+    /** pending records lost because the queue was full */
+    uint32_t dropped;
+    /** sector erases since start-up */
+    uint32_t erases;
+} pqueue;
+
+/**
+ * @brief Opens a queue and recovers its state from flash
+ *
+ * @param q the handle to be initialized
+ * @param flash flash access functions and region size
+ * @return @ref pqcode value
+ */
+PQ_API pqcode pq_init(pqueue *q, const pq_flash *flash);
+
+/**
+ * @brief Appends a record
+ *
+ * @param q the handle initialized with pq_init()
+ * @param data the payload
+ * @param len the payload length (at most PQ_MAX_RECORD)
+ * @return @ref pqcode value
+ */
+PQ_API pqcode pq_push(pqueue *q, const void *data, size_t len);
+
+/**
+ * @brief Copies the oldest pending record without consuming it
+ *
+ * @param q the handle initialized with pq_init()
+ * @param dst the destination buffer
+ * @param size the destination buffer size
+ * @param len receives the payload length
+ * @return @ref pqcode value (PQ_EMPTY if nothing is pending)
+ */
+PQ_API pqcode pq_peek(pqueue *q, void *dst, size_t size, size_t *len);
+
+/**
+ * @brief Consumes the oldest pending record
+ *
+ * @param q the handle initialized with pq_init()
+ * @return @ref pqcode value (PQ_EMPTY if nothing is pending)
+ */
+PQ_API pqcode pq_pop(pqueue *q);
+
+/**
+ * @brief Checks if the queue holds pending records
+ *
+ * @param q the handle initialized with pq_init()
+ */
+#define pq_empty(q) ((q)->tail == (q)->head)
+
+#ifndef PQ_HEADER
+
+static uint32_t
+_pq_crc32(uint32_t crc, const void *data, size_t len)
+{
+    static const uint32_t tab[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ tab[crc & 0xF];
+        crc = (crc >> 4) ^ tab[crc & 0xF];
+    }
+    return ~crc;
+}
+
+static uint32_t
+_pq_record_crc(const pq_hdr *h, const void *data)
+{
+    uint32_t crc = _pq_crc32(0, &h->len, sizeof(h->len));
+    crc = _pq_crc32(crc, &h->seq, sizeof(h->seq));
+    return _pq_crc32(crc, data, h->len);
+}
+
+static uint32_t
+_pq_sector(uint32_t off)
+{
+    return off - off % PQ_SECTOR_SIZE;
+}
+
+static uint32_t
+_pq_next_sector(const pqueue *q, uint32_t off)
+{
+    off = _pq_sector(off) + PQ_SECTOR_SIZE;
+    return off >= q->flash.size ? 0 : off;
+}
+
+/* reads the header at off; returns 0 if it is erased or does not fit */
+static int
+_pq_header(pqueue *q, uint32_t off, pq_hdr *h)
+{
+    if (off % PQ_SECTOR_SIZE + sizeof(pq_hdr) > PQ_SECTOR_SIZE) return 0;
+    if (q->flash.read(q->flash.ctx, off, h, sizeof(pq_hdr)) != 0) return 0;
+    if (h->magic != PQ_MAGIC) return 0;
+    if (off % PQ_SECTOR_SIZE + sizeof(pq_hdr) + h->len > PQ_SECTOR_SIZE)
+        return 0;
+    return 1;
+}
+
+/* returns the offset behind the record at off */
+static uint32_t
+_pq_skip(const pqueue *q, const pq_hdr *h, uint32_t off)
+{
+    return (off + sizeof(pq_hdr) + PQ_ALIGN(h->len)) % q->flash.size;
+}
+
+/* moves the tail to the first pending record at or behind off */
+static void
+_pq_seek_tail(pqueue *q, uint32_t off)
+{
+    uint32_t sectors = 0;
+    pq_hdr h;
+    while (off != q->head) {
+        if (!_pq_header(q, off, &h)) {
+            if (++sectors > q->sectors) {
+                off = q->head;
+                break;
+            }
+            off = _pq_next_sector(q, off);
+            continue;
+        }
+        if (h.flags == PQ_ERASED32) break;
+        off = _pq_skip(q, &h, off);
+    }
+    q->tail = off;
+}
+
+/* erases the sector at off and moves the head there; pending records
+ * stored in that sector are dropped. empty tells if the queue holds no
+ * pending record: head and tail are equal as well when the head has
+ * reached the sector of the tail (full ring) */
+static pqcode
+_pq_open_sector(pqueue *q, uint32_t off, int empty)
+{
+    int full = !empty && _pq_sector(q->tail) == off;
+    pq_hdr h;
+
+    if (full) {
+        uint32_t t = q->tail;
+        while (_pq_sector(t) == off && _pq_header(q, t, &h)) {
+            if (h.flags == PQ_ERASED32) q->dropped++;
+            t = _pq_skip(q, &h, t);
+            if (t % PQ_SECTOR_SIZE == 0) break;
+        }
+    }
+    if (q->flash.erase(q->flash.ctx, off) != 0) return PQ_ERROR_FLASH;
+    q->erases++;
+    q->head = off;
+    if (empty)
+        q->tail = off;
+    else if (full)
+        _pq_seek_tail(q, _pq_next_sector(q, off));
+    return PQ_OK;
+}
+
+/* checks that the flash from off up to the end of its sector is erased */
+static int
+_pq_erased(pqueue *q, uint32_t off)
+{
+    uint32_t buf[16];
+    uint32_t end = _pq_sector(off) + PQ_SECTOR_SIZE, n, i;
+    for (; off < end; off += n) {
+        n = end - off < sizeof(buf) ? end - off : sizeof(buf);
+        if (q->flash.read(q->flash.ctx, off, buf, n) != 0) return 0;
+        for (i = 0; i < n / 4; ++i)
+            if (buf[i] != PQ_ERASED32) return 0;
+    }
+    return 1;
+}
+
+PQ_API pqcode
+pq_init(pqueue *q, const pq_flash *flash)
+{
+    uint32_t s, newest = 0, oldest, off;
+    int found = 0, closed = 0;
+    pq_hdr h;
+
+    memset(q, 0, sizeof(*q));
+    q->flash = *flash;
+    q->sectors = flash->size / PQ_SECTOR_SIZE;
+    if (q->sectors < 2) return PQ_ERROR_SIZE;
+    q->flash.size = q->sectors * PQ_SECTOR_SIZE;
+
+    /* the newest sector has the highest sequence number in its first
+     * record (compared with wrap-around of the 32 bit counter) */
+    for (s = 0; s < q->flash.size; s += PQ_SECTOR_SIZE) {
+        if (!_pq_header(q, s, &h)) continue;
+        if (!found || (int32_t)(h.seq - q->seq) > 0) {
+            newest = s;
+            q->seq = h.seq;
+            found = 1;
+        }
+    }
+    if (!found) return _pq_open_sector(q, 0, 1);
+
+    /* walk the newest sector to find the write position */
+    off = newest;
+    while (!closed && _pq_sector(off) == newest) {
+        uint8_t buf[64];
+        uint32_t crc, pos, n;
+        if (!_pq_header(q, off, &h)) {
+            /* end of the log, unless a write was interrupted */
+            closed = !_pq_erased(q, off);
+            break;
+        }
+        crc = _pq_crc32(0, &h.len, sizeof(h.len));
+        crc = _pq_crc32(crc, &h.seq, sizeof(h.seq));
+        for (pos = 0; pos < h.len; pos += n) {
+            n = h.len - pos < sizeof(buf) ? h.len - pos : sizeof(buf);
+            if (flash->read(flash->ctx, off + sizeof(pq_hdr) + pos, buf, n))
+                return PQ_ERROR_FLASH;
+            crc = _pq_crc32(crc, buf, n);
+        }
+        q->seq = h.seq + 1;
+        closed = crc != h.crc;
+        if (closed && h.flags == PQ_ERASED32) {
+            /* a torn record is consumed, it is never handed out */
+            uint32_t consumed = 0;
+            if (flash->write(flash->ctx, off + offsetof(pq_hdr, flags),
+                             &consumed, sizeof(consumed)))
+                return PQ_ERROR_FLASH;
+        }
+        off = _pq_skip(q, &h, off);
+        if (off % PQ_SECTOR_SIZE == 0) closed = 1;
+    }
+
+    /* the oldest sector is the first non-empty one behind the newest */
+    oldest = _pq_next_sector(q, newest);
+    while (oldest != newest && !_pq_header(q, oldest, &h))
+        oldest = _pq_next_sector(q, oldest);
+
+    if (closed) {
+        uint32_t next = _pq_next_sector(q, newest);
+        q->head = q->tail = next;
+        /* a full ring loses its oldest sector to the next write */
+        if (oldest == next) oldest = _pq_next_sector(q, next);
+        if (oldest != next) _pq_seek_tail(q, oldest);
+        return _pq_open_sector(q, next, pq_empty(q));
+    }
+    q->head = q->tail = off;
+    _pq_seek_tail(q, oldest);
+    return PQ_OK;
+}
+
+PQ_API pqcode
+pq_push(pqueue *q, const void *data, size_t len)
+{
+    pq_hdr h;
+    uint32_t off;
+    int empty;
+    pqcode ret;
+
+    if (len > PQ_MAX_RECORD) return PQ_ERROR_SIZE;
+
+    if (q->head % PQ_SECTOR_SIZE + sizeof(pq_hdr) + len > PQ_SECTOR_SIZE) {
+        ret = _pq_open_sector(q, _pq_next_sector(q, q->head), pq_empty(q));
+        if (ret != PQ_OK) return ret;
+    }
+    off = q->head;
+    empty = pq_empty(q);
+
+    h.magic = PQ_MAGIC;
+    h.len = (uint16_t)len;
+    h.seq = q->seq;
+    h.crc = _pq_record_crc(&h, data);
+    h.flags = PQ_ERASED32;
+    /* payload first, the header makes the record visible */
+    if (len && q->flash.write(q->flash.ctx, off + sizeof(pq_hdr), data, len))
+        return PQ_ERROR_FLASH;
+    if (q->flash.write(q->flash.ctx, off, &h, sizeof(pq_hdr)))
+        return PQ_ERROR_FLASH;
+
+    q->seq++;
+    q->pushed++;
+    q->head = _pq_skip(q, &h, off);
+    if (empty) q->tail = off;
+    /* the queue holds at least this record, so a tail in the next sector
+     * means a full ring */
+    if (q->head % PQ_SECTOR_SIZE == 0)
+        return _pq_open_sector(q, q->head, 0);
+    return PQ_OK;
+}
+
+PQ_API pqcode
+pq_peek(pqueue *q, void *dst, size_t size, size_t *len)
+{
+    pq_hdr h;
+    if (pq_empty(q)) return PQ_EMPTY;
+    if (!_pq_header(q, q->tail, &h)) return PQ_ERROR_CORRUPT;
+    if (h.len > size) return PQ_ERROR_SIZE;
+    if (q->flash.read(q->flash.ctx, q->tail + sizeof(pq_hdr), dst, h.len))
+        return PQ_ERROR_FLASH;
+    *len = h.len;
+    if (_pq_record_crc(&h, dst) != h.crc) return PQ_ERROR_CORRUPT;
+    return PQ_OK;
+}
+
+PQ_API pqcode
+pq_pop(pqueue *q)
+{
+    pq_hdr h;
+    uint32_t consumed = 0;
+    if (pq_empty(q)) return PQ_EMPTY;
+    if (!_pq_header(q, q->tail, &h)) {
+        /* nothing readable left in this sector */
+        _pq_seek_tail(q, _pq_next_sector(q, q->tail));
+        return PQ_OK;
+    }
+    if (q->flash.write(q->flash.ctx, q->tail + offsetof(pq_hdr, flags),
+                       &consumed, sizeof(consumed)))
+        return PQ_ERROR_FLASH;
+    q->popped++;
+    _pq_seek_tail(q, _pq_skip(q, &h, q->tail));
+    return PQ_OK;
+}
+
+#ifdef PQ_FILE_FLASH
+#include <stdio.h>
+
+/* file backed stand-in for the flash, emulating NOR program/erase rules */
+
+static int
+_pq_file_read(void *ctx, uint32_t off, void *dst, size_t len)
+{
+    FILE *f = (FILE *)ctx;
+    if (fseek(f, (long)off, SEEK_SET) != 0) return -1;
+    return fread(dst, 1, len, f) == len ? 0 : -1;
+}
+
+static int
+_pq_file_write(void *ctx, uint32_t off, const void *src, size_t len)
+{
+    FILE *f = (FILE *)ctx;
+    const uint8_t *p = (const uint8_t *)src;
+    uint8_t b;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        if (_pq_file_read(ctx, off + i, &b, 1) != 0) return -1;
+        b &= p[i];
+        if (fseek(f, (long)(off + i), SEEK_SET) != 0) return -1;
+        if (fwrite(&b, 1, 1, f) != 1) return -1;
+    }
+    return fflush(f);
+}
+
+static int
+_pq_file_erase(void *ctx, uint32_t off)
+{
+    FILE *f = (FILE *)ctx;
+    uint8_t ff[PQ_SECTOR_SIZE];
+    memset(ff, 0xFF, sizeof(ff));
+    if (fseek(f, (long)off, SEEK_SET) != 0) return -1;
+    if (fwrite(ff, 1, sizeof(ff), f) != sizeof(ff)) return -1;
+    return fflush(f);
+}
+
+/**
+ * @brief Opens (or creates as erased) a file of size bytes as flash
+ *
+ * @param flash receives the access functions
+ * @param path the backing file
+ * @param size the region size; a multiple of PQ_SECTOR_SIZE
+ * @return int (0 on success)
+ */
+static int
+pq_file_flash(pq_flash *flash, const char *path, uint32_t size)
+{
+    FILE *f = fopen(path, "r+b");
+    uint32_t off;
+    if (f == NULL) {
+        if ((f = fopen(path, "w+b")) == NULL) return -1;
+        for (off = 0; off < size; off += PQ_SECTOR_SIZE)
+            if (_pq_file_erase(f, off) != 0) return -1;
+    }
+    flash->read = _pq_file_read;
+    flash->write = _pq_file_write;
+    flash->erase = _pq_file_erase;
+    flash->ctx = f;
+    flash->size = size;
+    return 0;
+}
+#endif /* PQ_FILE_FLASH */
+
+#endif /* PQ_HEADER */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PQUEUE_H */
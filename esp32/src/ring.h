@@ -0,0 +1,90 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023  <Wolfgang Kampichler>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/**
+ *  @file    ring.h
+ *  @author  Wolfgang Kampichler (DEC112)
+ *  @date    10-2023
+ *  @version 1.1
+ *
+ *  @brief Lock-free single-producer/single-consumer ring buffer
+ *
+ * RING_DEFINE(name, type, size) defines the ring type `name` holding up to
+ * `size` elements of `type` (`size` must be a power of two) and the
+ * functions name_push(), name_pop() and name_depth(). Exactly one task may
+ * push and exactly one task may pop; head and tail are only written by
+ * their owner and published with release/acquire ordering, so neither side
+ * ever blocks or takes a lock. A push into a full ring fails and is counted
+ * in `drops`; `peak` keeps the highest depth seen by the producer.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+
+#define RING_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RING_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#define RING_DEFINE(name, type, size)                                         \
+    typedef struct name {                                                     \
+        type buf[size];                                                       \
+        uint32_t head; /* written by the producer */                          \
+        uint32_t tail; /* written by the consumer */                          \
+        uint32_t drops;                                                       \
+        uint32_t peak;                                                        \
+    } name;                                                                   \
+                                                                              \
+    typedef char name##_size_check[((size) & ((size) - 1)) == 0 ? 1 : -1];    \
+                                                                              \
+    static inline int name##_push(name *r, const type *e)                     \
+    {                                                                         \
+        uint32_t head = r->head;                                              \
+        uint32_t depth = head - RING_LOAD(&r->tail);                          \
+        if (depth >= (size)) {                                                \
+            r->drops++;                                                       \
+            return 0;                                                         \
+        }                                                                     \
+        r->buf[head & ((size) - 1)] = *e;                                     \
+        RING_STORE(&r->head, head + 1);                                       \
+        if (depth + 1 > r->peak) r->peak = depth + 1;                         \
+        return 1;                                                             \
+    }                                                                         \
+                                                                              \
+    static inline int name##_pop(name *r, type *e)                            \
+    {                                                                         \
+        uint32_t tail = r->tail;                                              \
+        if (tail == RING_LOAD(&r->head)) return 0;                            \
+        *e = r->buf[tail & ((size) - 1)];                                     \
+        RING_STORE(&r->tail, tail + 1);                                       \
+        return 1;                                                             \
+    }                                                                         \
+                                                                              \
+    static inline uint32_t name##_depth(name *r)                              \
+    {                                                                         \
+        return RING_LOAD(&r->head) - RING_LOAD(&r->tail);                     \
+    }
+
+#endif /* RING_H */
@@ -0,0 +1,275 @@
+/*
+ * MIT License
+ *
+ * Copyright (C) 2023  <Wolfgang Kampichler>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/**
+ *  @file    senml.h
+ *  @author  Wolfgang Kampichler (DEC112)
+ *  @date    10-2023
+ *  @version 1.0
+ *
+ *  @brief SenML JSON records of a dataset from pre-rendered fragments
+ *
+ * The records of a dataset always have the same structure; only the time,
+ * the sensor values and the device (base name, id) differ. The device part
+ * is rendered once per device with jsonb (senml_tpl_build()):
+ *
+ *   head   {"bn":"urn:dev:mac:<mac>:","bt":
+ *   id     {"n":"id","vs":"<id>"}
+ *
+ * and the location records once for all devices (senml_loc_build()):
+ *
+ *   loc    {"n":"lat","u":"lat","v":<lat>},{"n":"lon","u":"lon","v":<lon>}
+ *
+ * senml_dataset() writes these fragments and the constant ones below to a
+ * jsonb sink and only formats the time and the sensor values (integer to
+ * text). The output is the same, byte for byte, as the one of the jsonb
+ * builder calls it replaces.
+ *
+ * The header depends on json.h and the C library only.
+ */
+
+#ifndef SENML_H
+#define SENML_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+
+/* sensors of a dataset (same bits as the dataset mask of the gateway) */
+#define SENML_BAT 0x01
+#define SENML_TEMP 0x02
+#define SENML_MOV 0x04
+#define SENML_BTN 0x08
+
+#define SENML_LOC_SIZE 128
+
+/* labels of SenML-CBOR (RFC 8428, section 6) */
+#define SENML_CBOR_BN -2
+#define SENML_CBOR_BT -3
+#define SENML_CBOR_N 0
+#define SENML_CBOR_U 1
+#define SENML_CBOR_V 2
+#define SENML_CBOR_VS 3
+#define SENML_CBOR_VB 4
+#define SENML_CBOR_T 6
+
+/** @brief pre-rendered records of a device */
+typedef struct senml_tpl {
+    char *buf; /* head followed by the id record (NULL if not built) */
+    uint16_t head;
+    uint16_t len;
+} senml_tpl;
+
+/** @brief values of a dataset */
+typedef struct senml_values {
+    int64_t tm; /* time [ms] */
+    int64_t t;  /* time relative to the first dataset of the device [ms] */
+    uint8_t mask;
+    uint8_t bat;
+    int16_t temp;
+    uint8_t mov;
+    uint8_t btn;
+} senml_values;
+
+/**
+ * @brief frees the fragments of a device; they are built again on the next
+ *        senml_tpl_build()
+ */
+static inline void senml_tpl_free(senml_tpl *t)
+{
+    free(t->buf);
+    t->buf = NULL;
+    t->head = 0;
+    t->len = 0;
+}
+
+/**
+ * @brief renders the fragments of a device with base name urn and id
+ * @return int (0 on success; -1 if out of memory or the id is too long)
+ */
+static inline int senml_tpl_build(senml_tpl *t, const char *urn,
+                                  const char *id)
+{
+    /* id: at most 63 bytes, 6 bytes each if all had to be escaped */
+    char tmp[64 + 6 * 64];
+    size_t head;
+    jsonb b;
+    int err = 0;
+
+    senml_tpl_free(t);
+    jsonb_init(&b);
+    err |= jsonb_object(&b, tmp, sizeof(tmp));
+    err |= jsonb_key_trusted(&b, tmp, sizeof(tmp), "bn", 2);
+    err |= jsonb_string(&b, tmp, sizeof(tmp), urn, strlen(urn));
+    err |= jsonb_key_trusted(&b, tmp, sizeof(tmp), "bt", 2);
+    head = b.pos;
+    jsonb_init(&b);
+    b.pos = head;
+    err |= jsonb_object(&b, tmp, sizeof(tmp));
+    err |= jsonb_key_trusted(&b, tmp, sizeof(tmp), "n", 1);
+    err |= jsonb_string_trusted(&b, tmp, sizeof(tmp), "id", 2);
+    err |= jsonb_key_trusted(&b, tmp, sizeof(tmp), "vs", 2);
+    err |= jsonb_string(&b, tmp, sizeof(tmp), id, strlen(id));
+    err |= jsonb_object_pop(&b, tmp, sizeof(tmp));
+    if (err < 0 || (t->buf = (char *)malloc(b.pos)) == NULL) {
+        return -1;
+    }
+    memcpy(t->buf, tmp, b.pos);
+    t->head = (uint16_t)head;
+    t->len = (uint16_t)b.pos;
+    return 0;
+}
+
+/**
+ * @brief renders the location records into buf (SENML_LOC_SIZE bytes)
+ * @return int (length of the records; -1 on error)
+ */
+static inline int senml_loc_build(char *buf, double lat, double lon)
+{
+    const double v[2] = {lat, lon};
+    const char *n[2] = {"lat", "lon"};
+    jsonb b;
+    int err = 0;
+
+    jsonb_init(&b);
+    err |= jsonb_array(&b, buf, SENML_LOC_SIZE);
+    for (int i = 0; i < 2; i++) {
+        err |= jsonb_object(&b, buf, SENML_LOC_SIZE);
+        err |= jsonb_key_trusted(&b, buf, SENML_LOC_SIZE, "n", 1);
+        err |= jsonb_string_trusted(&b, buf, SENML_LOC_SIZE, n[i], 3);
+        err |= jsonb_key_trusted(&b, buf, SENML_LOC_SIZE, "u", 1);
+        err |= jsonb_string_trusted(&b, buf, SENML_LOC_SIZE, n[i], 3);
+        err |= jsonb_key_trusted(&b, buf, SENML_LOC_SIZE, "v", 1);
+        err |= jsonb_number(&b, buf, SENML_LOC_SIZE, v[i]);
+        err |= jsonb_object_pop(&b, buf, SENML_LOC_SIZE);
+    }
+    err |= jsonb_array_pop(&b, buf, SENML_LOC_SIZE);
+    if (err < 0) {
+        return -1;
+    }
+    /* without the array brackets */
+    memmove(buf, buf + 1, b.pos - 2);
+    return (int)b.pos - 2;
+}
+
+/* writes a string literal */
+#define SENML_PUT(s, lit) jsonb_sink_put((s), "" lit "", sizeof(lit) - 1)
+
+/* writes a number as jsonb_number() / a time in ms as jsonb_fixed(.., 3) */
+static inline int senml_put_int(jsonb_sink *s, int v)
+{
+    char token[JSONB_NUMBER_SIZE];
+    return jsonb_sink_put(s, token, jsonb_format_number(token, v));
+}
+
+static inline int senml_put_ms(jsonb_sink *s, int64_t ms)
+{
+    char token[JSONB_NUMBER_SIZE];
+    return jsonb_sink_put(s, token, jsonb_format_fixed(token, ms, 3));
+}
+
+/* writes the relative time of a record (if not 0) and the value key */
+static inline int senml_put_t(jsonb_sink *s, int64_t t, int vb)
+{
+    int err = 0;
+
+    if (t != 0) {
+        err |= SENML_PUT(s, ",\"t\":");
+        err |= senml_put_ms(s, t);
+    }
+    err |= vb ? SENML_PUT(s, ",\"vb\":") : SENML_PUT(s, ",\"v\":");
+    return err;
+}
+
+/**
+ * @brief writes the records of a dataset to a sink; the first dataset of a
+ *        device carries the device records (t is ignored), the following
+ *        ones the sensor records with their relative time. comma: records
+ *        precede the dataset in the pack
+ * @return int (negative on error)
+ */
+static inline int senml_dataset(jsonb_sink *s, const senml_tpl *tpl,
+                                const char *loc, size_t loclen,
+                                const senml_values *d, int first, int comma)
+{
+    int64_t t = first ? 0 : d->t;
+    int err = 0;
+
+    if (first) {
+        if (comma) {
+            err |= SENML_PUT(s, ",");
+        }
+        err |= jsonb_sink_put(s, tpl->buf, tpl->head);
+        err |= senml_put_ms(s, d->tm);
+        if (d->mask & SENML_BAT) {
+            err |= SENML_PUT(s, ",\"n\":\"batt\",\"u\":\"%EL\",\"v\":");
+            err |= senml_put_int(s, d->bat);
+            err |= SENML_PUT(s, "},");
+            err |= jsonb_sink_put(s, tpl->buf + tpl->head,
+                                  tpl->len - tpl->head);
+        } else {
+            /* the id record without its '{' */
+            err |= SENML_PUT(s, ",");
+            err |= jsonb_sink_put(s, tpl->buf + tpl->head + 1,
+                                  tpl->len - tpl->head - 1);
+        }
+        err |= SENML_PUT(s, ",");
+        err |= jsonb_sink_put(s, loc, loclen);
+        comma = 1;
+    } else if (d->mask & SENML_BAT) {
+        err |= comma ? SENML_PUT(s, ",{\"n\":\"batt\",\"u\":\"%EL\"")
+                     : SENML_PUT(s, "{\"n\":\"batt\",\"u\":\"%EL\"");
+        err |= senml_put_t(s, t, 0);
+        err |= senml_put_int(s, d->bat);
+        err |= SENML_PUT(s, "}");
+        comma = 1;
+    }
+    if (d->mask & SENML_TEMP) {
+        err |= comma ? SENML_PUT(s, ",{\"n\":\"temp\",\"u\":\"Cel\"")
+                     : SENML_PUT(s, "{\"n\":\"temp\",\"u\":\"Cel\"");
+        err |= senml_put_t(s, t, 0);
+        err |= senml_put_int(s, d->temp);
+        err |= SENML_PUT(s, "}");
+        comma = 1;
+    }
+    if (d->mask & SENML_MOV) {
+        err |= comma ? SENML_PUT(s, ",{\"n\":\"move\"")
+                     : SENML_PUT(s, "{\"n\":\"move\"");
+        err |= senml_put_t(s, t, 1);
+        err |= d->mov ? SENML_PUT(s, "true}") : SENML_PUT(s, "false}");
+        comma = 1;
+    }
+    if (d->mask & SENML_BTN) {
+        err |= comma ? SENML_PUT(s, ",{\"n\":\"button\"")
+                     : SENML_PUT(s, "{\"n\":\"button\"");
+        err |= senml_put_t(s, t, 1);
+        err |= d->btn ? SENML_PUT(s, "true}") : SENML_PUT(s, "false}");
+    }
+    return err;
+}
+
+#endif /* SENML_H */
@@ -0,0 +1,240 @@
+/*
+ * host tests of adv.h: sensor frames are decoded from advertising data laid
+ * out as the puck script advertises them (Espruino NRF.setAdvertising()
+ * with manufacturer 0x0590, flags and name) and as service data, and
+ * deduplicated by their sequence number
+ *
+ *   pio test -e native -f test_adv
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "adv.h"
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+// advertisement of the puck script: flags, complete local name
+// "Puck.js 3c1a", manufacturer data of Espruino (0x0590) holding frame
+// version 1, seq 0x2a, battery 87%, 23 Cel, movement, 5 presses
+static const uint8_t advPuck[] = {
+    0x02, 0x01, 0x06,                                           // flags
+    0x0d, 0x09, 'P', 'u', 'c', 'k', '.', 'j', 's', ' ', '3', 'c', '1',
+    'a',                                                        // name
+    0x09, 0xff, 0x90, 0x05, 0x01, 0x2a, 0x57, 0x17, 0x01, 0x05  // frame
+};
+
+// the same frame as service data of Environmental Sensing (0x181A), with
+// the button value set and a temperature below zero (-7 Cel)
+static const uint8_t advService[] = {
+    0x02, 0x01, 0x06,                                           // flags
+    0x03, 0x03, 0x1a, 0x18,                                     // UUIDs
+    0x09, 0x16, 0x1a, 0x18, 0x01, 0x07, 0x64, 0xf9, 0x02, 0xff  // frame
+};
+
+// advertising data as the scan reports it: advertisement (flags and the
+// 128-bit service UUID) followed by the scan response (name and frame)
+static const uint8_t advScanRsp[] = {
+    0x02, 0x01, 0x06,                                           // flags
+    0x11, 0x07, 0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0,
+    0x93, 0xf3, 0xa3, 0xb5, 0x01, 0x00, 0x40, 0x6e,             // UUID
+    // scan response
+    0x0d, 0x09, 'P', 'u', 'c', 'k', '.', 'j', 's', ' ', '3', 'c', '1',
+    'a',                                                        // name
+    0x09, 0xff, 0x90, 0x05, 0x01, 0x00, 0x32, 0x15, 0x00, 0x00  // frame
+};
+
+static void test_manufacturer(void) {
+  adv_frame f;
+
+  TEST_ASSERT_EQUAL_INT(1, adv_decode(advPuck, sizeof(advPuck), &f));
+  TEST_ASSERT_EQUAL_INT(1, f.version);
+  TEST_ASSERT_EQUAL_INT(0x2a, f.seq);
+  TEST_ASSERT_EQUAL_INT(87, f.bat);
+  TEST_ASSERT_EQUAL_INT(23, f.temp);
+  TEST_ASSERT_EQUAL_INT(1, f.mov);
+  TEST_ASSERT_EQUAL_INT(0, f.btn);
+  TEST_ASSERT_EQUAL_INT(5, f.presses);
+  return;
+}
+
+static void test_service_data(void) {
+  adv_frame f;
+
+  TEST_ASSERT_EQUAL_INT(1, adv_decode(advService, sizeof(advService), &f));
+  TEST_ASSERT_EQUAL_INT(7, f.seq);
+  TEST_ASSERT_EQUAL_INT(100, f.bat);
+  TEST_ASSERT_EQUAL_INT(-7, f.temp);
+  TEST_ASSERT_EQUAL_INT(0, f.mov);
+  TEST_ASSERT_EQUAL_INT(1, f.btn);
+  TEST_ASSERT_EQUAL_INT(255, f.presses);
+  return;
+}
+
+static void test_scan_response(void) {
+  adv_frame f;
+
+  TEST_ASSERT_EQUAL_INT(1, adv_decode(advScanRsp, sizeof(advScanRsp), &f));
+  TEST_ASSERT_EQUAL_INT(0, f.seq);
+  TEST_ASSERT_EQUAL_INT(50, f.bat);
+  TEST_ASSERT_EQUAL_INT(21, f.temp);
+  // the advertisement alone holds no frame
+  TEST_ASSERT_EQUAL_INT(0, adv_decode(advScanRsp, 21, &f));
+  return;
+}
+
+static void test_other_data(void) {
+  // manufacturer data of another company and service data of another
+  // service come first; the frame behind them is found
+  static const uint8_t adv[] = {
+      0x02, 0x01, 0x06,
+      0x09, 0xff, 0x4c, 0x00, 0x01, 0x2a, 0x57, 0x17, 0x01, 0x05,
+      0x09, 0x16, 0x0f, 0x18, 0x01, 0x2a, 0x57, 0x17, 0x01, 0x05,
+      0x09, 0xff, 0x90, 0x05, 0x01, 0x2b, 0x57, 0x17, 0x01, 0x05};
+  adv_frame f;
+
+  TEST_ASSERT_EQUAL_INT(1, adv_decode(adv, sizeof(adv), &f));
+  TEST_ASSERT_EQUAL_INT(0x2b, f.seq);
+  TEST_ASSERT_EQUAL_INT(0, adv_decode(adv, 23, &f));
+  return;
+}
+
+static void test_malformed(void) {
+  uint8_t adv[sizeof(advPuck)];
+  adv_frame f;
+
+  // the frame cut off by the end of the data
+  TEST_ASSERT_EQUAL_INT(0, adv_decode(advPuck, sizeof(advPuck) - 1, &f));
+  // an AD length running past the end of the data ends the search
+  memcpy(adv, advPuck, sizeof(adv));
+  adv[3] = 0x1e;
+  TEST_ASSERT_EQUAL_INT(0, adv_decode(adv, sizeof(adv), &f));
+  // a frame shorter than ADV_FRAME_SIZE (AD length one too short)
+  memcpy(adv, advPuck, sizeof(adv));
+  adv[17] = 0x08;
+  TEST_ASSERT_EQUAL_INT(0, adv_decode(adv, sizeof(adv), &f));
+  // a zero length ends the data
+  memcpy(adv, advPuck, sizeof(adv));
+  adv[3] = 0x00;
+  TEST_ASSERT_EQUAL_INT(0, adv_decode(adv, sizeof(adv), &f));
+  // AD structures too short for a company id
+  static const uint8_t shortAd[] = {0x02, 0xff, 0x90, 0x01, 0x16};
+  TEST_ASSERT_EQUAL_INT(0, adv_decode(shortAd, sizeof(shortAd), &f));
+  TEST_ASSERT_EQUAL_INT(0, adv_decode(advPuck, 0, &f));
+  return;
+}
+
+static void test_versions(void) {
+  uint8_t adv[sizeof(advPuck) + 2];
+  adv_frame f;
+
+  // an unknown version is not decoded
+  memcpy(adv, advPuck, sizeof(advPuck));
+  adv[21] = 2;
+  TEST_ASSERT_EQUAL_INT(0, adv_decode(adv, sizeof(advPuck), &f));
+  // bytes appended to a frame of version 1 are ignored
+  memcpy(adv, advPuck, sizeof(advPuck));
+  adv[17] += 2;
+  adv[sizeof(advPuck)] = 0xaa;
+  adv[sizeof(advPuck) + 1] = 0x55;
+  TEST_ASSERT_EQUAL_INT(1, adv_decode(adv, sizeof(adv), &f));
+  TEST_ASSERT_EQUAL_INT(0x2a, f.seq);
+  TEST_ASSERT_EQUAL_INT(5, f.presses);
+  return;
+}
+
+/// @brief a frame with sequence number seq and press counter presses
+/// @return adv_frame
+static adv_frame frame(uint8_t seq, uint8_t presses) {
+  adv_frame f;
+
+  memset(&f, 0, sizeof(f));
+  f.version = ADV_FRAME_VERSION;
+  f.seq = seq;
+  f.presses = presses;
+  return f;
+}
+
+static int accept(adv_seen *s, uint8_t seq, uint8_t count, int *presses) {
+  adv_frame f = frame(seq, count);
+
+  return adv_accept(s, &f, presses);
+}
+
+static void test_repeated(void) {
+  adv_seen s;
+  int presses = -1;
+
+  memset(&s, 0, sizeof(s));
+  // the first frame of a sensor counts no presses
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 10, 5, &presses));
+  TEST_ASSERT_EQUAL_INT(0, presses);
+  // the advertisement is repeated until the next reading
+  for (int i = 0; i < 3; i++) {
+    TEST_ASSERT_EQUAL_INT(0, accept(&s, 10, 5, &presses));
+    TEST_ASSERT_EQUAL_INT(0, presses);
+  }
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 11, 6, &presses));
+  TEST_ASSERT_EQUAL_INT(1, presses);
+  // readings missed by the scan: two presses in three readings
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 14, 8, &presses));
+  TEST_ASSERT_EQUAL_INT(2, presses);
+  // a reading without a press
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 15, 8, &presses));
+  TEST_ASSERT_EQUAL_INT(0, presses);
+  return;
+}
+
+static void test_wrap(void) {
+  adv_seen s;
+  int presses = -1;
+
+  memset(&s, 0, sizeof(s));
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 250, 254, &presses));
+  // sequence number and press counter wrap around
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 2, 1, &presses));
+  TEST_ASSERT_EQUAL_INT(3, presses);
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 3, 2, &presses));
+  TEST_ASSERT_EQUAL_INT(1, presses);
+  // sequence number 0 after 255 is the next reading
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 255, 2, &presses));
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 0, 3, &presses));
+  TEST_ASSERT_EQUAL_INT(1, presses);
+  return;
+}
+
+static void test_restart(void) {
+  adv_seen s;
+  int presses = -1;
+
+  memset(&s, 0, sizeof(s));
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 120, 40, &presses));
+  // the puck restarts: sequence number and press counter begin at 0
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 0, 0, &presses));
+  TEST_ASSERT_EQUAL_INT(0, presses);
+  TEST_ASSERT_EQUAL_INT(0, accept(&s, 0, 0, &presses));
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 1, 1, &presses));
+  TEST_ASSERT_EQUAL_INT(1, presses);
+  // a restart seen only after a press
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 90, 60, &presses));
+  TEST_ASSERT_EQUAL_INT(1, accept(&s, 2, 1, &presses));
+  TEST_ASSERT_EQUAL_INT(1, presses);
+  return;
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_manufacturer);
+  RUN_TEST(test_service_data);
+  RUN_TEST(test_scan_response);
+  RUN_TEST(test_other_data);
+  RUN_TEST(test_malformed);
+  RUN_TEST(test_versions);
+  RUN_TEST(test_repeated);
+  RUN_TEST(test_wrap);
+  RUN_TEST(test_restart);
+  return UNITY_END();
+}
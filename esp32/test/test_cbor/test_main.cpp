@@ -0,0 +1,434 @@
+/*
+ * host tests of cbor.h: items written by the builder (cborb_*(), cborbs_*())
+ * are decoded again with cbord_next() and compared with what was written
+ *
+ *   pio test -e native -f test_cbor
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+#include "json.h"
+#include "cbor.h"
+#include "senml.h"
+
+#define PACK_SIZE 3072
+#define WINDOW_SIZE 16
+
+static char buf[PACK_SIZE];
+static char text[PACK_SIZE];
+
+// output of a sink (write callback)
+typedef struct s_out {
+  char data[PACK_SIZE];
+  size_t len;
+} s_out;
+
+static s_out out;
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+/// @brief collects the output of a sink
+/// @return size_t (bytes taken)
+static size_t collect(void *ctx, const char data[], size_t len) {
+  s_out *o = (s_out *)ctx;
+
+  if (o->len + len > sizeof(o->data)) {
+    return 0;
+  }
+  memcpy(o->data + o->len, data, len);
+  o->len += len;
+  return len;
+}
+
+/// @brief appends the text of a decoded item (and of the items of a
+///        container) to t: integers and labels as decimals, floats in their
+///        shortest form, strings quoted, maps as {k:v,..}, arrays as [..]
+/// @return int (0; -1 if the input is malformed or truncated)
+static int trace(cbord *r, char *t, size_t size, size_t *pos) {
+  char token[JSONB_NUMBER_SIZE];
+  cbord_item it;
+  long n;
+
+  if (cbord_next(r, &it) != 1) {
+    return -1;
+  }
+  switch (it.major) {
+  case CBOR_UINT:
+    n = snprintf(t + *pos, size - *pos, "%lld", (long long)it.i);
+    break;
+  case CBOR_TEXT:
+    n = snprintf(t + *pos, size - *pos, "\"%.*s\"", (int)it.len, it.str);
+    break;
+  case CBOR_ARRAY:
+  case CBOR_MAP: {
+    bool map = it.major == CBOR_MAP;
+    int64_t items = map ? 2 * it.i : it.i;
+
+    n = snprintf(t + *pos, size - *pos, "%c", map ? '{' : '[');
+    *pos += (size_t)n;
+    for (int64_t k = 0; items < 0 || k < items; k++) {
+      if (items < 0) {
+        // indefinite: items up to the break
+        cbord peek = *r;
+        cbord_item brk;
+        if (cbord_next(&peek, &brk) != 1) {
+          return -1;
+        }
+        if (brk.major == CBOR_SIMPLE && brk.simple == CBOR_BREAK) {
+          *r = peek;
+          break;
+        }
+      }
+      if (k > 0) {
+        *pos += (size_t)snprintf(t + *pos, size - *pos, "%c",
+                                 (map && (k & 1)) ? ':' : ',');
+      }
+      if (trace(r, t, size, pos) < 0) {
+        return -1;
+      }
+    }
+    n = snprintf(t + *pos, size - *pos, "%c", map ? '}' : ']');
+    break;
+  }
+  case CBOR_SIMPLE:
+    if (it.simple == CBOR_TRUE || it.simple == CBOR_FALSE) {
+      n = snprintf(t + *pos, size - *pos, "%s",
+                   (it.simple == CBOR_TRUE) ? "true" : "false");
+    } else if (it.simple == CBOR_NULL) {
+      n = snprintf(t + *pos, size - *pos, "null");
+    } else if (isnan(it.d) || isinf(it.d)) {
+      n = snprintf(t + *pos, size - *pos, "%s",
+                   isnan(it.d) ? "nan" : (it.d < 0) ? "-inf" : "inf");
+    } else if (it.simple != CBOR_BREAK) {
+      n = jsonb_format_number(token, it.d);
+      n = snprintf(t + *pos, size - *pos, "%.*s~", (int)n, token);
+    } else {
+      return -1;
+    }
+    break;
+  default:
+    return -1;
+  }
+  *pos += (size_t)n;
+  return 0;
+}
+
+/// @brief decodes len bytes of p into the text t (one top level item)
+/// @return int (0; -1 if the input is malformed, truncated or longer)
+static int decode(const void *p, size_t len, char *t, size_t size) {
+  cbord r;
+  size_t pos = 0;
+
+  t[0] = '\0';
+  cbord_init(&r, p, len);
+  if (trace(&r, t, size, &pos) < 0 || r.pos != len) {
+    return -1;
+  }
+  return 0;
+}
+
+void test_integers(void) {
+  const int64_t v[] = {0,          1,          23,         24,
+                       255,        256,        65535,      65536,
+                       4294967295, 4294967296, INT64_MAX,  -1,
+                       -24,        -25,        -256,       -257,
+                       -65537,     INT64_MIN,  SENML_CBOR_BN};
+  const size_t len[] = {1, 1, 1, 2, 2, 3, 3, 5, 5, 9, 9, 1, 1, 2, 2, 3, 5, 9, 1};
+
+  for (size_t k = 0; k < sizeof(v) / sizeof(v[0]); k++) {
+    cbord r;
+    cbord_item it;
+    cborb b;
+
+    cborb_init(&b);
+    TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_int(&b, buf, sizeof(buf), v[k]));
+    TEST_ASSERT_EQUAL_INT(len[k], b.pos);
+    cbord_init(&r, buf, b.pos);
+    TEST_ASSERT_EQUAL_INT(1, cbord_next(&r, &it));
+    TEST_ASSERT_EQUAL_INT(CBOR_UINT, it.major);
+    TEST_ASSERT_TRUE(it.i == v[k]);
+    TEST_ASSERT_EQUAL_INT(0, cbord_next(&r, &it));
+  }
+  return;
+}
+
+void test_numbers(void) {
+  const double v[] = {0.0,     -0.0,     1.0,       -1.0,   0.5,
+                      -2.25,   0.1,      48.2082,   -16.3738,
+                      1700000000.007,    1e21,      -1e21,  1e300,
+                      5e-324,  FLT_MAX,  -FLT_MAX,  FLT_MIN,
+                      3.4028235677973366e38,        9223372036854775808.0,
+                      -9223372036854775808.0,       INFINITY, -INFINITY};
+
+  for (size_t k = 0; k < sizeof(v) / sizeof(v[0]); k++) {
+    cbord r;
+    cbord_item it;
+    cborb b;
+
+    cborb_init(&b);
+    TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_number(&b, buf, sizeof(buf), v[k]));
+    cbord_init(&r, buf, b.pos);
+    TEST_ASSERT_EQUAL_INT(1, cbord_next(&r, &it));
+    if (it.major == CBOR_UINT) {
+      // integral values are written as integers (-0 as 0)
+      TEST_ASSERT_TRUE(v[k] == (double)it.i);
+      TEST_ASSERT_TRUE(b.pos <= 9);
+    } else {
+      TEST_ASSERT_EQUAL_INT(CBOR_SIMPLE, it.major);
+      TEST_ASSERT_TRUE(v[k] == it.d);
+      // the shortest float that holds the value
+      bool single = (double)(float)v[k] == v[k];
+      TEST_ASSERT_EQUAL_HEX8(single ? CBOR_FLOAT32 : CBOR_FLOAT64, it.simple);
+      TEST_ASSERT_EQUAL_INT(single ? 5 : 9, b.pos);
+    }
+    TEST_ASSERT_EQUAL_INT(0, cbord_next(&r, &it));
+  }
+  // NaN
+  cborb b;
+  cbord r;
+  cbord_item it;
+  cborb_init(&b);
+  TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_number(&b, buf, sizeof(buf), NAN));
+  cbord_init(&r, buf, b.pos);
+  TEST_ASSERT_EQUAL_INT(1, cbord_next(&r, &it));
+  TEST_ASSERT_TRUE(isnan(it.d));
+  return;
+}
+
+void test_half_floats(void) {
+  // not written by the builder, decoded for other encoders
+  const uint8_t h[][3] = {{0xf9, 0x3c, 0x00}, {0xf9, 0xc0, 0x00},
+                          {0xf9, 0x7b, 0xff}, {0xf9, 0x00, 0x01},
+                          {0xf9, 0x80, 0x00}, {0xf9, 0x7c, 0x00}};
+  const double v[] = {1.0, -2.0, 65504.0, 5.960464477539063e-8, -0.0,
+                      INFINITY};
+
+  for (size_t k = 0; k < sizeof(v) / sizeof(v[0]); k++) {
+    cbord r;
+    cbord_item it;
+
+    cbord_init(&r, h[k], 3);
+    TEST_ASSERT_EQUAL_INT(1, cbord_next(&r, &it));
+    TEST_ASSERT_EQUAL_HEX8(CBOR_FLOAT16, it.simple);
+    TEST_ASSERT_TRUE(v[k] == it.d);
+  }
+  return;
+}
+
+void test_strings(void) {
+  const size_t len[] = {0, 1, 23, 24, 255, 256, 1000};
+
+  for (size_t k = 0; k < sizeof(len) / sizeof(len[0]); k++) {
+    char str[1000];
+    cbord r;
+    cbord_item it;
+    cborb b;
+
+    for (size_t i = 0; i < len[k]; i++) {
+      str[i] = (char)(' ' + (i * 7) % 95);
+    }
+    cborb_init(&b);
+    TEST_ASSERT_EQUAL_INT(JSONB_OK,
+                          cborb_string(&b, buf, sizeof(buf), str, len[k]));
+    cbord_init(&r, buf, b.pos);
+    TEST_ASSERT_EQUAL_INT(1, cbord_next(&r, &it));
+    TEST_ASSERT_EQUAL_INT(CBOR_TEXT, it.major);
+    TEST_ASSERT_EQUAL_INT(len[k], it.len);
+    TEST_ASSERT_EQUAL_MEMORY(str, it.str, len[k]);
+    TEST_ASSERT_EQUAL_INT(b.pos, r.pos);
+  }
+  return;
+}
+
+void test_containers(void) {
+  cborb b;
+
+  cborb_init(&b);
+  TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_array(&b, buf, sizeof(buf), 3));
+  TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_bool(&b, buf, sizeof(buf), 1));
+  TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_null(&b, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_INT(JSONB_OK,
+                        cborb_map(&b, buf, sizeof(buf), CBORB_INDEFINITE));
+  TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_int(&b, buf, sizeof(buf), -3));
+  TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_bool(&b, buf, sizeof(buf), 0));
+  TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_pop(&b, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_pop(&b, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_INT(0, decode(buf, b.pos, text, sizeof(text)));
+  TEST_ASSERT_EQUAL_STRING("[true,null,{-3:false}]", text);
+
+  // a definite container takes as many items as announced
+  cborb_init(&b);
+  TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_map(&b, buf, sizeof(buf), 1));
+  TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_int(&b, buf, sizeof(buf), 0));
+  TEST_ASSERT_EQUAL_INT(JSONB_ERROR_INPUT, cborb_pop(&b, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_int(&b, buf, sizeof(buf), 1));
+  TEST_ASSERT_EQUAL_INT(JSONB_ERROR_INPUT,
+                        cborb_int(&b, buf, sizeof(buf), 2));
+  TEST_ASSERT_EQUAL_INT(JSONB_OK, cborb_pop(&b, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_INT(JSONB_ERROR_STACK, cborb_pop(&b, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_INT(0, decode(buf, b.pos, text, sizeof(text)));
+  TEST_ASSERT_EQUAL_STRING("{0:1}", text);
+
+  // an item which does not fit leaves the builder unchanged
+  cborb_init(&b);
+  TEST_ASSERT_EQUAL_INT(JSONB_ERROR_NOMEM,
+                        cborb_string(&b, buf, 4, "abcd", 4));
+  TEST_ASSERT_EQUAL_INT(0, b.pos);
+  return;
+}
+
+/// @brief writes a sensor record as the gateway does (cbor_record())
+/// @return int (negative on error)
+static int record(cborb_sink *c, const char *name, const char *unit,
+                  int64_t t, int label) {
+  int err = 0;
+
+  err |= cborbs_map(c, 2 + (unit != NULL) + (t != 0));
+  err |= cborbs_int(c, SENML_CBOR_N);
+  err |= cborbs_string(c, name, strlen(name));
+  if (unit != NULL) {
+    err |= cborbs_int(c, SENML_CBOR_U);
+    err |= cborbs_string(c, unit, strlen(unit));
+  }
+  if (t != 0) {
+    err |= cborbs_int(c, SENML_CBOR_T);
+    err |= cborbs_number(c, (double)t / 1000);
+  }
+  err |= cborbs_int(c, label);
+  return err;
+}
+
+/// @brief writes a pack of two datasets of a device as the gateway does
+///        (cbor_dataset()) through a sink with a small window
+/// @return int (length of the pack; negative on error)
+static int pack(const senml_values *d, const char *id) {
+  const char *urn = "urn:dev:mac:c82b96ffffa10f3e:";
+  char window[WINDOW_SIZE];
+  jsonb_sink s;
+  cborb_sink c;
+  int err = 0;
+
+  out.len = 0;
+  jsonb_sink_init(&s, window, sizeof(window), collect, &out);
+  cborb_sink_init(&c, &s);
+  err |= cborbs_array(&c, CBORB_INDEFINITE);
+  // first dataset: base name and time, battery, id
+  err |= cborbs_map(&c, 5);
+  err |= cborbs_int(&c, SENML_CBOR_BN);
+  err |= cborbs_string(&c, urn, strlen(urn));
+  err |= cborbs_int(&c, SENML_CBOR_BT);
+  err |= cborbs_number(&c, (double)d[0].tm / 1000);
+  err |= cborbs_int(&c, SENML_CBOR_N);
+  err |= cborbs_string_lit(&c, "batt");
+  err |= cborbs_int(&c, SENML_CBOR_U);
+  err |= cborbs_string_lit(&c, "%EL");
+  err |= cborbs_int(&c, SENML_CBOR_V);
+  err |= cborbs_int(&c, d[0].bat);
+  err |= cborbs_pop(&c);
+  err |= cborbs_map(&c, 2);
+  err |= cborbs_int(&c, SENML_CBOR_N);
+  err |= cborbs_string_lit(&c, "id");
+  err |= cborbs_int(&c, SENML_CBOR_VS);
+  err |= cborbs_string(&c, id, strlen(id));
+  err |= cborbs_pop(&c);
+  err |= record(&c, "temp", "Cel", 0, SENML_CBOR_V);
+  err |= cborbs_int(&c, d[0].temp);
+  err |= cborbs_pop(&c);
+  // second dataset: relative time
+  err |= record(&c, "temp", "Cel", d[1].t, SENML_CBOR_V);
+  err |= cborbs_int(&c, d[1].temp);
+  err |= cborbs_pop(&c);
+  err |= record(&c, "move", NULL, d[1].t, SENML_CBOR_VB);
+  err |= cborbs_bool(&c, d[1].mov);
+  err |= cborbs_pop(&c);
+  err |= record(&c, "button", NULL, d[1].t, SENML_CBOR_VB);
+  err |= cborbs_bool(&c, d[1].btn);
+  err |= cborbs_pop(&c);
+  err |= cborbs_pop(&c);
+  err |= jsonb_sink_flush(&s);
+  return (err < 0) ? -1 : (int)out.len;
+}
+
+void test_senml_pack(void) {
+  senml_values d[2];
+
+  memset(d, 0, sizeof(d));
+  d[0].tm = 1700000000007LL;
+  d[0].bat = 87;
+  d[0].temp = -12;
+  d[1].t = 1500;
+  d[1].temp = 215;
+  d[1].mov = 1;
+  TEST_ASSERT_GREATER_THAN(0, pack(d, "puck \"7\""));
+  TEST_ASSERT_EQUAL_INT(0, decode(out.data, out.len, text, sizeof(text)));
+  TEST_ASSERT_EQUAL_STRING(
+      "[{-2:\"urn:dev:mac:c82b96ffffa10f3e:\",-3:1700000000.007~,"
+      "0:\"batt\",1:\"%EL\",2:87},{0:\"id\",3:\"puck \"7\"\"},"
+      "{0:\"temp\",1:\"Cel\",2:-12},"
+      "{0:\"temp\",1:\"Cel\",6:1.5~,2:215},{0:\"move\",6:1.5~,4:true},"
+      "{0:\"button\",6:1.5~,4:false}]",
+      text);
+
+  // whole seconds are written as integers, ms as float or double
+  const int64_t t[] = {1, 125, 1000, 86400000, 1700000000007LL};
+  for (size_t k = 0; k < sizeof(t) / sizeof(t[0]); k++) {
+    cbord r;
+    cbord_item it;
+    int labels = 0;
+
+    d[1].t = t[k];
+    TEST_ASSERT_GREATER_THAN(0, pack(d, "puck-1"));
+    cbord_init(&r, out.data, out.len);
+    while (cbord_next(&r, &it) == 1) {
+      if (it.major != CBOR_UINT || it.i != SENML_CBOR_T) {
+        continue;
+      }
+      TEST_ASSERT_EQUAL_INT(1, cbord_next(&r, &it));
+      double v = (it.major == CBOR_UINT) ? (double)it.i : it.d;
+      TEST_ASSERT_TRUE(v == (double)t[k] / 1000);
+      labels++;
+    }
+    TEST_ASSERT_EQUAL_INT(3, labels);
+  }
+  return;
+}
+
+void test_truncated(void) {
+  senml_values d[2];
+
+  memset(d, 0, sizeof(d));
+  d[0].tm = 1700000000007LL;
+  d[1].t = 1;
+  int len = pack(d, "puck-1");
+  TEST_ASSERT_GREATER_THAN(0, len);
+  memcpy(buf, out.data, (size_t)len);
+  TEST_ASSERT_EQUAL_INT(0, decode(buf, (size_t)len, text, sizeof(text)));
+  // no prefix of the pack is a complete pack
+  for (int n = 0; n < len; n++) {
+    TEST_ASSERT_EQUAL_INT(-1, decode(buf, (size_t)n, text, sizeof(text)));
+  }
+  // tags and indefinite strings are not supported
+  const uint8_t tag[] = {0xc1, 0x00};
+  const uint8_t str[] = {0x7f, 0x61, 0x61, 0xff};
+  TEST_ASSERT_EQUAL_INT(-1, decode(tag, sizeof(tag), text, sizeof(text)));
+  TEST_ASSERT_EQUAL_INT(-1, decode(str, sizeof(str), text, sizeof(text)));
+  return;
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_integers);
+  RUN_TEST(test_numbers);
+  RUN_TEST(test_half_floats);
+  RUN_TEST(test_strings);
+  RUN_TEST(test_containers);
+  RUN_TEST(test_senml_pack);
+  RUN_TEST(test_truncated);
+  return UNITY_END();
+}
@@ -0,0 +1,335 @@
+/*
+ * host tests of dataset.h: the transitions of the dataset mask (sensors,
+ * DS_VALID, DS_PACKED), the pool and check_data(); the assembly of
+ * notifications and the scan for complete datasets are timed at the end
+ *
+ *   pio test -e native -f test_dataset
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unity.h>
+
+#include "dataset.h"
+
+// sensor types (EventType of the gateway)
+enum { BAT, TEMP, MOV, BTN, SENSORS };
+
+static ds_pool pool;
+
+void setUp(void) {
+  ds_init(&pool);
+  return;
+}
+
+void tearDown(void) {}
+
+/// @brief stores a value of sensor type as the gateway does (type, value)
+/// @return int (dataset index; DS_NONE if none is free)
+static int notify(int type, int val, uint32_t rx) {
+  int j = ds_index(&pool, (uint8_t)type, rx, 1700000000000ULL + rx);
+
+  if (j == DS_NONE) {
+    return j;
+  }
+  switch (type) {
+  case BAT:
+    set_data_bat(&pool.data[j], val);
+    break;
+  case TEMP:
+    set_data_temp(&pool.data[j], val);
+    break;
+  case MOV:
+    set_data_mov(&pool.data[j], val);
+    break;
+  case BTN:
+    set_data_btn(&pool.data[j], val);
+    break;
+  }
+  ds_update(&pool, j);
+  return j;
+}
+
+void test_sensor_bits(void) {
+  TEST_ASSERT_EQUAL_INT(DS_BAT, 1 << BAT);
+  TEST_ASSERT_EQUAL_INT(DS_TEMP, 1 << TEMP);
+  TEST_ASSERT_EQUAL_INT(DS_MOV, 1 << MOV);
+  TEST_ASSERT_EQUAL_INT(DS_BTN, 1 << BTN);
+  TEST_ASSERT_EQUAL_INT(0, DS_FULL & (DS_VALID | DS_PACKED));
+  TEST_ASSERT_EQUAL_INT(24, sizeof(ds_data));
+  return;
+}
+
+void test_complete_dataset(void) {
+  TEST_ASSERT_EQUAL_INT(DS_NONE, pool.open);
+  TEST_ASSERT_EQUAL_INT(0, notify(BAT, 87, 1000));
+  TEST_ASSERT_EQUAL_INT(0, pool.open);
+  TEST_ASSERT_EQUAL_INT(1, pool.used);
+  TEST_ASSERT_EQUAL_INT(DS_BAT, pool.data[0].mask);
+  TEST_ASSERT_EQUAL_INT(1000, pool.data[0].opened);
+  TEST_ASSERT_TRUE(pool.data[0].tm == 1700000000000ULL + 1000);
+  TEST_ASSERT_FALSE(check_data(&pool.data[0]));
+  TEST_ASSERT_EQUAL_INT(0, notify(TEMP, -12, 1100));
+  TEST_ASSERT_EQUAL_INT(0, notify(MOV, 1, 1200));
+  TEST_ASSERT_FALSE(check_data(&pool.data[0]));
+  // the last sensor closes the dataset
+  TEST_ASSERT_EQUAL_INT(0, notify(BTN, 0, 1499));
+  TEST_ASSERT_EQUAL_INT(DS_NONE, pool.open);
+  TEST_ASSERT_EQUAL_INT(DS_FULL | DS_VALID, pool.data[0].mask);
+  TEST_ASSERT_TRUE(check_data(&pool.data[0]));
+  TEST_ASSERT_EQUAL_INT(87, pool.data[0].bat);
+  TEST_ASSERT_EQUAL_INT(-12, pool.data[0].temp);
+  TEST_ASSERT_EQUAL_INT(ADV_F_MOV, pool.data[0].state);
+  // packed and sent
+  pool.data[0].mask |= DS_PACKED;
+  TEST_ASSERT_TRUE(check_data(&pool.data[0]));
+  ds_release(&pool, 0);
+  TEST_ASSERT_EQUAL_INT(0, pool.used);
+  TEST_ASSERT_EQUAL_INT(0, pool.data[0].mask);
+  TEST_ASSERT_FALSE(check_data(&pool.data[0]));
+  return;
+}
+
+void test_repeated_sensor(void) {
+  TEST_ASSERT_EQUAL_INT(0, notify(BAT, 80, 0));
+  TEST_ASSERT_EQUAL_INT(0, notify(TEMP, 20, 10));
+  // a sensor repeats: the dataset is closed incomplete, a new one started
+  TEST_ASSERT_EQUAL_INT(1, notify(TEMP, 21, 20));
+  TEST_ASSERT_EQUAL_INT(DS_BAT | DS_TEMP | DS_VALID, pool.data[0].mask);
+  TEST_ASSERT_TRUE(check_data(&pool.data[0]));
+  TEST_ASSERT_EQUAL_INT(20, pool.data[0].temp);
+  TEST_ASSERT_EQUAL_INT(DS_TEMP, pool.data[1].mask);
+  TEST_ASSERT_EQUAL_INT(21, pool.data[1].temp);
+  TEST_ASSERT_EQUAL_INT(3, pool.used);
+  // a value stored twice into a dataset keeps the first one
+  set_data_temp(&pool.data[1], 99);
+  set_data_btn(&pool.data[1], 1);
+  set_data_btn(&pool.data[1], 0);
+  TEST_ASSERT_EQUAL_INT(21, pool.data[1].temp);
+  TEST_ASSERT_EQUAL_INT(ADV_F_BTN, pool.data[1].state);
+  return;
+}
+
+void test_window(void) {
+  const uint32_t base[] = {0, 1000, 0xffffff00u};
+
+  for (size_t k = 0; k < sizeof(base) / sizeof(base[0]); k++) {
+    ds_init(&pool);
+    uint32_t rx = base[k];
+    TEST_ASSERT_EQUAL_INT(0, notify(BAT, 1, rx));
+    // within the window (also across the wrap of the ms counter)
+    TEST_ASSERT_EQUAL_INT(0, notify(TEMP, 2, rx + DS_WINDOW_MS - 1));
+    ds_expire_pool(&pool, rx + DS_WINDOW_MS - 1);
+    TEST_ASSERT_EQUAL_INT(0, pool.open);
+    TEST_ASSERT_FALSE(check_data(&pool.data[0]));
+    // the window has passed: the next sensor starts a new dataset
+    TEST_ASSERT_EQUAL_INT(1, notify(MOV, 0, rx + DS_WINDOW_MS));
+    TEST_ASSERT_TRUE(check_data(&pool.data[0]));
+    TEST_ASSERT_EQUAL_INT(DS_MOV, pool.data[1].mask);
+    // an expired dataset is closed without a notification
+    ds_expire_pool(&pool, rx + 2 * DS_WINDOW_MS - 1);
+    TEST_ASSERT_EQUAL_INT(1, pool.open);
+    ds_expire_pool(&pool, rx + 2 * DS_WINDOW_MS);
+    TEST_ASSERT_EQUAL_INT(DS_NONE, pool.open);
+    TEST_ASSERT_EQUAL_INT(DS_MOV | DS_VALID, pool.data[1].mask);
+    TEST_ASSERT_TRUE(check_data(&pool.data[1]));
+  }
+  return;
+}
+
+void test_check_data(void) {
+  ds_data d;
+
+  memset(&d, 0, sizeof(d));
+  TEST_ASSERT_FALSE(check_data(&d));
+  // closed without any sensor (nothing to send)
+  d.mask = DS_VALID;
+  TEST_ASSERT_FALSE(check_data(&d));
+  d.mask = DS_VALID | DS_PACKED;
+  TEST_ASSERT_FALSE(check_data(&d));
+  for (int m = 1; m <= DS_FULL; m++) {
+    d.mask = (uint8_t)m;
+    TEST_ASSERT_FALSE(check_data(&d));
+    d.mask = (uint8_t)(m | DS_VALID);
+    TEST_ASSERT_TRUE(check_data(&d));
+    d.mask = (uint8_t)(m | DS_VALID | DS_PACKED);
+    TEST_ASSERT_TRUE(check_data(&d));
+  }
+  // ds_update() only closes the dataset being assembled
+  TEST_ASSERT_EQUAL_INT(0, notify(BAT, 1, 0));
+  TEST_ASSERT_EQUAL_INT(1, ds_open(&pool, 5, 5));
+  pool.data[0].mask |= DS_FULL;
+  ds_update(&pool, 0);
+  TEST_ASSERT_EQUAL_INT(1, pool.open);
+  return;
+}
+
+void test_pool_full(void) {
+  for (int j = 0; j < DS_POOL_SIZE; j++) {
+    TEST_ASSERT_EQUAL_INT(j, notify(BAT, j, (uint32_t)j));
+  }
+  TEST_ASSERT_EQUAL_INT((1 << DS_POOL_SIZE) - 1, pool.used);
+  // no free dataset: the one being assembled is closed, the value dropped
+  TEST_ASSERT_EQUAL_INT(DS_NONE, notify(BAT, 99, 20));
+  TEST_ASSERT_EQUAL_INT(DS_NONE, pool.open);
+  for (int j = 0; j < DS_POOL_SIZE; j++) {
+    TEST_ASSERT_TRUE(check_data(&pool.data[j]));
+    TEST_ASSERT_EQUAL_INT(j, pool.data[j].bat);
+  }
+  // the lowest free dataset is taken again
+  ds_release(&pool, 6);
+  ds_release(&pool, 3);
+  TEST_ASSERT_EQUAL_INT(3, notify(TEMP, 1, 30));
+  TEST_ASSERT_EQUAL_INT(6, notify(TEMP, 2, 40));
+  // releasing the dataset being assembled ends it
+  ds_release(&pool, 6);
+  TEST_ASSERT_EQUAL_INT(DS_NONE, pool.open);
+  TEST_ASSERT_EQUAL_INT(6, notify(BTN, 1, 50));
+  return;
+}
+
+/// @brief times the assembly of n datasets (four notifications each, every
+///        8th dataset incomplete), as -DDATASET_BENCH does on the device
+/// @return
+void test_bench(void) {
+  const int n = 2000000;
+  uint32_t rx = 0;
+  uint32_t events = 0;
+  uint32_t complete = 0;
+  uint32_t partial = 0;
+  clock_t t0, t1;
+
+  t0 = clock();
+  for (int i = 0; i < n; i++) {
+    int sensors = (i % 8 == 7) ? SENSORS - 1 : SENSORS;
+
+    for (int k = 0; k < sensors; k++) {
+      int j = ds_index(&pool, (uint8_t)k, rx, rx);
+      if (j == DS_NONE) {
+        continue;
+      }
+      pool.data[j].mask |= (uint8_t)(1 << k);
+      ds_update(&pool, j);
+      events++;
+      rx += 5;
+    }
+    rx += 1000;
+    // an incomplete dataset is closed by the next notification
+    for (uint16_t m = pool.used; m != 0; m &= m - 1) {
+      int j = __builtin_ctz(m);
+      if (check_data(&pool.data[j])) {
+        if ((pool.data[j].mask & DS_FULL) == DS_FULL) {
+          complete++;
+        } else {
+          partial++;
+        }
+        ds_release(&pool, j);
+      }
+    }
+  }
+  t1 = clock();
+  printf("BENCH: %u notifications, %u datasets (%u incomplete), "
+         "%.1f ns/notification\n",
+         (unsigned)events, (unsigned)(complete + partial), (unsigned)partial,
+         (double)(t1 - t0) * 1e9 / CLOCKS_PER_SEC / events);
+  // the incomplete dataset of the last round is still open
+  TEST_ASSERT_EQUAL_INT(n - 1, complete + partial);
+  TEST_ASSERT_EQUAL_INT(n / 8 - 1, partial);
+  return;
+}
+
+// former layout of a dataset and of a device slot (long double time,
+// int values and bool flags; the datasets inside the static device slot)
+typedef struct s_old_data {
+  long double tm;
+  int temp;
+  bool f_temp;
+  int bat;
+  bool f_bat;
+  int mov;
+  bool f_mov;
+  int btn;
+  bool f_btn;
+  bool valid;
+} s_old_data;
+
+typedef struct s_old_device {
+  char id[64];
+  char url0[64];
+  char url[64];
+  s_old_data data[DS_POOL_SIZE];
+} s_old_device;
+
+static bool old_check_data(s_old_data *d) {
+  return (d->f_bat & d->f_btn & d->f_mov & d->f_temp & d->valid);
+}
+
+/// @brief times the scan for complete datasets of the former loop() over
+///        all datasets of a slot against the walk over the used mask (3
+///        device slots, 2 datasets in use per slot, one of them complete)
+/// @return
+void test_scan_bench(void) {
+  const int n = 2000000;
+  const int slots = 3;
+  static s_old_device old[3];
+  static ds_pool pools[3];
+  volatile uint32_t sink = 0;
+  uint32_t found[2] = {0, 0};
+  clock_t t0, t1, t2;
+
+  for (int i = 0; i < slots; i++) {
+    ds_init(&pools[i]);
+    for (int k = 0; k < 2; k++) {
+      int j = 3 * i + k;
+      s_old_data *d = &old[i].data[j];
+      d->f_bat = d->f_temp = d->f_mov = d->valid = true;
+      d->f_btn = (k == 0);
+      pools[i].used |= (uint16_t)(1 << j);
+      pools[i].data[j].mask = (k == 0) ? (DS_FULL | DS_VALID) : DS_BAT;
+    }
+  }
+  t0 = clock();
+  for (int r = 0; r < n; r++) {
+    for (int i = 0; i < slots; i++) {
+      for (int j = 0; j < DS_POOL_SIZE; j++) {
+        // the former loop() copied every dataset
+        s_old_data d = old[i].data[j];
+        found[0] += old_check_data(&d);
+      }
+    }
+    sink = sink + found[0];
+  }
+  t1 = clock();
+  for (int r = 0; r < n; r++) {
+    for (int i = 0; i < slots; i++) {
+      for (uint16_t m = pools[i].used; m != 0; m &= m - 1) {
+        found[1] += check_data(&pools[i].data[__builtin_ctz(m)]);
+      }
+    }
+    sink = sink + found[1];
+  }
+  t2 = clock();
+  printf("BENCH: scan of %d slots: former layout %.1f ns (%u bytes/slot), "
+         "used mask %.1f ns (%u bytes/slot)\n",
+         slots, (double)(t1 - t0) * 1e9 / CLOCKS_PER_SEC / n,
+         (unsigned)sizeof(s_old_device),
+         (double)(t2 - t1) * 1e9 / CLOCKS_PER_SEC / n,
+         (unsigned)sizeof(ds_pool));
+  TEST_ASSERT_EQUAL_UINT32((uint32_t)n * slots, found[0]);
+  TEST_ASSERT_EQUAL_UINT32(found[0], found[1]);
+  return;
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_sensor_bits);
+  RUN_TEST(test_complete_dataset);
+  RUN_TEST(test_repeated_sensor);
+  RUN_TEST(test_window);
+  RUN_TEST(test_check_data);
+  RUN_TEST(test_pool_full);
+  RUN_TEST(test_bench);
+  RUN_TEST(test_scan_bench);
+  return UNITY_END();
+}
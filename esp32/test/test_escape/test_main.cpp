@@ -0,0 +1,267 @@
+/*
+ * host tests of the string escaping of json.h: the word-at-a-time escaper
+ * (_jsonb_escape()) must write the same output as the former byte-wise
+ * two-pass escaper for every string; both are timed with 2M strings
+ *
+ *   pio test -e native -f test_escape
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unity.h>
+
+#include "json.h"
+
+#define STR_SIZE 64
+#define OUT_SIZE (6 * STR_SIZE + 1)
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+/* the former escaper: counts the bytes to be added in a first pass and
+ * escapes byte by byte in a second one (reference) */
+static long
+ref_escape(
+    size_t *pos, char buf[], size_t bufsize, const char str[], size_t len)
+{
+    char *esc_tok = NULL, _esc_tok[8] = "\\u00";
+    char *esc_buf = NULL;
+    int extra_bytes = 0;
+    size_t i;
+second_iter:
+    /* 1st iteration, esc_buf is NULL and count extra_bytes needed for escaping
+     * 2st iteration, esc_buf is not NULL, and does escaping.  */
+    for (i = 0; i < len; ++i) {
+        unsigned char c = str[i];
+        esc_tok = NULL;
+        switch (c) {
+        case 0x22: esc_tok = (char*)"\\\""; break;
+        case 0x5C: esc_tok = (char*)"\\\\"; break;
+        case '\b': esc_tok = (char*)"\\b"; break;
+        case '\f': esc_tok = (char*)"\\f"; break;
+        case '\n': esc_tok = (char*)"\\n"; break;
+        case '\r': esc_tok = (char*)"\\r"; break;
+        case '\t': esc_tok = (char*)"\\t"; break;
+        default: if (c <= 0x1F) {
+                   static const char tohex[] = "0123456789abcdef";
+                   _esc_tok[4] = tohex[c >> 4];
+                   _esc_tok[5] = tohex[c & 0xF];
+                   _esc_tok[6] = 0;
+                   esc_tok = _esc_tok;
+                 }
+        }
+        if (esc_tok) {
+            int j;
+            for (j = 0; esc_tok[j]; j++) {
+                if (!esc_buf) /* count how many extra bytes are needed */
+                    continue;
+                *esc_buf++ = esc_tok[j];
+            }
+            extra_bytes += j - 1;
+        }
+        else if (esc_buf) {
+            *esc_buf++ = c;
+        }
+    }
+
+    if (*pos + len + extra_bytes > bufsize) {
+        *buf = '\0';
+        return JSONB_ERROR_NOMEM;
+    }
+
+    if (esc_buf) {
+        *pos += len + extra_bytes;
+        return JSONB_OK;
+    }
+    if (!extra_bytes) {
+        size_t j;
+        for (j = 0; j < len; ++j)
+            buf[*pos + j] = str[j];
+        *pos += len;
+        return JSONB_OK;
+    }
+    esc_buf = buf + *pos;
+    extra_bytes = 0;
+    goto second_iter;
+}
+
+/// @brief a pseudo random 64 bit number (xorshift)
+/// @return uint64_t
+static uint64_t rnd(void) {
+  static uint64_t x = 88172645463325252ULL;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+
+/// @brief escapes len bytes at str (copied to offset off of a word aligned
+///        buffer) with both escapers into a buffer of bufsize bytes and
+///        checks that result and output are the same
+/// @return
+static void check(const char *str, size_t len, size_t off, size_t bufsize) {
+  union {
+    uintptr_t align;
+    char s[STR_SIZE + sizeof(uintptr_t)];
+  } in;
+  char a[OUT_SIZE], b[OUT_SIZE];
+  size_t pa = 0, pb = 0;
+
+  memcpy(in.s + off, str, len);
+  memset(a, 0x55, sizeof(a));
+  memset(b, 0x55, sizeof(b));
+  long ra = ref_escape(&pa, a, bufsize, in.s + off, len);
+  long rb = _jsonb_escape(&pb, b, bufsize, in.s + off, len);
+  TEST_ASSERT_EQUAL_INT(ra, rb);
+  if (ra == JSONB_OK) {
+    TEST_ASSERT_EQUAL_INT(pa, pb);
+    TEST_ASSERT_EQUAL_MEMORY(a, b, pa);
+  } else {
+    TEST_ASSERT_EQUAL_INT(0, pb);
+    TEST_ASSERT_EQUAL_INT('\0', b[0]);
+  }
+  return;
+}
+
+void test_every_byte(void) {
+  // every byte alone and in clean strings of 7, 8 and 9 bytes (around a
+  // word) at every position and alignment
+  for (int c = 0; c < 256; c++) {
+    for (size_t len = 1; len <= 17; len++) {
+      for (size_t at = 0; at < len; at++) {
+        for (size_t off = 0; off < sizeof(uintptr_t); off++) {
+          char s[STR_SIZE];
+
+          memset(s, 'a', len);
+          s[at] = (char)c;
+          check(s, len, off, OUT_SIZE);
+        }
+      }
+    }
+  }
+  return;
+}
+
+void test_special_strings(void) {
+  // all strings up to 5 bytes of clean and special bytes
+  const char alpha[] = {'a', ' ', '"', '\\', '\n', '\x01', '\x1f', '\x7f',
+                        '\x80', '\xff', '\0', '/'};
+  const size_t n = sizeof(alpha);
+
+  for (size_t len = 0; len <= 5; len++) {
+    size_t count = 1;
+
+    for (size_t k = 0; k < len; k++) {
+      count *= n;
+    }
+    for (size_t i = 0; i < count; i++) {
+      char s[STR_SIZE];
+      size_t v = i;
+
+      for (size_t k = 0; k < len; k++, v /= n) {
+        s[k] = alpha[v % n];
+      }
+      check(s, len, i % sizeof(uintptr_t), OUT_SIZE);
+    }
+  }
+  return;
+}
+
+void test_buffer_size(void) {
+  const char *str[] = {"", "abcdefg", "abcdefgh", "abcdefghi", "\"\\\"\\",
+                       "id \"7\"\x01\ttail", "\x1f\x1f\x1f\x1f\x1f\x1f\x1f"};
+
+  // every buffer size up to the one needed (and more): the escaper fails
+  // with JSONB_ERROR_NOMEM exactly where the former one did
+  for (size_t k = 0; k < sizeof(str) / sizeof(str[0]); k++) {
+    size_t len = strlen(str[k]);
+
+    for (size_t size = 0; size <= 6 * len + 2; size++) {
+      for (size_t off = 0; off < sizeof(uintptr_t); off++) {
+        check(str[k], len, off, size);
+      }
+    }
+  }
+  return;
+}
+
+/// @brief fills s with a random string of len bytes; every 16th byte (on
+///        average) has to be escaped
+/// @return
+static void random_string(char *s, size_t len) {
+  for (size_t k = 0; k < len; k++) {
+    uint64_t r = rnd();
+    s[k] = (r % 16 == 0) ? "\"\\\n\t\x01\x1f"[(r >> 8) % 6]
+                         : (char)(' ' + 2 + (r >> 8) % 90);
+  }
+  return;
+}
+
+void test_random_strings(void) {
+  for (int i = 0; i < 2000000; i++) {
+    char s[STR_SIZE];
+    size_t len = rnd() % STR_SIZE;
+
+    random_string(s, len);
+    check(s, len, (size_t)i % sizeof(uintptr_t), OUT_SIZE);
+  }
+  return;
+}
+
+/// @brief times 2M strings of each kind with both escapers (a device id,
+///        which needs no escaping, and random strings with special bytes)
+/// @return
+void test_bench(void) {
+  const int n = 2000000;
+  const char *id = "f0a1b2c3-1234-4bcd-9876-00112233aabb";
+  static char rs[1024][STR_SIZE];
+  static size_t rl[1024];
+  char out[OUT_SIZE];
+  uint64_t bytes[2] = {0, 0};
+
+  for (int k = 0; k < 1024; k++) {
+    rl[k] = 8 + rnd() % (STR_SIZE - 8);
+    random_string(rs[k], rl[k]);
+  }
+  for (int kind = 0; kind < 2; kind++) {
+    clock_t t[3];
+
+    for (int e = 0; e < 2; e++) {
+      t[e] = clock();
+      for (int i = 0; i < n; i++) {
+        const char *s = (kind == 0) ? id : rs[i & 1023];
+        size_t len = (kind == 0) ? 36 : rl[i & 1023];
+        size_t pos = 0;
+
+        if (e == 0) {
+          ref_escape(&pos, out, sizeof(out), s, len);
+        } else {
+          _jsonb_escape(&pos, out, sizeof(out), s, len);
+        }
+        bytes[e] += pos;
+      }
+    }
+    t[2] = clock();
+    printf("BENCH: %s: byte-wise %.1f ns/string, word-wise %.1f ns/string "
+           "(%d strings)\n",
+           (kind == 0) ? "device id" : "random strings",
+           (double)(t[1] - t[0]) * 1e9 / CLOCKS_PER_SEC / n,
+           (double)(t[2] - t[1]) * 1e9 / CLOCKS_PER_SEC / n, n);
+  }
+  TEST_ASSERT_EQUAL_INT(bytes[0], bytes[1]);
+  return;
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_every_byte);
+  RUN_TEST(test_special_strings);
+  RUN_TEST(test_buffer_size);
+  RUN_TEST(test_random_strings);
+  RUN_TEST(test_bench);
+  return UNITY_END();
+}
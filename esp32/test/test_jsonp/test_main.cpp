@@ -0,0 +1,138 @@
+/*
+ * host tests of the pull parser of json.h (jsonp_next()): the number
+ * grammar and the completeness of a document, parsed at once and in
+ * chunks of one byte
+ *
+ *   pio test -e native -f test_jsonp
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "json.h"
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+/* parses doc in chunks of chunk bytes; the text of the last number is
+ * copied to num */
+static int parse(const char *doc, size_t chunk, char *num) {
+  jsonp p;
+  const char *s = doc;
+  size_t left = strlen(doc);
+
+  jsonp_init(&p);
+  num[0] = '\0';
+  while (left > 0) {
+    size_t n = (left < chunk) ? left : chunk;
+    size_t k = n;
+    jsonptoken t;
+
+    while ((t = jsonp_next(&p, &s, &k)) > JSONP_MORE) {
+      if (t == JSONP_NUMBER) {
+        snprintf(num, JSONP_VALUE_SIZE, "%s", p.value);
+      }
+    }
+    left -= n - k;
+    if (t < 0) {
+      break;
+    }
+  }
+  return jsonp_complete(&p);
+}
+
+static void check(const char *doc, int complete, const char *num) {
+  char text[JSONP_VALUE_SIZE];
+
+  TEST_ASSERT_EQUAL_INT_MESSAGE(complete, parse(doc, strlen(doc), text), doc);
+  if (complete) {
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(num, text, doc);
+  }
+  TEST_ASSERT_EQUAL_INT_MESSAGE(complete, parse(doc, 1, text), doc);
+  if (complete) {
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(num, text, doc);
+  }
+  return;
+}
+
+static void test_numbers(void) {
+  static const char *valid[] = {"0",      "-0",     "7",        "-12",
+                                "120",    "0.5",    "-0.25",    "1.5e3",
+                                "1E5",    "2e+10",  "3e-7",     "0.1E-2",
+                                "-0e0",   "10.01",  "1e007",    "123456789"};
+  char doc[64];
+
+  for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+    snprintf(doc, sizeof(doc), "{\"a\":%s}", valid[i]);
+    check(doc, 1, valid[i]);
+    snprintf(doc, sizeof(doc), "[%s ]", valid[i]);
+    check(doc, 1, valid[i]);
+  }
+  return;
+}
+
+static void test_invalid_numbers(void) {
+  static const char *invalid[] = {"--1", "-",    "+1",  "1.",  ".5",
+                                  "01",  "-01",  "1e",  "1e+", "1E-",
+                                  "1.e3", "1..2", "1e5.3", "1-2", "0x1",
+                                  "1ee2", "-.5",  "1.5e", "00",  "1+"};
+  char doc[64];
+
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    snprintf(doc, sizeof(doc), "{\"a\":%s}", invalid[i]);
+    check(doc, 0, NULL);
+    snprintf(doc, sizeof(doc), "[%s]", invalid[i]);
+    check(doc, 0, NULL);
+  }
+  return;
+}
+
+static void test_complete(void) {
+  check("{\"a\":1}", 1, "1");
+  check("{\"a\":1} \r\n", 1, "1");
+  check("{\"a\":1} x", 0, NULL);
+  check("{\"a\":1}}", 0, NULL);
+  check("{\"a\":1}{}", 0, NULL);
+  check("{\"a\":1", 0, NULL);
+  check("[1,2]", 1, "2");
+  check("[1,2,]", 0, NULL);
+  return;
+}
+
+static void test_location(void) {
+  const char *doc = "{\"location\":{\"lat\":48.2082,\"lng\":-16.3738e0},"
+                    "\"accuracy\":20}";
+  const char *s = doc;
+  size_t left = strlen(doc);
+  jsonptoken t;
+  jsonp p;
+  int found = 0;
+
+  jsonp_init(&p);
+  while ((t = jsonp_next(&p, &s, &left)) > JSONP_MORE) {
+    if (jsonp_match(&p, "location.lat")) {
+      TEST_ASSERT_EQUAL_STRING("48.2082", p.value);
+      found++;
+    } else if (jsonp_match(&p, "location.lng")) {
+      TEST_ASSERT_EQUAL_STRING("-16.3738e0", p.value);
+      found++;
+    } else if (jsonp_match(&p, "accuracy")) {
+      TEST_ASSERT_EQUAL_STRING("20", p.value);
+      found++;
+    }
+  }
+  TEST_ASSERT_EQUAL_INT(3, found);
+  TEST_ASSERT_TRUE(jsonp_complete(&p));
+  return;
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_numbers);
+  RUN_TEST(test_invalid_numbers);
+  RUN_TEST(test_complete);
+  RUN_TEST(test_location);
+  return UNITY_END();
+}
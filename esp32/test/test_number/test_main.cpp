@@ -0,0 +1,332 @@
+/*
+ * host tests of the number formatting of json.h: jsonb_number() (Grisu2,
+ * _jsonb_dtoa()) must read back to the same double as printf("%.17g")
+ * does, jsonb_fixed() must write the exact decimal of a fixed point value;
+ * both are timed against printf() at the end
+ *
+ *   pio test -e native -f test_number
+ */
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unity.h>
+
+#include "json.h"
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+/// @brief a pseudo random 64 bit number (xorshift)
+/// @return uint64_t
+static uint64_t rnd(void) {
+  static uint64_t x = 88172645463325252ULL;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+
+/// @brief checks that a token is a JSON number
+/// @return bool
+static bool json_number(const char *s) {
+  if (*s == '-') {
+    s++;
+  }
+  if (*s == '0') {
+    s++;
+  } else if (*s >= '1' && *s <= '9') {
+    while (*s >= '0' && *s <= '9') {
+      s++;
+    }
+  } else {
+    return false;
+  }
+  if (*s == '.') {
+    if (*++s < '0' || *s > '9') {
+      return false;
+    }
+    while (*s >= '0' && *s <= '9') {
+      s++;
+    }
+  }
+  if (*s == 'e' || *s == 'E') {
+    s++;
+    if (*s == '+' || *s == '-') {
+      s++;
+    }
+    if (*s < '0' || *s > '9') {
+      return false;
+    }
+    while (*s >= '0' && *s <= '9') {
+      s++;
+    }
+  }
+  return *s == '\0';
+}
+
+/// @brief number of significant digits of a number token
+/// @return int
+static int digits(const char *s) {
+  int n = 0;
+  int zeros = 0;
+  bool lead = true;
+
+  for (; *s != '\0' && *s != 'e' && *s != 'E'; s++) {
+    if (*s < '0' || *s > '9') {
+      continue;
+    }
+    if (lead && *s == '0') {
+      continue;
+    }
+    lead = false;
+    // trailing zeros of an integer are not significant
+    zeros = (*s == '0') ? zeros + 1 : 0;
+    n++;
+  }
+  return n - zeros;
+}
+
+/// @brief formats v with jsonb_format_number() and checks that it is a JSON
+///        number which reads back to the same double (bit for bit) as the
+///        text of printf("%.17g") does, with at most 17 digits
+/// @return int (1 if the text is longer than the shortest which reads back)
+static int check(double v) {
+  char token[JSONB_NUMBER_SIZE + 1];
+  char ref[48];
+  double a, b;
+  int shortest = 17;
+
+  long len = jsonb_format_number(token, v);
+  TEST_ASSERT_GREATER_THAN(0, len);
+  TEST_ASSERT_LESS_THAN(JSONB_NUMBER_SIZE, len);
+  token[len] = '\0';
+  snprintf(ref, sizeof(ref), "%.17g", v);
+  a = strtod(token, NULL);
+  b = strtod(ref, NULL);
+  if (!json_number(token) || memcmp(&a, &v, sizeof(v)) != 0 ||
+      memcmp(&b, &v, sizeof(v)) != 0) {
+    printf("%s (%%.17g: %s)\n", token, ref);
+    TEST_FAIL_MESSAGE("number does not read back");
+  }
+  for (int p = 1; p < 17; p++) {
+    snprintf(ref, sizeof(ref), "%.*g", p, v);
+    if (strtod(ref, NULL) == v) {
+      shortest = p;
+      break;
+    }
+  }
+  TEST_ASSERT_LESS_OR_EQUAL(17, digits(token));
+  return digits(token) > shortest;
+}
+
+void test_edge_values(void) {
+  const double v[] = {0.0,
+                      -0.0,
+                      1.0,
+                      -1.0,
+                      0.1,
+                      -0.1,
+                      1e-6,
+                      1e-7,
+                      123456.789e-11,
+                      1e20,
+                      1e21,
+                      -1e21,
+                      1e22,
+                      9007199254740991.0,
+                      9007199254740992.0,
+                      9007199254740993.0,
+                      18446744073709551615.0,
+                      DBL_MAX,
+                      -DBL_MAX,
+                      DBL_MIN,
+                      DBL_MIN / 2,
+                      4.9406564584124654e-324,
+                      -4.9406564584124654e-324,
+                      2.2250738585072009e-308,
+                      DBL_EPSILON,
+                      48.2082,
+                      16.3738,
+                      -33.8688,
+                      1700000000.007,
+                      5e-324 * 3,
+                      0.30000000000000004,
+                      2.5,
+                      1.5e300};
+
+  for (size_t k = 0; k < sizeof(v) / sizeof(v[0]); k++) {
+    TEST_ASSERT_EQUAL_INT(0, check(v[k]));
+  }
+  // the sign of zero is kept
+  char token[JSONB_NUMBER_SIZE];
+  TEST_ASSERT_EQUAL_INT(2, jsonb_format_number(token, -0.0));
+  TEST_ASSERT_EQUAL_STRING_LEN("-0", token, 2);
+  TEST_ASSERT_EQUAL_INT(1, jsonb_format_number(token, 0.0));
+  // integers below 2^53 and exponents up to 20 are written plainly
+  TEST_ASSERT_EQUAL_INT(21, jsonb_format_number(token, 1e20));
+  TEST_ASSERT_EQUAL_STRING_LEN("100000000000000000000", token, 21);
+  TEST_ASSERT_EQUAL_INT(4, jsonb_format_number(token, 1e21));
+  TEST_ASSERT_EQUAL_STRING_LEN("1e21", token, 4);
+  TEST_ASSERT_EQUAL_INT(4, jsonb_format_number(token, 1e-7));
+  TEST_ASSERT_EQUAL_STRING_LEN("1e-7", token, 4);
+  TEST_ASSERT_EQUAL_STRING_LEN("0.000001", token,
+                               jsonb_format_number(token, 1e-6));
+  // not finite: not a JSON number
+  TEST_ASSERT_TRUE(jsonb_format_number(token, NAN) < 0);
+  TEST_ASSERT_TRUE(jsonb_format_number(token, INFINITY) < 0);
+  TEST_ASSERT_TRUE(jsonb_format_number(token, -INFINITY) < 0);
+  return;
+}
+
+void test_random_values(void) {
+  const int n = 1000000;
+  int longer = 0;
+  int tested = 0;
+
+  // any finite double (random bit patterns, denormals included)
+  for (int i = 0; i < n; i++) {
+    uint64_t u = rnd();
+    double v;
+
+    memcpy(&v, &u, sizeof(v));
+    if (v != v || v - v != 0) {
+      continue;
+    }
+    longer += check(v);
+    tested++;
+  }
+  // sensor values and coordinates with few decimals
+  for (int i = 0; i < n; i++) {
+    double v = (double)(int64_t)(rnd() % 200000000 - 100000000) /
+               pow(10, (double)(rnd() % 8));
+    longer += check(v);
+    tested++;
+  }
+  // Grisu2 misses the shortest digits for about 0.1% of all doubles
+  printf("NUMBER: %d values, %d longer than the shortest\n", tested,
+         longer);
+  TEST_ASSERT_LESS_THAN(tested / 500, longer);
+  return;
+}
+
+/// @brief the exact decimal of value / 10^scale
+/// @return
+static void fixed_ref(char *ref, size_t size, int64_t value, unsigned scale) {
+  uint64_t n = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+  uint64_t p = 1;
+
+  for (unsigned k = 0; k < scale; k++) {
+    p *= 10;
+  }
+  if (scale == 0) {
+    snprintf(ref, size, "%s%llu", value < 0 ? "-" : "", (unsigned long long)n);
+  } else {
+    snprintf(ref, size, "%s%llu.%0*llu", value < 0 ? "-" : "",
+             (unsigned long long)(n / p), (int)scale,
+             (unsigned long long)(n % p));
+  }
+  return;
+}
+
+void test_fixed(void) {
+  const int64_t v[] = {0,       1,       -1,       9,     -9,
+                       10,      -10,     999,      -999,  1000,
+                       -1000,   1001,    -1001,    123456789,
+                       1700000000007LL,  -1700000000007LL,
+                       INT64_MAX,        INT64_MIN,        INT64_MIN + 1};
+  const unsigned scale[] = {0, 1, 3, 6, 18};
+  char token[JSONB_NUMBER_SIZE + 1];
+  char ref[48];
+
+  for (size_t k = 0; k < sizeof(v) / sizeof(v[0]); k++) {
+    for (size_t s = 0; s < sizeof(scale) / sizeof(scale[0]); s++) {
+      long len = jsonb_format_fixed(token, v[k], scale[s]);
+
+      TEST_ASSERT_GREATER_THAN(0, len);
+      token[len] = '\0';
+      fixed_ref(ref, sizeof(ref), v[k], scale[s]);
+      TEST_ASSERT_EQUAL_STRING(ref, token);
+      TEST_ASSERT_TRUE(json_number(token));
+    }
+  }
+  TEST_ASSERT_EQUAL_STRING_LEN("-0.001", token, jsonb_format_fixed(token, -1, 3));
+  TEST_ASSERT_EQUAL_STRING_LEN("0.000", token, jsonb_format_fixed(token, 0, 3));
+  TEST_ASSERT_EQUAL_STRING_LEN("-5", token, jsonb_format_fixed(token, -5, 0));
+  TEST_ASSERT_TRUE(jsonb_format_fixed(token, 1, 19) < 0);
+
+  // times in ms as seconds: the same text as printf("%.3f")
+  for (int i = 0; i < 1000000; i++) {
+    int64_t ms = (int64_t)(rnd() % 4000000000000ULL) - 1000000000000LL;
+    long len = jsonb_format_fixed(token, ms, 3);
+
+    token[len] = '\0';
+    snprintf(ref, sizeof(ref), "%.3f", (double)ms / 1000);
+    if (strcmp(ref, token) != 0 && !(ms > -1000 && ms < 0)) {
+      printf("%lld: %s (%%.3f: %s)\n", (long long)ms, token, ref);
+      TEST_FAIL_MESSAGE("fixed point value differs from %.3f");
+    }
+  }
+  return;
+}
+
+/// @brief times n numbers of each kind (sensor values, coordinates,
+///        timestamps) against printf(), as -DNUMBER_BENCH does on the device
+/// @return
+void test_bench(void) {
+  const int n = 2000000;
+  const char *name[] = {"integer", "fraction", "time"};
+  char token[JSONB_NUMBER_SIZE];
+  char old[48];
+
+  for (int kind = 0; kind < 3; kind++) {
+    int64_t now = 1700000000000LL;
+    uint64_t bytes[2] = {0, 0};
+    clock_t t0, t1, t2;
+
+    t0 = clock();
+    for (int i = 0; i < n; i++) {
+      if (kind == 0) {
+        bytes[0] += jsonb_format_number(token, i % 101);
+      } else if (kind == 1) {
+        bytes[0] += jsonb_format_number(token, 48.2082 + i * 1e-6);
+      } else {
+        bytes[0] += jsonb_format_fixed(token, now + i * 37, 3);
+      }
+    }
+    t1 = clock();
+    for (int i = 0; i < n; i++) {
+      if (kind == 0) {
+        bytes[1] += snprintf(old, sizeof(old), "%.17g", (double)(i % 101));
+      } else if (kind == 1) {
+        bytes[1] += snprintf(old, sizeof(old), "%.17g", 48.2082 + i * 1e-6);
+      } else {
+        bytes[1] += snprintf(old, sizeof(old), "%.3f",
+                             (double)(now + i * 37) / 1000);
+      }
+    }
+    t2 = clock();
+    printf("BENCH: %s %.1f ns/number (%llu bytes), printf %.1f ns/number "
+           "(%llu bytes)\n",
+           name[kind], (double)(t1 - t0) * 1e9 / CLOCKS_PER_SEC / n,
+           (unsigned long long)bytes[0],
+           (double)(t2 - t1) * 1e9 / CLOCKS_PER_SEC / n,
+           (unsigned long long)bytes[1]);
+    TEST_ASSERT_LESS_OR_EQUAL(bytes[1], bytes[0]);
+  }
+  return;
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_edge_values);
+  RUN_TEST(test_random_values);
+  RUN_TEST(test_fixed);
+  RUN_TEST(test_bench);
+  return UNITY_END();
+}
@@ -0,0 +1,305 @@
+/*
+ * host tests of pqueue.h against the file backed flash (PQ_FILE_FLASH):
+ * FIFO order over many passes of the ring, a full ring dropping its oldest
+ * sector, recovery at start-up after torn writes, CRC failures and consumed
+ * records persisting over a restart
+ *
+ *   pio test -e native -f test_pqueue
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+#define PQ_FILE_FLASH
+#include "pqueue.h"
+
+#define FLASH_FILE "test_pqueue.bin"
+#define SECTORS 3
+// 16 bytes header: four records of this size fill a sector
+#define QUARTER (PQ_SECTOR_SIZE / 4 - sizeof(pq_hdr))
+
+static pq_flash flash;
+static pqueue q;
+
+/// @brief opens the queue on the flash file (a restart of the gateway)
+/// @return
+static void mount(void) {
+  TEST_ASSERT_EQUAL_INT(0, pq_file_flash(&flash, FLASH_FILE,
+                                         SECTORS * PQ_SECTOR_SIZE));
+  TEST_ASSERT_EQUAL_INT(PQ_OK, pq_init(&q, &flash));
+  return;
+}
+
+static void unmount(void) {
+  fclose((FILE *)flash.ctx);
+  return;
+}
+
+static void remount(void) {
+  unmount();
+  mount();
+  return;
+}
+
+void setUp(void) {
+  remove(FLASH_FILE);
+  mount();
+  return;
+}
+
+void tearDown(void) {
+  unmount();
+  remove(FLASH_FILE);
+  return;
+}
+
+/// @brief fills buf with the payload of record n (len bytes)
+/// @return
+static void payload(uint8_t *buf, uint32_t n, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    buf[i] = (uint8_t)(n * 31 + i);
+  }
+  if (len >= sizeof(n)) {
+    memcpy(buf, &n, sizeof(n));
+  }
+  return;
+}
+
+static void push(uint32_t n, size_t len) {
+  uint8_t buf[PQ_MAX_RECORD];
+
+  payload(buf, n, len);
+  TEST_ASSERT_EQUAL_INT(PQ_OK, pq_push(&q, buf, len));
+  return;
+}
+
+/// @brief checks that the oldest record is record n and consumes it
+/// @return
+static void pop(uint32_t n, size_t len) {
+  uint8_t buf[PQ_MAX_RECORD];
+  uint8_t ref[PQ_MAX_RECORD];
+  size_t got = 0;
+
+  payload(ref, n, len);
+  TEST_ASSERT_EQUAL_INT(PQ_OK, pq_peek(&q, buf, sizeof(buf), &got));
+  TEST_ASSERT_EQUAL_INT(len, got);
+  TEST_ASSERT_EQUAL_MEMORY(ref, buf, len);
+  TEST_ASSERT_EQUAL_INT(PQ_OK, pq_pop(&q));
+  return;
+}
+
+/// @brief counts the pending records from the tail to the head (without
+///        consuming them)
+/// @return int
+static int pending(void) {
+  uint32_t off = q.tail;
+  uint32_t steps = 0;
+  int n = 0;
+  pq_hdr h;
+
+  while (off != q.head && steps++ < SECTORS * PQ_SECTOR_SIZE) {
+    if (!_pq_header(&q, off, &h)) {
+      off = _pq_next_sector(&q, off);
+      continue;
+    }
+    n += (h.flags == PQ_ERASED32);
+    off = _pq_skip(&q, &h, off);
+  }
+  TEST_ASSERT_EQUAL_INT(q.head, off);
+  return n;
+}
+
+static void test_fifo_wrap(void) {
+  uint32_t in = 0;
+  uint32_t out = 0;
+
+  srand(1);
+  // many passes over the ring, never more than a sector pending
+  while (in < 1500) {
+    int k = rand() % 4;
+
+    for (int i = 0; i < k; i++, in++) {
+      push(in, 16 + in % 200);
+    }
+    while (in - out > 12 || (rand() % 2 && out < in)) {
+      pop(out, 16 + out % 200);
+      out++;
+    }
+  }
+  while (out < in) {
+    pop(out, 16 + out % 200);
+    out++;
+  }
+  TEST_ASSERT_TRUE(pq_empty(&q));
+  TEST_ASSERT_EQUAL_INT(PQ_EMPTY, pq_pop(&q));
+  TEST_ASSERT_TRUE(q.erases > 10 * SECTORS);
+  TEST_ASSERT_EQUAL_INT(0, q.dropped);
+  return;
+}
+
+static void test_full_ring(void) {
+  // four records per sector: the 12th push wraps onto the oldest sector
+  for (uint32_t n = 0; n < 12; n++) {
+    push(n, QUARTER);
+  }
+  TEST_ASSERT_FALSE(pq_empty(&q));
+  TEST_ASSERT_EQUAL_INT(4, q.dropped);
+  TEST_ASSERT_EQUAL_INT(8, pending());
+  for (uint32_t n = 4; n < 8; n++) {
+    pop(n, QUARTER);
+  }
+  // the ring keeps dropping the oldest sector while nothing is consumed
+  for (uint32_t n = 12; n < 20; n++) {
+    push(n, QUARTER);
+  }
+  TEST_ASSERT_EQUAL_INT(8, q.dropped);
+  remount();
+  TEST_ASSERT_EQUAL_INT(8, pending());
+  for (uint32_t n = 12; n < 20; n++) {
+    pop(n, QUARTER);
+  }
+  TEST_ASSERT_TRUE(pq_empty(&q));
+  return;
+}
+
+static void test_full_ring_random(void) {
+  uint32_t in = 0;
+  uint32_t out = 0;
+  uint32_t lost = 0;
+
+  srand(2);
+  for (int r = 0; r < 3000; r++) {
+    if (rand() % 3) {
+      uint32_t dropped = q.dropped;
+      push(in, QUARTER);
+      in++;
+      // dropped records are the oldest ones
+      out += q.dropped - dropped;
+      lost += q.dropped - dropped;
+    } else if (out < in) {
+      pop(out, QUARTER);
+      out++;
+    }
+    TEST_ASSERT_EQUAL_INT(in - out, pending());
+  }
+  TEST_ASSERT_TRUE(lost > 0);
+  TEST_ASSERT_EQUAL_INT(lost, q.dropped);
+  return;
+}
+
+/// @brief writes len bytes at off as an interrupted write would leave them
+/// @return
+static void program(uint32_t off, const void *data, size_t len) {
+  TEST_ASSERT_EQUAL_INT(0, flash.write(flash.ctx, off, data, len));
+  return;
+}
+
+static void test_torn_header(void) {
+  pq_hdr h = {PQ_MAGIC, 100, 0, 0, PQ_ERASED32};
+
+  for (uint32_t n = 0; n < 3; n++) {
+    push(n, 100);
+  }
+  // power loss after the first half of the header
+  h.seq = q.seq;
+  program(q.head, &h, sizeof(h) / 2);
+  remount();
+  TEST_ASSERT_EQUAL_INT(3, pending());
+  // the damaged sector is closed, new records go to the next one
+  TEST_ASSERT_EQUAL_INT(PQ_SECTOR_SIZE, q.head);
+  push(3, 100);
+  remount();
+  for (uint32_t n = 0; n < 4; n++) {
+    pop(n, 100);
+  }
+  TEST_ASSERT_TRUE(pq_empty(&q));
+  return;
+}
+
+static void test_torn_record(void) {
+  uint8_t buf[100];
+  size_t len = 0;
+  pq_hdr h;
+
+  for (uint32_t n = 0; n < 3; n++) {
+    push(n, 100);
+  }
+  // power loss while the payload was written: the header made it, part of
+  // the payload did not
+  payload(buf, 3, sizeof(buf));
+  h.magic = PQ_MAGIC;
+  h.len = sizeof(buf);
+  h.seq = q.seq;
+  h.crc = _pq_record_crc(&h, buf);
+  h.flags = PQ_ERASED32;
+  program(q.head + sizeof(pq_hdr), buf, sizeof(buf) / 2);
+  program(q.head, &h, sizeof(h));
+  remount();
+  TEST_ASSERT_EQUAL_INT(PQ_SECTOR_SIZE, q.head);
+  for (uint32_t n = 0; n < 3; n++) {
+    pop(n, 100);
+  }
+  // the torn record is found by its CRC at start-up and never handed out
+  TEST_ASSERT_TRUE(pq_empty(&q));
+  TEST_ASSERT_EQUAL_INT(PQ_EMPTY, pq_peek(&q, buf, sizeof(buf), &len));
+  return;
+}
+
+static void test_crc(void) {
+  uint8_t buf[PQ_MAX_RECORD];
+  uint8_t zero = 0;
+  size_t len = 0;
+
+  for (uint32_t n = 0; n < 3; n++) {
+    push(n, 100);
+  }
+  // a bit flipped in the payload of the second record
+  program(sizeof(pq_hdr) + PQ_ALIGN(100) + sizeof(pq_hdr) + 50, &zero, 1);
+  pop(0, 100);
+  TEST_ASSERT_EQUAL_INT(PQ_ERROR_CORRUPT, pq_peek(&q, buf, sizeof(buf), &len));
+  // the gateway drops a record it cannot read
+  TEST_ASSERT_EQUAL_INT(PQ_OK, pq_pop(&q));
+  pop(2, 100);
+  TEST_ASSERT_TRUE(pq_empty(&q));
+  // a buffer too small for the record
+  push(3, 100);
+  TEST_ASSERT_EQUAL_INT(PQ_ERROR_SIZE, pq_peek(&q, buf, 99, &len));
+  return;
+}
+
+static void test_remount(void) {
+  for (uint32_t n = 0; n < 10; n++) {
+    push(n, 300);
+  }
+  pop(0, 300);
+  pop(1, 300);
+  remount();
+  TEST_ASSERT_EQUAL_INT(8, pending());
+  pop(2, 300);
+  remount();
+  remount();
+  TEST_ASSERT_EQUAL_INT(7, pending());
+  push(10, 300);
+  remount();
+  for (uint32_t n = 3; n < 11; n++) {
+    pop(n, 300);
+  }
+  TEST_ASSERT_TRUE(pq_empty(&q));
+  remount();
+  TEST_ASSERT_TRUE(pq_empty(&q));
+  return;
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_fifo_wrap);
+  RUN_TEST(test_full_ring);
+  RUN_TEST(test_full_ring_random);
+  RUN_TEST(test_torn_header);
+  RUN_TEST(test_torn_record);
+  RUN_TEST(test_crc);
+  RUN_TEST(test_remount);
+  return UNITY_END();
+}
@@ -0,0 +1,322 @@
+/*
+ * host tests of senml.h: the packs written from the pre-rendered fragments
+ * (senml_dataset()) must be the same, byte for byte, as the ones of the
+ * jsonb builder calls they replace (json_dataset() of the gateway)
+ *
+ *   pio test -e native -f test_senml
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unity.h>
+
+#include "json.h"
+#include "senml.h"
+
+#define PACK_SIZE 3072
+
+static const char *urn = "urn:dev:mac:c82b96ffffa10f3e:";
+static const double lat = 48.2082;
+static const double lon = -16.3738;
+
+static char ref[PACK_SIZE];
+static char out[PACK_SIZE];
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+/// @brief encodes a dataset with the jsonb builder, as json_dataset() of the
+///        gateway does (the reference of senml_dataset())
+/// @return int (negative on error)
+static int ref_dataset(jsonb_sink *s, const char *id, const senml_values *d,
+                       bool first) {
+  int64_t t = d->t;
+  int err = 0;
+
+  if (first) {
+    if (d->mask & SENML_BAT) {
+      err |= jsonbs_object(s);
+      err |= jsonbs_key_lit(s, "bn");
+      err |= jsonbs_string(s, urn, strlen(urn));
+      err |= jsonbs_key_lit(s, "bt");
+      err |= jsonbs_fixed(s, d->tm, 3);
+      err |= jsonbs_key_lit(s, "n");
+      err |= jsonbs_string_lit(s, "batt");
+      err |= jsonbs_key_lit(s, "u");
+      err |= jsonbs_string_lit(s, "%EL");
+      err |= jsonbs_key_lit(s, "v");
+      err |= jsonbs_number(s, d->bat);
+      err |= jsonbs_object_pop(s);
+    }
+    err |= jsonbs_object(s);
+    if (!(d->mask & SENML_BAT)) {
+      err |= jsonbs_key_lit(s, "bn");
+      err |= jsonbs_string(s, urn, strlen(urn));
+      err |= jsonbs_key_lit(s, "bt");
+      err |= jsonbs_fixed(s, d->tm, 3);
+    }
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "id");
+    err |= jsonbs_key_lit(s, "vs");
+    err |= jsonbs_string(s, id, strlen(id));
+    err |= jsonbs_object_pop(s);
+    for (int i = 0; i < 2; i++) {
+      const char *n = (i == 0) ? "lat" : "lon";
+
+      err |= jsonbs_object(s);
+      err |= jsonbs_key_lit(s, "n");
+      err |= jsonbs_string(s, n, 3);
+      err |= jsonbs_key_lit(s, "u");
+      err |= jsonbs_string(s, n, 3);
+      err |= jsonbs_key_lit(s, "v");
+      err |= jsonbs_number(s, (i == 0) ? lat : lon);
+      err |= jsonbs_object_pop(s);
+    }
+  } else if (d->mask & SENML_BAT) {
+    err |= jsonbs_object(s);
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "batt");
+    err |= jsonbs_key_lit(s, "u");
+    err |= jsonbs_string_lit(s, "%EL");
+    if (t != 0) {
+      err |= jsonbs_key_lit(s, "t");
+      err |= jsonbs_fixed(s, t, 3);
+    }
+    err |= jsonbs_key_lit(s, "v");
+    err |= jsonbs_number(s, d->bat);
+    err |= jsonbs_object_pop(s);
+  }
+  if (d->mask & SENML_TEMP) {
+    err |= jsonbs_object(s);
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "temp");
+    err |= jsonbs_key_lit(s, "u");
+    err |= jsonbs_string_lit(s, "Cel");
+    if (!first && t != 0) {
+      err |= jsonbs_key_lit(s, "t");
+      err |= jsonbs_fixed(s, t, 3);
+    }
+    err |= jsonbs_key_lit(s, "v");
+    err |= jsonbs_number(s, d->temp);
+    err |= jsonbs_object_pop(s);
+  }
+  if (d->mask & SENML_MOV) {
+    err |= jsonbs_object(s);
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "move");
+    if (!first && t != 0) {
+      err |= jsonbs_key_lit(s, "t");
+      err |= jsonbs_fixed(s, t, 3);
+    }
+    err |= jsonbs_key_lit(s, "vb");
+    err |= jsonbs_bool(s, d->mov);
+    err |= jsonbs_object_pop(s);
+  }
+  if (d->mask & SENML_BTN) {
+    err |= jsonbs_object(s);
+    err |= jsonbs_key_lit(s, "n");
+    err |= jsonbs_string_lit(s, "button");
+    if (!first && t != 0) {
+      err |= jsonbs_key_lit(s, "t");
+      err |= jsonbs_fixed(s, t, 3);
+    }
+    err |= jsonbs_key_lit(s, "vb");
+    err |= jsonbs_bool(s, d->btn);
+    err |= jsonbs_object_pop(s);
+  }
+  return err;
+}
+
+/// @brief encodes a pack of the datasets d[0..n-1] of a device (the first
+///        one carries the device records) with the jsonb builder or from
+///        the fragments
+/// @return int (length of the pack; negative on error)
+static int pack(bool fragments, const char *id, const senml_values *d, int n,
+                char *buf) {
+  char loc[SENML_LOC_SIZE];
+  senml_tpl tpl = {NULL, 0, 0};
+  jsonb_sink s;
+  int loclen;
+  int err = 0;
+
+  jsonb_sink_init(&s, buf, PACK_SIZE, NULL, NULL);
+  if (fragments) {
+    loclen = senml_loc_build(loc, lat, lon);
+    if (loclen < 0 || senml_tpl_build(&tpl, urn, id) < 0) {
+      return -1;
+    }
+    err |= jsonb_sink_put(&s, "[", 1);
+    for (int i = 0; i < n; i++) {
+      err |= senml_dataset(&s, &tpl, loc, loclen, &d[i], i == 0, i > 0);
+    }
+    err |= jsonb_sink_put(&s, "]", 1);
+    senml_tpl_free(&tpl);
+  } else {
+    err |= jsonbs_array(&s);
+    for (int i = 0; i < n; i++) {
+      err |= ref_dataset(&s, id, &d[i], i == 0);
+    }
+    err |= jsonbs_array_pop(&s);
+  }
+  if (err < 0) {
+    return -1;
+  }
+  buf[jsonb_sink_length(&s)] = '\0';
+  return (int)jsonb_sink_length(&s);
+}
+
+/// @brief checks that both encodings of a pack are the same
+/// @return
+static void check_pack(const char *id, const senml_values *d, int n) {
+  int a = pack(false, id, d, n, ref);
+  int b = pack(true, id, d, n, out);
+
+  TEST_ASSERT_GREATER_THAN(0, a);
+  TEST_ASSERT_EQUAL_STRING(ref, out);
+  TEST_ASSERT_EQUAL_INT(a, b);
+  return;
+}
+
+/// @brief a dataset of values derived from k
+/// @return senml_values
+static senml_values values(int k, uint8_t mask, int64_t t) {
+  senml_values v;
+
+  v.tm = 1700000000000LL + k * 7 + t;
+  v.t = t;
+  v.mask = mask;
+  v.bat = (uint8_t)(100 - k);
+  v.temp = (int16_t)(k * 13 - 40);
+  v.mov = k & 1;
+  v.btn = (k >> 1) & 1;
+  return v;
+}
+
+void test_first_dataset(void) {
+  for (int mask = 1; mask <= 0x0f; mask++) {
+    senml_values d = values(mask, (uint8_t)mask, 0);
+    check_pack("puck-1", &d, 1);
+  }
+  return;
+}
+
+void test_relative_datasets(void) {
+  // t 0 leaves the relative time out; 1 ms is the smallest one written
+  const int64_t t[] = {0, 1, 10, 999, 1000, 1001, 250001, 86400000};
+
+  for (int m0 = 1; m0 <= 0x0f; m0++) {
+    for (int m1 = 1; m1 <= 0x0f; m1++) {
+      for (size_t k = 0; k < sizeof(t) / sizeof(t[0]); k++) {
+        senml_values d[3];
+
+        d[0] = values((int)k, (uint8_t)m0, 0);
+        d[1] = values((int)k + 1, (uint8_t)m1, t[k]);
+        d[2] = values((int)k + 2, (uint8_t)m0, t[k] * 2 + 3);
+        check_pack("puck-1", d, 3);
+      }
+    }
+  }
+  return;
+}
+
+void test_escaped_ids(void) {
+  const char *id[] = {"",
+                      "puck \"7\"\tlab",
+                      "back\\slash/",
+                      "\x01\x02\x1f ctl\r\n",
+                      "\xc3\xa4\xc3\xb6\xc3\xbc utf-8",
+                      "\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\""
+                      "\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\""
+                      "\""};
+  senml_values d[2];
+
+  d[0] = values(3, 0x0f, 0);
+  d[1] = values(4, 0x0f, 1500);
+  for (size_t k = 0; k < sizeof(id) / sizeof(id[0]); k++) {
+    TEST_ASSERT_LESS_THAN(64, strlen(id[k]));
+    check_pack(id[k], d, 2);
+  }
+  return;
+}
+
+void test_negative_and_extreme_values(void) {
+  const int16_t temp[] = {0, -1, -9, -10, -273, -32768, 32767, 1234};
+  const uint8_t bat[] = {0, 1, 9, 10, 99, 100, 255};
+  senml_values d[2];
+
+  for (size_t k = 0; k < sizeof(temp) / sizeof(temp[0]); k++) {
+    d[0] = values((int)k, 0x0f, 0);
+    d[0].temp = temp[k];
+    d[0].bat = bat[k % (sizeof(bat) / sizeof(bat[0]))];
+    d[1] = d[0];
+    d[1].temp = (int16_t)-temp[k];
+    d[1].t = 7;
+    check_pack("puck-1", d, 2);
+  }
+  // base times around a whole second and before the epoch
+  const int64_t tm[] = {0, 1, 999, 1000, 1700000000000LL, -1, -1001};
+  for (size_t k = 0; k < sizeof(tm) / sizeof(tm[0]); k++) {
+    d[0] = values((int)k, 0x0f, 0);
+    d[0].tm = tm[k];
+    check_pack("puck-1", d, 1);
+  }
+  return;
+}
+
+/// @brief times n packs of two full datasets of each encoding
+/// @return
+void test_bench(void) {
+  const int n = 20000;
+  char loc[SENML_LOC_SIZE];
+  senml_tpl tpl = {NULL, 0, 0};
+  senml_values d[2];
+  uint64_t bytes[2] = {0, 0};
+  clock_t t0, t1, t2;
+
+  d[0] = values(1, 0x0f, 0);
+  d[1] = values(2, 0x0f, 1000);
+  int loclen = senml_loc_build(loc, lat, lon);
+  TEST_ASSERT_EQUAL_INT(0, senml_tpl_build(&tpl, urn, "puck-1"));
+  t0 = clock();
+  for (int i = 0; i < n; i++) {
+    jsonb_sink s;
+
+    jsonb_sink_init(&s, ref, PACK_SIZE, NULL, NULL);
+    jsonbs_array(&s);
+    ref_dataset(&s, "puck-1", &d[0], true);
+    ref_dataset(&s, "puck-1", &d[1], false);
+    jsonbs_array_pop(&s);
+    bytes[0] += jsonb_sink_length(&s);
+  }
+  t1 = clock();
+  for (int i = 0; i < n; i++) {
+    jsonb_sink s;
+
+    jsonb_sink_init(&s, out, PACK_SIZE, NULL, NULL);
+    jsonb_sink_put(&s, "[", 1);
+    senml_dataset(&s, &tpl, loc, loclen, &d[0], 1, 0);
+    senml_dataset(&s, &tpl, loc, loclen, &d[1], 0, 1);
+    jsonb_sink_put(&s, "]", 1);
+    bytes[1] += jsonb_sink_length(&s);
+  }
+  t2 = clock();
+  senml_tpl_free(&tpl);
+  printf("BENCH: jsonb %.3f us/pack, fragments %.3f us/pack (%d packs)\n",
+         (double)(t1 - t0) * 1e6 / CLOCKS_PER_SEC / n,
+         (double)(t2 - t1) * 1e6 / CLOCKS_PER_SEC / n, n);
+  TEST_ASSERT_EQUAL_INT(bytes[0], bytes[1]);
+  return;
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_first_dataset);
+  RUN_TEST(test_relative_datasets);
+  RUN_TEST(test_escaped_ids);
+  RUN_TEST(test_negative_and_extreme_values);
+  RUN_TEST(test_bench);
+  return UNITY_END();
+}
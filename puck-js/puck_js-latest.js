@@ -24,6 +24,7 @@
 const storage = require('Storage');
 
 const SERVICE = "34defd2c-c8fe-b18e-9a70-591970cba32b";
+const FRAME = "34defd2d-c8fe-b18e-9a70-591970cba32b";    // all sensors in one notification (see esp32/src/adv.h)
 
 var CONFIG = {};
 
@@ -117,6 +118,8 @@ function discovered() {
 // Discovery Actions END ---
 
 var bp_payl = 1;
+var bp_count = 0;
+var adv_seq = 0;
 
 var move_timer = 0;
 var move_val_curr = 0;
@@ -126,6 +129,7 @@ var current_movement_timer;
 const EspDownlink = {   // Logic to communicate with ESP32
   characteristics: {},
   advertiseUUIDs: [],
+  name: "",
 
   bindMe: function() {
     let keys = Object.keys(this);
@@ -147,11 +151,23 @@ const EspDownlink = {   // Logic to communicate with ESP32
 
     NRF.setServices(services, { advertise: this.advertiseUUIDs, uart: false });
 
+    this.name = name;
+    this.advertiseFrame(this.sensorFrame());
+  },
+  sensorFrame: function() {    // Sensor frame: version, sequence number, battery, temperature, state, button presses
+    adv_seq = (adv_seq + 1) & 0xFF;
+
+    let mov = this.characteristics[BleNumbers.movement];
+    let state = (mov && mov.value === 1 ? 0x01 : 0) | (bp_payl ? 0 : 0x02);    // bp_payl holds the next button value
+
+    return [1, adv_seq, Puck.getBatteryPercentage(), Math.round(E.getTemperature()) & 0xFF, state, bp_count & 0xFF];
+  },
+  advertiseFrame: function(frame) {    // Sensor frame for the advertisement mode of the ESP32
     NRF.setAdvertising({}, {
-      "name": name,
+      "name": this.name,
       "showName": true,
       "manufacturer": 0x0590,
-      "manufacturerData": JSON.stringify({})
+      "manufacturerData": frame
     });
   },
   __charUpdate: function() {
@@ -178,7 +194,13 @@ const EspDownlink = {   // Logic to communicate with ESP32
   updateCharacteristic: function(uuid, data) {
     this.characteristics[uuid] = data;
   },
-  triggerUpdate: function() { this.__charUpdate(); }
+  triggerUpdate: function() {
+    let frame = this.sensorFrame();
+
+    this.updateCharacteristic(FRAME, { "value": frame, "notify": true });    // the ESP32 subscribes to either the frame or the four sensors
+    this.__charUpdate();
+    if(this.name !== "") { this.advertiseFrame(frame); }
+  }
 };
 
 EspDownlink.bindMe()
@@ -222,6 +244,7 @@ function updateCharacteristics(buttonPressed) {
       digitalWrite(LED1, bp_payl);    // visual feedback
 
       bp_payl = !bp_payl;
+      bp_count++;
   }
 
   sensors.forEach(e => {    // Update all sensors
@@ -297,7 +320,8 @@ function executor() {
   if(config === false) { return; }
   if(config) { CONFIG = config; }
 
-  let sendableData = `i=${CONFIG.id};e=${CONFIG.api}`;
+  // "c=" asks the gateway to post SenML-CBOR ("format": "cbor" in main.json)
+  let sendableData = `i=${CONFIG.id};${CONFIG.format === "cbor" ? "c" : "e"}=${CONFIG.api}`;
 
   EspDownlink.addCharacteristic(SERVICE, {    // Add config characteristic
     "value": sendableData,
@@ -310,6 +334,13 @@ function executor() {
     EspDownlink.addCharacteristic(BleNumbers[e], BleInit);
   });
 
+  EspDownlink.updateCharacteristic(FRAME, {    // Add the frame characteristic (all sensors, not advertised)
+    "value": [0, 0, 0, 0, 0, 0],
+    "readable": true,
+    "writable": false,
+    "notify": true
+  });
+
   setTimeout(() => {
     watchButton();
 